@@ -0,0 +1,281 @@
+/**
+ * @file AdaptiveIndex.h
+ *
+ * @breif A facade that picks the cheapest lookup engine (learned index, sorted array or BTree) per dataset
+ *
+ * @date 1/07/2018
+ * @author Ben Caine
+ */
+
+#ifndef LEARNED_INDICES_ADAPTIVEINDEX_H
+#define LEARNED_INDICES_ADAPTIVEINDEX_H
+
+#include "RecursiveModelIndex.h"
+#include "../external/cpp-btree/btree_map.h"
+#include <boost/optional.hpp>
+#include <chrono>
+#include <limits>
+#include <random>
+
+/**
+ * @brief Stores data in a RecursiveModelIndex, but serves lookups from whichever engine measured fastest
+ *
+ * On every retrain, a sample of the trained keys is looked up through each candidate engine and
+ * the cheapest one is kept. The alternative engines never copy the values: the sorted array is the
+ * learned index's own distinct keys, and the BTree maps keys to positions in its data.
+ *
+ * @tparam KeyType: The key type of our index
+ * @tparam ValueType: The value we are storing
+ * @tparam secondStageSize: The size of the second stage of the learned index
+ */
+template <typename KeyType, typename ValueType, int secondStageSize>
+class AdaptiveIndex {
+public:
+
+    /**
+     * @brief The lookup engines we choose between
+     */
+    enum class Engine {
+        LearnedIndex,   ///< The recursive model index (with its own interpolation fallback)
+        SortedArray,    ///< Binary search over the sorted distinct keys
+        BTree           ///< A btree_map from key to position in the sorted data
+    };
+
+    /**
+     * @brief Create an adaptive index
+     * @param firstStageParams [in]: The first layer network parameters
+     * @param secondStageParams [in]: The second stage network parameters
+     * @param maxSecondStageError [in]: The max second stage error allowed before replacing with BTree
+     * @param maxOverflowSize [in]: The max size our overflow array can get to before we force a retrain
+     * @param sampleSize [in]: How many keys to time each engine on when choosing
+     * @param considerBTree [in]: Whether to build a BTree as a candidate (costs memory while measuring)
+     */
+    explicit AdaptiveIndex(const NetworkParameters &firstStageParams,
+                           const NetworkParameters &secondStageParams,
+                           int maxSecondStageError = 256,
+                           int maxOverflowSize = 10000,
+                           size_t sampleSize = 1000,
+                           bool considerBTree = true);
+
+    /**
+     * @brief Insert into our index new data
+     * @param key [in]: The key to insert
+     * @param value [in]: The value to insert
+     */
+    void insert(KeyType key, ValueType value);
+
+    /**
+     * @brief Find a specific item with the currently selected engine
+     * @param key [in]: A key to search for
+     * @return A pair of (key, value) if found.
+     */
+    boost::optional<std::pair<KeyType, ValueType>> find(KeyType key);
+
+    /**
+     * @brief Train the learned index and choose the engine for the new data
+     */
+    void train();
+
+    /**
+     * @return The engine currently serving lookups
+     */
+    Engine getEngine() const {
+        return m_engine;
+    }
+
+    /**
+     * @return The underlying learned index
+     */
+    RecursiveModelIndex<KeyType, ValueType, secondStageSize> &getLearnedIndex() {
+        return m_learnedIndex;
+    }
+
+private:
+
+    /**
+     * @brief Time every candidate engine on a sample of the trained keys and keep the cheapest
+     */
+    void selectEngine();
+
+    /**
+     * @brief Time a lookup function over the sample keys
+     * @param sample [in]: Keys to look up
+     * @param lookup [in]: Lookup function returning whether the key was found
+     * @return Total seconds taken, or the max double if a sampled key wasn't found
+     */
+    template <typename LookupFunc>
+    double timeLookups(const std::vector<KeyType> &sample, LookupFunc lookup);
+
+    /**
+     * @brief Find a key in the trained data with binary search
+     * @return The position of the first element with this key, or trainedSize()
+     */
+    size_t sortedArrayFind(KeyType key) const;
+
+    /**
+     * @brief Find a key in the trained data through the BTree
+     * @return The position of the first element with this key, or trainedSize()
+     */
+    size_t btreeFind(KeyType key) const;
+
+    ///------------ Data members ----------------
+    RecursiveModelIndex<KeyType, ValueType, secondStageSize> m_learnedIndex;  ///< Owns the data and the models
+    btree::btree_map<KeyType, size_t> m_tree;                                 ///< Key to position, only kept when selected
+
+    Engine m_engine;                                                           ///< Engine serving lookups
+    size_t m_sampleSize;                                                       ///< Keys timed per engine
+    bool m_considerBTree;                                                      ///< Whether the BTree is a candidate
+    size_t m_selectedGeneration;                                               ///< Training generation m_engine was chosen for
+};
+
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+AdaptiveIndex<KeyType, ValueType, secondStageSize>::AdaptiveIndex(const NetworkParameters &firstStageParams,
+                                                                  const NetworkParameters &secondStageParams,
+                                                                  int maxSecondStageError,
+                                                                  int maxOverflowSize,
+                                                                  size_t sampleSize,
+                                                                  bool considerBTree):
+    m_learnedIndex(firstStageParams, secondStageParams, maxSecondStageError, maxOverflowSize),
+    m_engine(Engine::LearnedIndex), m_sampleSize(sampleSize), m_considerBTree(considerBTree),
+    m_selectedGeneration(0)
+{
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+void AdaptiveIndex<KeyType, ValueType, secondStageSize>::insert(KeyType key, ValueType value) {
+    m_learnedIndex.insert(key, value);
+
+    // The insert may have triggered a retrain, in which case the positions the engines use moved
+    if (m_learnedIndex.getTrainingGeneration() != m_selectedGeneration) {
+        selectEngine();
+    }
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+boost::optional<std::pair<KeyType, ValueType>> AdaptiveIndex<KeyType, ValueType, secondStageSize>::find(KeyType key) {
+    if (m_engine == Engine::LearnedIndex) {
+        return m_learnedIndex.find(key);
+    }
+
+    auto pendingResult = m_learnedIndex.findPending(key);
+    if (pendingResult) {
+        return pendingResult;
+    }
+
+    size_t position = m_engine == Engine::BTree ? btreeFind(key) : sortedArrayFind(key);
+    if (position < m_learnedIndex.trainedSize()) {
+        return std::pair<KeyType, ValueType>(m_learnedIndex.keyAt(position), m_learnedIndex.valueAt(position));
+    }
+    return {};
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+void AdaptiveIndex<KeyType, ValueType, secondStageSize>::train() {
+    m_learnedIndex.train();
+    selectEngine();
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+void AdaptiveIndex<KeyType, ValueType, secondStageSize>::selectEngine() {
+    m_selectedGeneration = m_learnedIndex.getTrainingGeneration();
+    m_tree.clear();
+
+    const size_t trainedSize = m_learnedIndex.trainedSize();
+    if (trainedSize == 0) {
+        m_engine = Engine::LearnedIndex;
+        return;
+    }
+
+    // Sample keys that are actually present, that's the common case we optimize for
+    std::mt19937 rng(static_cast<unsigned int>(trainedSize));
+    std::uniform_int_distribution<size_t> distribution(0, trainedSize - 1);
+    std::vector<KeyType> sample;
+    sample.reserve(m_sampleSize);
+    for (size_t ii = 0; ii < m_sampleSize; ++ii) {
+        sample.push_back(m_learnedIndex.keyAt(distribution(rng)));
+    }
+
+    double learnedTime = timeLookups(sample, [&](KeyType key) {
+        return static_cast<bool>(m_learnedIndex.find(key));
+    });
+    double sortedArrayTime = timeLookups(sample, [&](KeyType key) {
+        return sortedArrayFind(key) < trainedSize;
+    });
+
+    m_engine = learnedTime <= sortedArrayTime ? Engine::LearnedIndex : Engine::SortedArray;
+    double bestTime = std::min(learnedTime, sortedArrayTime);
+
+    if (m_considerBTree) {
+        for (size_t ii = 0; ii < m_learnedIndex.distinctSize(); ++ii) {
+            m_tree.insert({m_learnedIndex.distinctKeyAt(ii), m_learnedIndex.runAt(ii).first});
+        }
+
+        double btreeTime = timeLookups(sample, [&](KeyType key) {
+            return btreeFind(key) < trainedSize;
+        });
+
+        if (btreeTime < bestTime) {
+            m_engine = Engine::BTree;
+            bestTime = btreeTime;
+        } else {
+            m_tree.clear();
+        }
+    }
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+template <typename LookupFunc>
+double AdaptiveIndex<KeyType, ValueType, secondStageSize>::timeLookups(const std::vector<KeyType> &sample,
+                                                                       LookupFunc lookup) {
+    // One untimed pass so every engine is measured with warm caches
+    size_t found = 0;
+    for (const auto &key : sample) {
+        found += lookup(key);
+    }
+
+    auto startTime = std::chrono::high_resolution_clock::now();
+    for (const auto &key : sample) {
+        found += lookup(key);
+    }
+    auto endTime = std::chrono::high_resolution_clock::now();
+
+    // Every sampled key is trained, so an engine that misses one is broken, never pick it
+    if (found != 2 * sample.size()) {
+        std::cerr << "Lookup engine missed " << 2 * sample.size() - found << " sampled keys" << std::endl;
+        return std::numeric_limits<double>::max();
+    }
+
+    std::chrono::duration<double> duration = endTime - startTime;
+    return duration.count();
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+size_t AdaptiveIndex<KeyType, ValueType, secondStageSize>::sortedArrayFind(KeyType key) const {
+    size_t first = 0;
+    size_t last = m_learnedIndex.distinctSize();
+    while (first < last) {
+        size_t middle = first + (last - first) / 2;
+        if (m_learnedIndex.distinctKeyAt(middle) < key) {
+            first = middle + 1;
+        } else {
+            last = middle;
+        }
+    }
+
+    if (first < m_learnedIndex.distinctSize() && m_learnedIndex.distinctKeyAt(first) == key) {
+        return m_learnedIndex.runAt(first).first;
+    }
+    return m_learnedIndex.trainedSize();
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+size_t AdaptiveIndex<KeyType, ValueType, secondStageSize>::btreeFind(KeyType key) const {
+    auto result = m_tree.find(key);
+    if (result != m_tree.end()) {
+        return result->second;
+    }
+    return m_learnedIndex.trainedSize();
+}
+
+#endif //LEARNED_INDICES_ADAPTIVEINDEX_H
@@ -0,0 +1,257 @@
+/**
+ * @file CompositeRecursiveModelIndex.h
+ *
+ * @breif A Recursive Model Index over two column (leading, trailing) keys
+ *
+ * @date 1/07/2018
+ * @author Ben Caine
+ */
+
+#ifndef LEARNED_INDICES_COMPOSITERECURSIVEMODELINDEX_H
+#define LEARNED_INDICES_COMPOSITERECURSIVEMODELINDEX_H
+
+#include "RecursiveModelIndex.h"
+#include "utils/KeyEncoding.h"
+#include "utils/LinearModel.h"
+#include <boost/optional.hpp>
+#include <limits>
+#include <memory>
+
+/**
+ * @brief A two column key, ordered lexicographically
+ */
+template <typename LeadingKeyType, typename TrailingKeyType>
+struct CompositeKey {
+    LeadingKeyType leading;     ///< First column, e.g. a tenant id
+    TrailingKeyType trailing;   ///< Second column, e.g. a timestamp
+
+    bool operator<(const CompositeKey &other) const {
+        return leading < other.leading || (leading == other.leading && trailing < other.trailing);
+    }
+
+    bool operator==(const CompositeKey &other) const {
+        return leading == other.leading && trailing == other.trailing;
+    }
+};
+
+/**
+ * @brief A learned index over (leading, trailing) composite keys
+ *
+ * Packing both columns into one wide integer gives a CDF made of steep steps, one per leading
+ * value, which no single model fits. Instead the root is a RecursiveModelIndex over the leading
+ * column only, whose runs of duplicates are exactly the leading column groups. Each group then
+ * has its own linear model of the trailing column, and the last mile search compares trailing
+ * keys inside the group only.
+ *
+ * @tparam LeadingKeyType: The first key column
+ * @tparam TrailingKeyType: The second key column
+ * @tparam ValueType: The value we are storing
+ * @tparam secondStageSize: The size of the second stage of the leading column index
+ */
+template <typename LeadingKeyType, typename TrailingKeyType, typename ValueType, int secondStageSize>
+class CompositeRecursiveModelIndex {
+public:
+
+    typedef CompositeKey<LeadingKeyType, TrailingKeyType> KeyType;
+    typedef KeyEncoding<TrailingKeyType> TrailingEncoding;
+
+    /**
+     * @brief Create a composite RMI
+     * @param firstStageParams [in]: The first layer network parameters of the leading column index
+     * @param secondStageParams [in]: The second stage network parameters of the leading column index
+     * @param maxSecondStageError [in]: The max second stage error allowed before replacing with BTree
+     * @param maxOverflowSize [in]: The max number of untrained inserts before we force a retrain
+     */
+    explicit CompositeRecursiveModelIndex(const NetworkParameters &firstStageParams,
+                                          const NetworkParameters &secondStageParams,
+                                          int maxSecondStageError = 256,
+                                          int maxOverflowSize = 10000);
+
+    /**
+     * @brief Insert into our index new data
+     * @param leading [in]: The leading key column
+     * @param trailing [in]: The trailing key column
+     * @param value [in]: The value to insert
+     */
+    void insert(LeadingKeyType leading, TrailingKeyType trailing, ValueType value);
+
+    /**
+     * @brief Find a specific item
+     * @return A pair of (key, value) if found.
+     */
+    boost::optional<std::pair<KeyType, ValueType>> find(LeadingKeyType leading, TrailingKeyType trailing);
+
+    /**
+     * @brief Find every item of one leading key with a trailing key in [trailingLow, trailingHigh]
+     * @return The matching (key, value) pairs in key order
+     */
+    std::vector<std::pair<KeyType, ValueType>> findRange(LeadingKeyType leading, TrailingKeyType trailingLow,
+                                                         TrailingKeyType trailingHigh);
+
+    /**
+     * @brief Sort the rows and train the leading column index and the per group models
+     */
+    void train();
+
+private:
+
+    /**
+     * @brief Find the rows of a leading key group
+     * @return The distinct leading key position, or none if the group doesn't exist
+     */
+    boost::optional<size_t> findGroup(LeadingKeyType leading);
+
+    /**
+     * @brief Lower bound of a trailing key inside a group, using the group's model
+     * @return The row of the first key in the group with trailing key not less than trailing
+     */
+    size_t trailingLowerBound(size_t group, TrailingKeyType trailing) const;
+
+    ///------------ Data members ----------------
+    NetworkParameters m_firstStageParams;                              ///< First stage network parameters
+    NetworkParameters m_secondStageParams;                             ///< Our second stage network parameters
+    int m_maxSecondStageError;                                         ///< Max second stage error before replacing with btree
+    int m_maxOverflowSize;                                             ///< Max untrained inserts before retraining
+
+    std::vector<std::pair<KeyType, ValueType>> m_data;                 ///< Trained rows, in key order
+    std::vector<typename TrailingEncoding::EncodedType> m_trailingKeys;///< Encoded trailing column of m_data
+    std::vector<LinearModel> m_groupModels;                            ///< Trailing column model per leading key group
+    std::unique_ptr<RecursiveModelIndex<LeadingKeyType, uint32_t, secondStageSize>> m_leadingIndex;  ///< Leading key to group
+    std::vector<std::pair<KeyType, ValueType>> m_overflowArray;        ///< Inserts since the last train
+};
+
+
+template <typename LeadingKeyType, typename TrailingKeyType, typename ValueType, int secondStageSize>
+CompositeRecursiveModelIndex<LeadingKeyType, TrailingKeyType, ValueType, secondStageSize>::CompositeRecursiveModelIndex(
+        const NetworkParameters &firstStageParams,
+        const NetworkParameters &secondStageParams,
+        int maxSecondStageError,
+        int maxOverflowSize):
+    m_firstStageParams(firstStageParams), m_secondStageParams(secondStageParams),
+    m_maxSecondStageError(maxSecondStageError), m_maxOverflowSize(maxOverflowSize)
+{
+}
+
+template <typename LeadingKeyType, typename TrailingKeyType, typename ValueType, int secondStageSize>
+void CompositeRecursiveModelIndex<LeadingKeyType, TrailingKeyType, ValueType, secondStageSize>::insert(
+        LeadingKeyType leading, TrailingKeyType trailing, ValueType value) {
+    m_overflowArray.push_back({KeyType{leading, trailing}, value});
+
+    if (m_overflowArray.size() > static_cast<size_t>(m_maxOverflowSize)) {
+        train();
+    }
+}
+
+template <typename LeadingKeyType, typename TrailingKeyType, typename ValueType, int secondStageSize>
+boost::optional<std::pair<CompositeKey<LeadingKeyType, TrailingKeyType>, ValueType>>
+CompositeRecursiveModelIndex<LeadingKeyType, TrailingKeyType, ValueType, secondStageSize>::find(LeadingKeyType leading,
+                                                                                               TrailingKeyType trailing) {
+    const KeyType key{leading, trailing};
+    for (const auto &pair : m_overflowArray) {
+        if (pair.first == key) {
+            return pair;
+        }
+    }
+
+    auto group = findGroup(leading);
+    if (!group) {
+        return {};
+    }
+
+    size_t row = trailingLowerBound(group.get(), trailing);
+    auto run = m_leadingIndex->runAt(group.get());
+    if (row < run.first + run.second && m_data[row].first.trailing == trailing) {
+        return m_data[row];
+    }
+    return {};
+}
+
+template <typename LeadingKeyType, typename TrailingKeyType, typename ValueType, int secondStageSize>
+std::vector<std::pair<CompositeKey<LeadingKeyType, TrailingKeyType>, ValueType>>
+CompositeRecursiveModelIndex<LeadingKeyType, TrailingKeyType, ValueType, secondStageSize>::findRange(
+        LeadingKeyType leading, TrailingKeyType trailingLow, TrailingKeyType trailingHigh) {
+    std::vector<std::pair<KeyType, ValueType>> result;
+
+    auto group = findGroup(leading);
+    if (group) {
+        auto run = m_leadingIndex->runAt(group.get());
+        for (size_t row = trailingLowerBound(group.get(), trailingLow);
+             row < run.first + run.second && !(trailingHigh < m_data[row].first.trailing); ++row) {
+            result.push_back(m_data[row]);
+        }
+    }
+
+    for (const auto &pair : m_overflowArray) {
+        if (pair.first.leading == leading && !(pair.first.trailing < trailingLow) && !(trailingHigh < pair.first.trailing)) {
+            result.push_back(pair);
+        }
+    }
+
+    std::stable_sort(result.begin(), result.end(), [](const std::pair<KeyType, ValueType> &p1,
+                                                      const std::pair<KeyType, ValueType> &p2) {
+        return p1.first < p2.first;
+    });
+    return result;
+}
+
+template <typename LeadingKeyType, typename TrailingKeyType, typename ValueType, int secondStageSize>
+void CompositeRecursiveModelIndex<LeadingKeyType, TrailingKeyType, ValueType, secondStageSize>::train() {
+    m_data.insert(m_data.end(), m_overflowArray.begin(), m_overflowArray.end());
+    m_overflowArray.clear();
+
+    std::sort(m_data.begin(), m_data.end(), [](const std::pair<KeyType, ValueType> &p1,
+                                               const std::pair<KeyType, ValueType> &p2) {
+        return p1.first < p2.first;
+    });
+
+    m_trailingKeys.clear();
+    m_trailingKeys.reserve(m_data.size());
+    std::vector<std::pair<LeadingKeyType, uint32_t>> leadingKeys;
+    leadingKeys.reserve(m_data.size());
+    for (size_t row = 0; row < m_data.size(); ++row) {
+        m_trailingKeys.push_back(TrailingEncoding::encode(m_data[row].first.trailing));
+        leadingKeys.push_back({m_data[row].first.leading, static_cast<uint32_t>(row)});
+    }
+
+    // Rows are sorted by leading key first, so each run of the leading index is one group of rows
+    m_leadingIndex.reset(new RecursiveModelIndex<LeadingKeyType, uint32_t, secondStageSize>(
+            m_firstStageParams, m_secondStageParams, m_maxSecondStageError, std::numeric_limits<int>::max()));
+    m_leadingIndex->load(leadingKeys);
+    m_leadingIndex->train();
+
+    m_groupModels.assign(m_leadingIndex->distinctSize(), LinearModel());
+    for (size_t group = 0; group < m_groupModels.size(); ++group) {
+        auto run = m_leadingIndex->runAt(group);
+        TrailingKeyType origin = m_data[run.first].first.trailing;
+        m_groupModels[group].fit(m_trailingKeys.begin() + run.first, m_trailingKeys.begin() + run.first + run.second,
+                                 [origin](typename TrailingEncoding::EncodedType encoded) {
+                                     return TrailingEncoding::toModelInput(TrailingEncoding::decode(encoded), origin);
+                                 });
+    }
+}
+
+template <typename LeadingKeyType, typename TrailingKeyType, typename ValueType, int secondStageSize>
+boost::optional<size_t> CompositeRecursiveModelIndex<LeadingKeyType, TrailingKeyType, ValueType, secondStageSize>::findGroup(
+        LeadingKeyType leading) {
+    if (!m_leadingIndex) {
+        return {};
+    }
+
+    size_t group = m_leadingIndex->lowerBound(leading);
+    if (group == m_leadingIndex->distinctSize() || m_leadingIndex->distinctKeyAt(group) != leading) {
+        return {};
+    }
+    return group;
+}
+
+template <typename LeadingKeyType, typename TrailingKeyType, typename ValueType, int secondStageSize>
+size_t CompositeRecursiveModelIndex<LeadingKeyType, TrailingKeyType, ValueType, secondStageSize>::trailingLowerBound(
+        size_t group, TrailingKeyType trailing) const {
+    auto run = m_leadingIndex->runAt(group);
+    TrailingKeyType origin = m_data[run.first].first.trailing;
+    return run.first + m_groupModels[group].lowerBound(m_trailingKeys.data() + run.first, run.second,
+                                                       TrailingEncoding::toModelInput(trailing, origin),
+                                                       TrailingEncoding::encode(trailing));
+}
+
+#endif //LEARNED_INDICES_COMPOSITERECURSIVEMODELINDEX_H
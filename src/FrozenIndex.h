@@ -0,0 +1,749 @@
+/**
+ * @file FrozenIndex.h
+ *
+ * @breif A read only, position independent snapshot of a trained index, shareable between processes
+ *
+ * @date 1/07/2018
+ * @author Ben Caine
+ */
+
+#ifndef LEARNED_INDICES_FROZENINDEX_H
+#define LEARNED_INDICES_FROZENINDEX_H
+
+#include "RecursiveModelIndex.h"
+#include "utils/AccessStatistics.h"
+#include "utils/KeyEncoding.h"
+#include "utils/LinearModel.h"
+#include "utils/SearchUtils.h"
+#include <boost/optional.hpp>
+#include <atomic>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
+
+/**
+ * @brief A trained index frozen into one flat block of memory
+ *
+ * The block holds a header, the leaf boundary keys, one linear model per leaf, the distinct keys,
+ * their runs and the values, each section located by an offset from the start of the block. Nothing
+ * in it is a pointer, so it can be written to a file or a POSIX shared memory segment once and
+ * mapped read only by any number of processes, at any address, with no training or parsing.
+ *
+ * Routing is a search of the boundary keys (the same monotone split as RoutingMode::BoundaryTable)
+ * and each leaf is a closed form linear fit of its keys, so no network is needed to serve lookups.
+ * Leaves are used in place, so attaching costs the same however many there are, and a leaf's
+ * pages are only faulted in when a lookup first touches it (or by prefaultInBackground()).
+ *
+ * @tparam KeyType: The key type of the index
+ * @tparam ValueType: The value type, stored by copy so it must be trivially copyable
+ */
+template <typename KeyType, typename ValueType>
+class FrozenIndex {
+    static_assert(std::is_trivially_copyable<ValueType>::value, "Frozen values are copied byte for byte");
+
+public:
+
+    typedef KeyEncoding<KeyType> Encoding;
+    typedef typename Encoding::EncodedType EncodedKeyType;
+    typedef typename AccessStatistics<KeyType>::Range KeyRange;
+
+    /**
+     * @brief What warmup() brings into memory and how
+     */
+    struct WarmupPolicy {
+        bool models;                                        ///< Touch the boundary keys and leaf models
+        bool allKeys;                                       ///< Touch the whole key column
+        std::vector<KeyRange> hotRanges;                    ///< Key ranges whose keys, runs and values are touched
+        unsigned numThreads;                                ///< Threads touching pages
+        std::function<void(size_t, size_t)> onProgress;     ///< Called with (bytes done, bytes total), one call at a time
+
+        WarmupPolicy(): models(true), allKeys(false), numThreads(1) {}
+    };
+
+    FrozenIndex(): m_base(nullptr), m_size(0), m_mapped(false), m_statistics(nullptr), m_stopPrefault(false) {}
+    ~FrozenIndex() {
+        detach();
+    }
+
+    FrozenIndex(const FrozenIndex &) = delete;
+    FrozenIndex &operator=(const FrozenIndex &) = delete;
+
+    FrozenIndex(FrozenIndex &&other): m_base(nullptr), m_size(0), m_mapped(false), m_statistics(nullptr),
+                                      m_stopPrefault(false) {
+        *this = std::move(other);
+    }
+
+    FrozenIndex &operator=(FrozenIndex &&other) {
+        if (this != &other) {
+            detach();
+            other.stopPrefault();
+            m_buffer.swap(other.m_buffer);
+            m_base = other.m_base;
+            m_size = other.m_size;
+            m_mapped = other.m_mapped;
+            m_statistics = other.m_statistics;
+            other.m_base = nullptr;
+            other.m_size = 0;
+            other.m_mapped = false;
+            other.m_statistics = nullptr;
+        }
+        return *this;
+    }
+
+    /**
+     * @brief Freeze the trained data of an index into a block (pending inserts are not included)
+     * @param index [in]: A trained index
+     * @return The frozen block, ready to be written out or used in place with attachBuffer()
+     */
+    template <int secondStageSize>
+    static std::vector<char> freeze(RecursiveModelIndex<KeyType, ValueType, secondStageSize> &index);
+
+    /**
+     * @brief Freeze an index and write it to a file
+     * @return Whether the file was written
+     */
+    template <int secondStageSize>
+    static bool publishFile(RecursiveModelIndex<KeyType, ValueType, secondStageSize> &index, const std::string &path);
+
+    /**
+     * @brief Freeze an index into a POSIX shared memory segment (replacing any segment of that name)
+     * @param name [in]: Segment name, e.g. "/orders_index"
+     * @return Whether the segment was written
+     */
+    template <int secondStageSize>
+    static bool publishShared(RecursiveModelIndex<KeyType, ValueType, secondStageSize> &index, const std::string &name);
+
+    /**
+     * @brief Use a frozen block owned by this object
+     * @return Whether the block is a valid frozen index for these key and value types
+     */
+    bool attachBuffer(std::vector<char> &&buffer);
+
+    /**
+     * @brief Map a frozen index file read only
+     * @return Whether the file was mapped and is a valid frozen index for these key and value types
+     */
+    bool attachFile(const std::string &path);
+
+    /**
+     * @brief Map a shared memory segment written by publishShared() read only
+     * @return Whether the segment was mapped and is a valid frozen index for these key and value types
+     */
+    bool attachShared(const std::string &name);
+
+    /**
+     * @brief Release the block or mapping (stopping any prefault in progress)
+     */
+    void detach();
+
+    /**
+     * @brief Touch every page of the block on a background thread, routing and leaf models first
+     *
+     * Lookups work throughout, they just stop paying page faults on parts the thread already
+     * reached. The thread stops early on detach().
+     */
+    void prefaultInBackground();
+
+    /**
+     * @brief Bring parts of the block into memory before serving, e.g. before joining a load balancer
+     *
+     * Mapped ranges are first passed to madvise(MADV_WILLNEED) so the kernel reads them ahead, then
+     * policy.numThreads threads touch every page, models first and then the hot ranges in order.
+     *
+     * @return Bytes touched
+     */
+    size_t warmup(const WarmupPolicy &policy);
+
+    /**
+     * @brief Count which key ranges findRef() and find() land in, until called again with nullptr
+     * @param statistics [in]: Statistics to record into (reset for this index), must outlive the recording
+     */
+    void recordAccesses(AccessStatistics<KeyType> *statistics) {
+        m_statistics = statistics;
+        if (m_statistics) {
+            m_statistics->reset(distinctSize());
+        }
+    }
+
+    /**
+     * @brief The most looked up key ranges recorded into statistics by this index
+     */
+    std::vector<KeyRange> hottestRanges(const AccessStatistics<KeyType> &statistics, size_t count) const {
+        const EncodedKeyType *keys = m_base ? section<EncodedKeyType>(header().keysOffset) : nullptr;
+        return statistics.hottest(count, [keys](size_t position) {
+            return Encoding::decode(keys[position]);
+        });
+    }
+
+    /**
+     * @return Whether a frozen index is attached
+     */
+    bool isAttached() const {
+        return m_base != nullptr;
+    }
+
+    /**
+     * @brief Find a specific item
+     * @return A pair of (key, value) if found.
+     */
+    boost::optional<std::pair<KeyType, ValueType>> find(KeyType key) const {
+        const ValueType *value = findRef(key);
+        if (value) {
+            return std::pair<KeyType, ValueType>(key, *value);
+        }
+        return {};
+    }
+
+    /**
+     * @brief Find a specific item without copying its value
+     * @return A pointer into the frozen block, or nullptr
+     */
+    const ValueType *findRef(KeyType key) const;
+
+    /**
+     * @return Position of the first distinct key not less than key, or distinctSize()
+     */
+    size_t lowerBound(KeyType key) const;
+
+    /**
+     * @return The number of distinct keys
+     */
+    size_t distinctSize() const {
+        return m_base ? header().numKeys : 0;
+    }
+
+    /**
+     * @return The number of (key, value) rows
+     */
+    size_t size() const {
+        return m_base ? header().numRows : 0;
+    }
+
+    /**
+     * @return The size of the frozen block in bytes
+     */
+    size_t sizeInBytes() const {
+        return m_size;
+    }
+
+private:
+
+    static const uint32_t formatVersion = 1;
+
+    /**
+     * @brief Start of the block, every offset is relative to it
+     */
+    struct Header {
+        char magic[8];              ///< "LIDXFRZN"
+        uint32_t version;           ///< formatVersion
+        uint32_t keySize;           ///< sizeof(EncodedKeyType)
+        uint32_t keyIsFloating;     ///< Whether keys use the floating point encoding
+        uint32_t valueSize;         ///< sizeof(ValueType)
+        uint64_t numLeaves;         ///< Number of leaves
+        uint64_t numKeys;           ///< Number of distinct keys
+        uint64_t numRows;           ///< Number of rows
+        uint64_t boundariesOffset;  ///< EncodedKeyType[numLeaves - 1], largest key of each leaf but the last
+        uint64_t leavesOffset;      ///< Leaf[numLeaves]
+        uint64_t keysOffset;        ///< EncodedKeyType[numKeys], sorted distinct keys
+        uint64_t runStartsOffset;   ///< uint64_t[numKeys + 1], first row of each distinct key plus the end
+        uint64_t valuesOffset;      ///< ValueType[numRows], in key order
+        uint64_t totalSize;         ///< Size of the whole block
+    };
+
+    /**
+     * @brief The linear model of one leaf, over model inputs relative to the leaf's first key
+     */
+    struct Leaf {
+        uint64_t start;             ///< First distinct key position of the leaf
+        uint64_t end;               ///< One past the last distinct key position of the leaf
+        float slope;                ///< Positions per unit of model input
+        float intercept;            ///< Position (relative to start) at the leaf's first key
+        int32_t maxNegativeError;   ///< Max error (negative) of a prediction
+        int32_t maxPositiveError;   ///< Max error (positive) of a prediction
+    };
+
+    const Header &header() const {
+        return *reinterpret_cast<const Header *>(m_base);
+    }
+
+    template <typename T>
+    const T *section(uint64_t offset) const {
+        return reinterpret_cast<const T *>(m_base + offset);
+    }
+
+    /**
+     * @brief The header, with section offsets, of a block holding these counts
+     */
+    static Header layout(size_t numLeaves, size_t numKeys, size_t numRows);
+
+    /**
+     * @brief Write the frozen form of an index into a zeroed block laid out by header
+     */
+    template <int secondStageSize>
+    static void freezeInto(RecursiveModelIndex<KeyType, ValueType, secondStageSize> &index,
+                           const std::vector<size_t> &leafStarts, const Header &header, char *block);
+
+    /**
+     * @brief Size a file or shared memory descriptor for an index and freeze it into a mapping of it
+     * @return Whether the descriptor could be sized and mapped
+     */
+    template <int secondStageSize>
+    static bool freezeToDescriptor(RecursiveModelIndex<KeyType, ValueType, secondStageSize> &index, int fd);
+
+    /**
+     * @brief Round a section offset up so every section is aligned for any of our types
+     */
+    static uint64_t alignOffset(uint64_t offset) {
+        return (offset + 63) & ~static_cast<uint64_t>(63);
+    }
+
+    /**
+     * @brief Check the header of the attached block matches these types, and its sections fit the block
+     */
+    bool validate();
+
+    /**
+     * @brief Map a file descriptor read only
+     */
+    bool mapDescriptor(int fd);
+
+    /**
+     * @brief Stop and join the prefault thread, if running
+     */
+    void stopPrefault();
+
+    /**
+     * @brief Read one byte of every page of [first, last) from base, stopping early if stop is set
+     * @return Bytes covered
+     */
+    static size_t touchPages(const char *base, uint64_t first, uint64_t last, const std::atomic<bool> *stop = nullptr);
+
+    ///------------ Data members ----------------
+    std::vector<char> m_buffer;                 ///< Owned block, when attached from a buffer
+    const char *m_base;                         ///< Start of the block
+    size_t m_size;                              ///< Size of the block
+    bool m_mapped;                              ///< Whether m_base is an mmap to unmap on detach
+    AccessStatistics<KeyType> *m_statistics;    ///< Where lookups are counted, if recording
+    std::thread m_prefaultThread;               ///< Background thread touching the block's pages, if started
+    std::atomic<bool> m_stopPrefault;           ///< Set to make m_prefaultThread return early
+};
+
+template <typename KeyType, typename ValueType>
+const uint32_t FrozenIndex<KeyType, ValueType>::formatVersion;
+
+
+template <typename KeyType, typename ValueType>
+typename FrozenIndex<KeyType, ValueType>::Header FrozenIndex<KeyType, ValueType>::layout(size_t numLeaves, size_t numKeys,
+                                                                                        size_t numRows) {
+    Header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "LIDXFRZN", sizeof(header.magic));
+    header.version = formatVersion;
+    header.keySize = sizeof(EncodedKeyType);
+    header.keyIsFloating = std::is_floating_point<KeyType>::value;
+    header.valueSize = sizeof(ValueType);
+    header.numLeaves = numLeaves;
+    header.numKeys = numKeys;
+    header.numRows = numRows;
+    header.boundariesOffset = alignOffset(sizeof(Header));
+    header.leavesOffset = alignOffset(header.boundariesOffset + (numLeaves - 1) * sizeof(EncodedKeyType));
+    header.keysOffset = alignOffset(header.leavesOffset + numLeaves * sizeof(Leaf));
+    header.runStartsOffset = alignOffset(header.keysOffset + numKeys * sizeof(EncodedKeyType));
+    header.valuesOffset = alignOffset(header.runStartsOffset + (numKeys + 1) * sizeof(uint64_t));
+    header.totalSize = alignOffset(header.valuesOffset + numRows * sizeof(ValueType));
+    return header;
+}
+
+template <typename KeyType, typename ValueType>
+template <int secondStageSize>
+std::vector<char> FrozenIndex<KeyType, ValueType>::freeze(RecursiveModelIndex<KeyType, ValueType, secondStageSize> &index) {
+    const std::vector<size_t> leafStarts = index.getLeafStarts();
+    const Header header = layout(leafStarts.size() - 1, index.distinctSize(), index.trainedSize());
+
+    std::vector<char> buffer(header.totalSize, 0);
+    freezeInto(index, leafStarts, header, buffer.data());
+    return buffer;
+}
+
+template <typename KeyType, typename ValueType>
+template <int secondStageSize>
+void FrozenIndex<KeyType, ValueType>::freezeInto(RecursiveModelIndex<KeyType, ValueType, secondStageSize> &index,
+                                                 const std::vector<size_t> &leafStarts, const Header &header,
+                                                 char *block) {
+    const size_t numLeaves = header.numLeaves;
+    const size_t numKeys = header.numKeys;
+    const size_t numRows = header.numRows;
+    std::memcpy(block, &header, sizeof(header));
+
+    auto *keys = reinterpret_cast<EncodedKeyType *>(block + header.keysOffset);
+    auto *runStarts = reinterpret_cast<uint64_t *>(block + header.runStartsOffset);
+    for (size_t ii = 0; ii < numKeys; ++ii) {
+        keys[ii] = Encoding::encode(index.distinctKeyAt(ii));
+        runStarts[ii] = index.runAt(ii).first;
+    }
+    runStarts[numKeys] = numRows;
+
+    auto *values = reinterpret_cast<ValueType *>(block + header.valuesOffset);
+    for (size_t ii = 0; ii < numRows; ++ii) {
+        std::memcpy(values + ii, &index.valueAt(ii), sizeof(ValueType));
+    }
+
+    auto *boundaries = reinterpret_cast<EncodedKeyType *>(block + header.boundariesOffset);
+    auto *leaves = reinterpret_cast<Leaf *>(block + header.leavesOffset);
+    for (size_t leaf = 0; leaf < numLeaves; ++leaf) {
+        const size_t start = leafStarts[leaf];
+        const size_t end = leafStarts[leaf + 1];
+        if (leaf + 1 < numLeaves) {
+            // Leaf 0 always holds the first key, so end > 0 whenever there are keys
+            boundaries[leaf] = end > 0 ? keys[end - 1] : 0;
+        }
+
+        LinearModel model;
+        if (end > start) {
+            KeyType origin = Encoding::decode(keys[start]);
+            model.fit(keys + start, keys + end, [origin](EncodedKeyType key) {
+                return Encoding::toModelInput(Encoding::decode(key), origin);
+            });
+        }
+        leaves[leaf] = {start, end, model.slope, model.intercept, model.maxNegativeError, model.maxPositiveError};
+    }
+}
+
+template <typename KeyType, typename ValueType>
+template <int secondStageSize>
+bool FrozenIndex<KeyType, ValueType>::freezeToDescriptor(RecursiveModelIndex<KeyType, ValueType, secondStageSize> &index,
+                                                         int fd) {
+    const std::vector<size_t> leafStarts = index.getLeafStarts();
+    const Header header = layout(leafStarts.size() - 1, index.distinctSize(), index.trainedSize());
+
+    // Frozen straight into the (file backed) mapping, never into a second in memory copy
+    if (::ftruncate(fd, static_cast<off_t>(header.totalSize)) != 0) {
+        return false;
+    }
+    void *mapping = ::mmap(nullptr, header.totalSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    freezeInto(index, leafStarts, header, static_cast<char *>(mapping));
+    ::munmap(mapping, header.totalSize);
+    return true;
+}
+
+template <typename KeyType, typename ValueType>
+template <int secondStageSize>
+bool FrozenIndex<KeyType, ValueType>::publishFile(RecursiveModelIndex<KeyType, ValueType, secondStageSize> &index,
+                                                  const std::string &path) {
+    // Write then rename, so readers never map a half written file
+    std::string temporaryPath = path + ".tmp";
+    int fd = ::open(temporaryPath.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (fd < 0) {
+        std::cerr << "Failed to create " << temporaryPath << std::endl;
+        return false;
+    }
+
+    bool success = freezeToDescriptor(index, fd);
+    ::close(fd);
+    if (!success) {
+        std::cerr << "Failed to write " << temporaryPath << std::endl;
+        ::unlink(temporaryPath.c_str());
+        return false;
+    }
+    return ::rename(temporaryPath.c_str(), path.c_str()) == 0;
+}
+
+template <typename KeyType, typename ValueType>
+template <int secondStageSize>
+bool FrozenIndex<KeyType, ValueType>::publishShared(RecursiveModelIndex<KeyType, ValueType, secondStageSize> &index,
+                                                    const std::string &name) {
+    ::shm_unlink(name.c_str());
+    int fd = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) {
+        std::cerr << "Failed to create shared memory segment " << name << std::endl;
+        return false;
+    }
+
+    bool success = freezeToDescriptor(index, fd);
+    ::close(fd);
+
+    if (!success) {
+        std::cerr << "Failed to write shared memory segment " << name << std::endl;
+        ::shm_unlink(name.c_str());
+    }
+    return success;
+}
+
+template <typename KeyType, typename ValueType>
+bool FrozenIndex<KeyType, ValueType>::attachBuffer(std::vector<char> &&buffer) {
+    detach();
+    m_buffer.swap(buffer);
+    m_base = m_buffer.data();
+    m_size = m_buffer.size();
+    return validate();
+}
+
+template <typename KeyType, typename ValueType>
+bool FrozenIndex<KeyType, ValueType>::attachFile(const std::string &path) {
+    detach();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Failed to open " << path << std::endl;
+        return false;
+    }
+    bool success = mapDescriptor(fd);
+    ::close(fd);
+    return success && validate();
+}
+
+template <typename KeyType, typename ValueType>
+bool FrozenIndex<KeyType, ValueType>::attachShared(const std::string &name) {
+    detach();
+    int fd = ::shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        std::cerr << "Failed to open shared memory segment " << name << std::endl;
+        return false;
+    }
+    bool success = mapDescriptor(fd);
+    ::close(fd);
+    return success && validate();
+}
+
+template <typename KeyType, typename ValueType>
+void FrozenIndex<KeyType, ValueType>::detach() {
+    stopPrefault();
+    if (m_mapped) {
+        ::munmap(const_cast<char *>(m_base), m_size);
+    }
+    m_buffer = std::vector<char>();
+    m_base = nullptr;
+    m_size = 0;
+    m_mapped = false;
+}
+
+template <typename KeyType, typename ValueType>
+void FrozenIndex<KeyType, ValueType>::prefaultInBackground() {
+    stopPrefault();
+    if (!m_base) {
+        return;
+    }
+
+    // Sections in the order lookups need them: routing, leaf models, then keys, runs and values
+    const Header &info = header();
+    std::vector<std::pair<uint64_t, uint64_t>> ranges = {
+        {info.boundariesOffset, info.keysOffset},
+        {info.keysOffset, info.totalSize}
+    };
+
+    const char *base = m_base;
+    std::atomic<bool> *stop = &m_stopPrefault;
+    m_prefaultThread = std::thread([base, ranges, stop]() {
+        for (const auto &range : ranges) {
+            touchPages(base, range.first, range.second, stop);
+        }
+    });
+}
+
+template <typename KeyType, typename ValueType>
+size_t FrozenIndex<KeyType, ValueType>::touchPages(const char *base, uint64_t first, uint64_t last,
+                                                   const std::atomic<bool> *stop) {
+    const uint64_t pageSize = static_cast<uint64_t>(::sysconf(_SC_PAGESIZE));
+    unsigned checksum = 0;
+    // Step from the page holding first, so a range that starts mid page still reaches its last page
+    uint64_t offset = first & ~(pageSize - 1);
+    for (; offset < last && !(stop && stop->load(std::memory_order_relaxed)); offset += pageSize) {
+        checksum += *static_cast<const volatile char *>(base + std::max(offset, first));
+    }
+    (void)checksum;
+    return static_cast<size_t>(std::max(std::min(offset, last), first) - first);
+}
+
+template <typename KeyType, typename ValueType>
+size_t FrozenIndex<KeyType, ValueType>::warmup(const WarmupPolicy &policy) {
+    if (!m_base) {
+        return 0;
+    }
+
+    const Header &info = header();
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    if (policy.models) {
+        ranges.push_back({info.boundariesOffset, info.keysOffset});
+    }
+    if (policy.allKeys) {
+        ranges.push_back({info.keysOffset, info.keysOffset + info.numKeys * sizeof(EncodedKeyType)});
+    }
+
+    const uint64_t *runStarts = section<uint64_t>(info.runStartsOffset);
+    for (const auto &range : policy.hotRanges) {
+        size_t first = lowerBound(range.first);
+        size_t last = lowerBound(range.last);
+        if (last < info.numKeys && section<EncodedKeyType>(info.keysOffset)[last] == Encoding::encode(range.last)) {
+            last++;
+        }
+        if (first >= last) {
+            continue;
+        }
+        ranges.push_back({info.keysOffset + first * sizeof(EncodedKeyType), info.keysOffset + last * sizeof(EncodedKeyType)});
+        ranges.push_back({info.runStartsOffset + first * sizeof(uint64_t), info.runStartsOffset + (last + 1) * sizeof(uint64_t)});
+        ranges.push_back({info.valuesOffset + runStarts[first] * sizeof(ValueType),
+                          info.valuesOffset + runStarts[last] * sizeof(ValueType)});
+    }
+
+    // Split into chunks so threads share the work however uneven the ranges are
+    const uint64_t pageSize = static_cast<uint64_t>(::sysconf(_SC_PAGESIZE));
+    const uint64_t chunkSize = 256 * pageSize;
+    std::vector<std::pair<uint64_t, uint64_t>> chunks;
+    size_t totalBytes = 0;
+    for (const auto &range : ranges) {
+        if (range.second <= range.first) {
+            continue;
+        }
+        if (m_mapped) {
+            uint64_t alignedFirst = range.first & ~(pageSize - 1);
+            ::madvise(const_cast<char *>(m_base) + alignedFirst, range.second - alignedFirst, MADV_WILLNEED);
+        }
+        for (uint64_t first = range.first; first < range.second; first += chunkSize) {
+            chunks.push_back({first, std::min(range.second, first + chunkSize)});
+        }
+        totalBytes += range.second - range.first;
+    }
+
+    std::atomic<size_t> nextChunk(0);
+    std::mutex progressMutex;
+    size_t doneBytes = 0;
+    const char *base = m_base;
+    auto worker = [&]() {
+        for (size_t chunk = nextChunk++; chunk < chunks.size(); chunk = nextChunk++) {
+            size_t bytes = touchPages(base, chunks[chunk].first, chunks[chunk].second);
+            std::lock_guard<std::mutex> lock(progressMutex);
+            doneBytes += bytes;
+            if (policy.onProgress) {
+                policy.onProgress(doneBytes, totalBytes);
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned ii = 1; ii < policy.numThreads; ++ii) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    return doneBytes;
+}
+
+template <typename KeyType, typename ValueType>
+void FrozenIndex<KeyType, ValueType>::stopPrefault() {
+    if (m_prefaultThread.joinable()) {
+        m_stopPrefault = true;
+        m_prefaultThread.join();
+    }
+    m_stopPrefault = false;
+}
+
+template <typename KeyType, typename ValueType>
+bool FrozenIndex<KeyType, ValueType>::mapDescriptor(int fd) {
+    struct stat status;
+    if (::fstat(fd, &status) != 0 || status.st_size < static_cast<off_t>(sizeof(Header))) {
+        std::cerr << "Frozen index is too small to hold a header" << std::endl;
+        return false;
+    }
+
+    void *mapping = ::mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Failed to map frozen index" << std::endl;
+        return false;
+    }
+
+    m_base = static_cast<const char *>(mapping);
+    m_size = static_cast<size_t>(status.st_size);
+    m_mapped = true;
+    return true;
+}
+
+template <typename KeyType, typename ValueType>
+bool FrozenIndex<KeyType, ValueType>::validate() {
+    const Header *candidate = reinterpret_cast<const Header *>(m_base);
+    bool valid = m_size >= sizeof(Header) &&
+                 std::memcmp(candidate->magic, "LIDXFRZN", sizeof(candidate->magic)) == 0 &&
+                 candidate->version == formatVersion &&
+                 candidate->keySize == sizeof(EncodedKeyType) &&
+                 candidate->keyIsFloating == static_cast<uint32_t>(std::is_floating_point<KeyType>::value) &&
+                 candidate->valueSize == sizeof(ValueType) &&
+                 candidate->numLeaves > 0 &&
+                 // Every element takes at least a byte, so larger counts can't fit, and smaller ones
+                 // can't overflow the layout arithmetic
+                 candidate->numLeaves <= m_size && candidate->numKeys <= m_size && candidate->numRows <= m_size;
+    if (valid) {
+        // The sections must sit exactly where a writer for these counts put them, inside the block
+        const Header expected = layout(candidate->numLeaves, candidate->numKeys, candidate->numRows);
+        valid = candidate->boundariesOffset == expected.boundariesOffset &&
+                candidate->leavesOffset == expected.leavesOffset &&
+                candidate->keysOffset == expected.keysOffset &&
+                candidate->runStartsOffset == expected.runStartsOffset &&
+                candidate->valuesOffset == expected.valuesOffset &&
+                candidate->totalSize == expected.totalSize &&
+                candidate->totalSize <= m_size;
+    }
+    if (valid) {
+        // Lookups search inside a leaf's key range, so a corrupt one would read past the keys
+        const Leaf *leaves = reinterpret_cast<const Leaf *>(m_base + candidate->leavesOffset);
+        for (uint64_t leaf = 0; valid && leaf < candidate->numLeaves; ++leaf) {
+            valid = leaves[leaf].start <= leaves[leaf].end && leaves[leaf].end <= candidate->numKeys;
+        }
+    }
+    if (!valid) {
+        std::cerr << "Not a frozen index for these key and value types" << std::endl;
+        detach();
+    }
+    return valid;
+}
+
+template <typename KeyType, typename ValueType>
+size_t FrozenIndex<KeyType, ValueType>::lowerBound(KeyType key) const {
+    if (!m_base || header().numKeys == 0) {
+        return 0;
+    }
+
+    const Header &info = header();
+    const EncodedKeyType encodedKey = Encoding::encode(key);
+    const EncodedKeyType *keys = section<EncodedKeyType>(info.keysOffset);
+
+    size_t leafIdx = simdLowerBound(section<EncodedKeyType>(info.boundariesOffset), info.numLeaves - 1, encodedKey);
+    const Leaf &leaf = section<Leaf>(info.leavesOffset)[leafIdx];
+    if (leaf.end == leaf.start) {
+        // Only keys past every trained key reach an empty leaf
+        return leaf.start;
+    }
+
+    LinearModel model;
+    model.slope = leaf.slope;
+    model.intercept = leaf.intercept;
+    model.maxNegativeError = leaf.maxNegativeError;
+    model.maxPositiveError = leaf.maxPositiveError;
+    float input = Encoding::toModelInput(key, Encoding::decode(keys[leaf.start]));
+    return leaf.start + model.lowerBound(keys + leaf.start, leaf.end - leaf.start, input, encodedKey);
+}
+
+template <typename KeyType, typename ValueType>
+const ValueType *FrozenIndex<KeyType, ValueType>::findRef(KeyType key) const {
+    size_t position = lowerBound(key);
+    if (!m_base || position >= header().numKeys ||
+        section<EncodedKeyType>(header().keysOffset)[position] != Encoding::encode(key)) {
+        return nullptr;
+    }
+    if (m_statistics) {
+        m_statistics->record(position);
+    }
+    const uint64_t row = section<uint64_t>(header().runStartsOffset)[position];
+    return section<ValueType>(header().valuesOffset) + row;
+}
+
+#endif //LEARNED_INDICES_FROZENINDEX_H
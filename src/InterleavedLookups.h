@@ -0,0 +1,151 @@
+/**
+ * @file InterleavedLookups.h
+ *
+ * @breif Round robin scheduling of many in flight lookups, so their cache misses overlap
+ *
+ * @date 1/07/2018
+ * @author Ben Caine
+ */
+
+#ifndef LEARNED_INDICES_INTERLEAVEDLOOKUPS_H
+#define LEARNED_INDICES_INTERLEAVEDLOOKUPS_H
+
+#include "RecursiveModelIndex.h"
+#include <functional>
+
+/**
+ * @brief Runs lookups against a RecursiveModelIndex a step at a time, round robin
+ *
+ * A single lookup mostly waits on memory: the leaf, then the key window, then the row. Each step
+ * of a lookup only prefetches what its next step needs, and the scheduler moves on to another
+ * lookup instead of waiting, so with enough lookups in flight the misses overlap. Callers submit
+ * keys with a callback and never see the steps.
+ *
+ * The index must not be modified while lookups are in flight.
+ *
+ * @tparam KeyType: The key type of the index
+ * @tparam ValueType: The value type of the index
+ * @tparam secondStageSize: The second stage size of the index
+ */
+template <typename KeyType, typename ValueType, int secondStageSize>
+class InterleavedLookups {
+public:
+
+    typedef RecursiveModelIndex<KeyType, ValueType, secondStageSize> Index;
+    typedef boost::optional<std::pair<KeyType, ValueType>> Result;
+    typedef std::function<void(KeyType, const Result &)> Callback;
+
+    /**
+     * @param index [in]: The index to look keys up in
+     * @param inFlight [in]: Max lookups interleaved at once, enough to cover memory latency
+     */
+    explicit InterleavedLookups(Index &index, size_t inFlight = 16);
+
+    /**
+     * @brief Start a lookup, advancing the ones in flight first if every slot is busy
+     * @param key [in]: A key to search for
+     * @param onResult [in]: Called with (key, result) once the lookup finishes
+     */
+    void submit(KeyType key, Callback onResult);
+
+    /**
+     * @brief Run every lookup in flight to completion
+     */
+    void drain();
+
+private:
+
+    /**
+     * @brief A lookup in flight
+     */
+    struct Slot {
+        typename Index::LookupState state;  ///< Progress of the lookup
+        Callback onResult;                  ///< Called once it finishes
+    };
+
+    /**
+     * @brief Advance the next lookup in flight by one step
+     */
+    void stepNext();
+
+    ///------------ Data members ----------------
+    Index &m_index;                     ///< Index we look keys up in
+    std::vector<Slot> m_slots;          ///< One per lookup that can be in flight
+    std::vector<size_t> m_active;       ///< Slots in flight, in round robin order
+    std::vector<size_t> m_free;         ///< Slots not in use
+    size_t m_next;                      ///< Position in m_active stepped next
+};
+
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+InterleavedLookups<KeyType, ValueType, secondStageSize>::InterleavedLookups(Index &index, size_t inFlight):
+    m_index(index), m_slots(std::max<size_t>(1, inFlight)), m_next(0)
+{
+    for (size_t ii = m_slots.size(); ii > 0; --ii) {
+        m_free.push_back(ii - 1);
+    }
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+void InterleavedLookups<KeyType, ValueType, secondStageSize>::submit(KeyType key, Callback onResult) {
+    while (m_free.empty()) {
+        stepNext();
+    }
+
+    size_t slot = m_free.back();
+    if (m_index.beginLookup(m_slots[slot].state, key)) {
+        onResult(key, m_slots[slot].state.result);
+        return;
+    }
+
+    m_free.pop_back();
+    m_slots[slot].onResult = std::move(onResult);
+    m_active.push_back(slot);
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+void InterleavedLookups<KeyType, ValueType, secondStageSize>::drain() {
+    while (!m_active.empty()) {
+        stepNext();
+    }
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+void InterleavedLookups<KeyType, ValueType, secondStageSize>::stepNext() {
+    if (m_next >= m_active.size()) {
+        m_next = 0;
+    }
+
+    size_t slot = m_active[m_next];
+    if (!m_index.resumeLookup(m_slots[slot].state)) {
+        m_next++;
+        return;
+    }
+
+    // Finished: swap it out of the active list, whatever was swapped in is stepped next
+    m_active[m_next] = m_active.back();
+    m_active.pop_back();
+    m_free.push_back(slot);
+    m_slots[slot].onResult(m_slots[slot].state.key, m_slots[slot].state.result);
+}
+
+/**
+ * @brief Look up a batch of keys with interleaving
+ * @return One result per key, in the same order as keys
+ */
+template <typename KeyType, typename ValueType, int secondStageSize>
+std::vector<boost::optional<std::pair<KeyType, ValueType>>>
+findInterleaved(RecursiveModelIndex<KeyType, ValueType, secondStageSize> &index, const std::vector<KeyType> &keys,
+                size_t inFlight = 16) {
+    std::vector<boost::optional<std::pair<KeyType, ValueType>>> results(keys.size());
+    InterleavedLookups<KeyType, ValueType, secondStageSize> lookups(index, inFlight);
+    for (size_t ii = 0; ii < keys.size(); ++ii) {
+        lookups.submit(keys[ii], [&results, ii](KeyType, const boost::optional<std::pair<KeyType, ValueType>> &result) {
+            results[ii] = result;
+        });
+    }
+    lookups.drain();
+    return results;
+}
+
+#endif //LEARNED_INDICES_INTERLEAVEDLOOKUPS_H
@@ -0,0 +1,377 @@
+/**
+ * @file LearnedGridIndex.h
+ *
+ * @breif A multi-dimensional learned index: a grid laid out by per dimension learned CDFs
+ *
+ * @date 1/07/2018
+ * @author Ben Caine
+ */
+
+#ifndef LEARNED_INDICES_LEARNEDGRIDINDEX_H
+#define LEARNED_INDICES_LEARNEDGRIDINDEX_H
+
+#include "RecursiveModelIndex.h"
+#include "utils/KeyEncoding.h"
+#include "utils/LinearModel.h"
+#include <array>
+#include <chrono>
+#include <limits>
+#include <memory>
+
+/**
+ * @brief A learned index for box queries over points with several attributes
+ *
+ * Every dimension but the last is cut into columns, and the column boundaries come from a
+ * RecursiveModelIndex trained on that dimension (its positions are the dimension's CDF), so each
+ * column holds about the same number of points whatever the distribution. Inside each grid cell
+ * the points are sorted by the last dimension, with a linear model of it per cell, so a query
+ * only scans the cells its box overlaps, and in each of those only the sort dimension range.
+ *
+ * @tparam KeyType: The type of every attribute
+ * @tparam ValueType: The value we are storing
+ * @tparam dimensions: Number of attributes of a point
+ * @tparam secondStageSize: The size of the second stage of each per dimension index
+ */
+template <typename KeyType, typename ValueType, int dimensions, int secondStageSize>
+class LearnedGridIndex {
+    static_assert(dimensions >= 2, "A grid needs at least one grid dimension and a sort dimension");
+
+public:
+
+    typedef std::array<KeyType, dimensions> Point;
+    typedef KeyEncoding<KeyType> Encoding;
+
+    /**
+     * @brief Create a learned grid index
+     * @param firstStageParams [in]: The first layer network parameters of each per dimension index
+     * @param secondStageParams [in]: The second stage network parameters of each per dimension index
+     * @param columnsPerDimension [in]: Number of columns each grid dimension is cut into
+     * @param maxSecondStageError [in]: The max second stage error allowed before replacing with BTree
+     * @param maxOverflowSize [in]: The max number of untrained inserts before we force a retrain
+     */
+    explicit LearnedGridIndex(const NetworkParameters &firstStageParams,
+                              const NetworkParameters &secondStageParams,
+                              size_t columnsPerDimension = 16,
+                              int maxSecondStageError = 256,
+                              int maxOverflowSize = 10000);
+
+    /**
+     * @brief Insert into our index new data
+     * @param point [in]: The point to insert
+     * @param value [in]: The value to insert
+     */
+    void insert(const Point &point, ValueType value);
+
+    /**
+     * @brief Find a specific point
+     * @return A pair of (point, value) if found.
+     */
+    boost::optional<std::pair<Point, ValueType>> find(const Point &point);
+
+    /**
+     * @brief Find every point inside a box
+     * @param low [in]: The lowest corner of the box, inclusive
+     * @param high [in]: The highest corner of the box, inclusive
+     * @return The matching (point, value) pairs, in no particular order
+     */
+    std::vector<std::pair<Point, ValueType>> findRange(const Point &low, const Point &high);
+
+    /**
+     * @brief Train the per dimension indexes and lay the points out in the grid
+     */
+    void train();
+
+    /**
+     * @brief Pick the number of columns per dimension that answers a sample workload fastest
+     *
+     * The per dimension models don't depend on the number of columns, so each candidate only
+     * costs a re-layout of the points, not a retrain.
+     *
+     * @param workload [in]: Sample (low, high) box queries
+     * @param candidates [in]: Column counts to try
+     * @return The chosen number of columns per dimension
+     */
+    size_t tune(const std::vector<std::pair<Point, Point>> &workload, const std::vector<size_t> &candidates);
+
+    /**
+     * @return Number of columns each grid dimension is cut into
+     */
+    size_t getColumnsPerDimension() const {
+        return m_columnsPerDimension;
+    }
+
+private:
+
+    static const int gridDimensions = dimensions - 1;
+    static const int sortDimension = dimensions - 1;
+
+    /**
+     * @brief The column a value falls into along a grid dimension
+     */
+    size_t columnOf(int dimension, KeyType value);
+
+    /**
+     * @brief Sort the trained points by (cell, sort dimension) and fit the per cell models
+     */
+    void buildLayout();
+
+    /**
+     * @brief Lower bound of a sort dimension value inside a cell
+     * @return The position of the first point in the cell not less than key in the sort dimension
+     */
+    size_t cellLowerBound(size_t cell, KeyType key) const;
+
+    ///------------ Data members ----------------
+    NetworkParameters m_firstStageParams;                              ///< First stage network parameters
+    NetworkParameters m_secondStageParams;                             ///< Our second stage network parameters
+    size_t m_columnsPerDimension;                                      ///< Columns per grid dimension
+    int m_maxSecondStageError;                                         ///< Max second stage error before replacing with btree
+    int m_maxOverflowSize;                                             ///< Max untrained inserts before retraining
+
+    std::vector<std::pair<Point, ValueType>> m_data;                   ///< Trained points, by (cell, sort dimension)
+    std::vector<typename Encoding::EncodedType> m_sortKeys;            ///< Encoded sort dimension of m_data
+    std::vector<size_t> m_cellStarts;                                  ///< First point of each cell, plus the end
+    std::vector<LinearModel> m_cellModels;                             ///< Sort dimension model per cell
+    std::array<std::unique_ptr<RecursiveModelIndex<KeyType, uint32_t, secondStageSize>>, gridDimensions> m_dimensionIndexes;  ///< CDF per grid dimension
+    std::vector<std::pair<Point, ValueType>> m_overflowArray;          ///< Inserts since the last train
+};
+
+
+template <typename KeyType, typename ValueType, int dimensions, int secondStageSize>
+LearnedGridIndex<KeyType, ValueType, dimensions, secondStageSize>::LearnedGridIndex(const NetworkParameters &firstStageParams,
+                                                                                    const NetworkParameters &secondStageParams,
+                                                                                    size_t columnsPerDimension,
+                                                                                    int maxSecondStageError,
+                                                                                    int maxOverflowSize):
+    m_firstStageParams(firstStageParams), m_secondStageParams(secondStageParams),
+    m_columnsPerDimension(std::max<size_t>(1, columnsPerDimension)),
+    m_maxSecondStageError(maxSecondStageError), m_maxOverflowSize(maxOverflowSize),
+    m_cellStarts(1, 0)
+{
+}
+
+template <typename KeyType, typename ValueType, int dimensions, int secondStageSize>
+void LearnedGridIndex<KeyType, ValueType, dimensions, secondStageSize>::insert(const Point &point, ValueType value) {
+    m_overflowArray.push_back({point, value});
+
+    if (m_overflowArray.size() > static_cast<size_t>(m_maxOverflowSize)) {
+        train();
+    }
+}
+
+template <typename KeyType, typename ValueType, int dimensions, int secondStageSize>
+boost::optional<std::pair<std::array<KeyType, dimensions>, ValueType>>
+LearnedGridIndex<KeyType, ValueType, dimensions, secondStageSize>::find(const Point &point) {
+    for (const auto &pair : m_overflowArray) {
+        if (pair.first == point) {
+            return pair;
+        }
+    }
+
+    if (m_data.empty()) {
+        return {};
+    }
+
+    size_t cell = 0;
+    for (int dimension = 0; dimension < gridDimensions; ++dimension) {
+        cell = cell * m_columnsPerDimension + columnOf(dimension, point[dimension]);
+    }
+
+    for (size_t position = cellLowerBound(cell, point[sortDimension]);
+         position < m_cellStarts[cell + 1] && m_data[position].first[sortDimension] == point[sortDimension]; ++position) {
+        if (m_data[position].first == point) {
+            return m_data[position];
+        }
+    }
+    return {};
+}
+
+template <typename KeyType, typename ValueType, int dimensions, int secondStageSize>
+std::vector<std::pair<std::array<KeyType, dimensions>, ValueType>>
+LearnedGridIndex<KeyType, ValueType, dimensions, secondStageSize>::findRange(const Point &low, const Point &high) {
+    std::vector<std::pair<Point, ValueType>> result;
+    auto contains = [&](const Point &point) {
+        for (int dimension = 0; dimension < dimensions; ++dimension) {
+            if (point[dimension] < low[dimension] || high[dimension] < point[dimension]) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    if (!m_data.empty()) {
+        // Column positions are monotone in the value, so the box covers a sub-grid of cells
+        std::array<size_t, gridDimensions> firstColumn;
+        std::array<size_t, gridDimensions> lastColumn;
+        for (int dimension = 0; dimension < gridDimensions; ++dimension) {
+            if (high[dimension] < low[dimension]) {
+                return result;
+            }
+            firstColumn[dimension] = columnOf(dimension, low[dimension]);
+            lastColumn[dimension] = columnOf(dimension, high[dimension]);
+        }
+
+        std::array<size_t, gridDimensions> column = firstColumn;
+        while (true) {
+            size_t cell = 0;
+            for (int dimension = 0; dimension < gridDimensions; ++dimension) {
+                cell = cell * m_columnsPerDimension + column[dimension];
+            }
+
+            for (size_t position = cellLowerBound(cell, low[sortDimension]);
+                 position < m_cellStarts[cell + 1] && !(high[sortDimension] < m_data[position].first[sortDimension]); ++position) {
+                if (contains(m_data[position].first)) {
+                    result.push_back(m_data[position]);
+                }
+            }
+
+            // Odometer style step through the sub-grid, last grid dimension fastest
+            int dimension = gridDimensions - 1;
+            while (dimension >= 0 && column[dimension] == lastColumn[dimension]) {
+                column[dimension] = firstColumn[dimension];
+                dimension--;
+            }
+            if (dimension < 0) {
+                break;
+            }
+            column[dimension]++;
+        }
+    }
+
+    for (const auto &pair : m_overflowArray) {
+        if (contains(pair.first)) {
+            result.push_back(pair);
+        }
+    }
+    return result;
+}
+
+template <typename KeyType, typename ValueType, int dimensions, int secondStageSize>
+void LearnedGridIndex<KeyType, ValueType, dimensions, secondStageSize>::train() {
+    m_data.insert(m_data.end(), m_overflowArray.begin(), m_overflowArray.end());
+    m_overflowArray.clear();
+
+    // Each grid dimension gets its own index, whose positions are that dimension's CDF
+    for (int dimension = 0; dimension < gridDimensions; ++dimension) {
+        std::vector<std::pair<KeyType, uint32_t>> column;
+        column.reserve(m_data.size());
+        for (const auto &pair : m_data) {
+            column.push_back({pair.first[dimension], 0});
+        }
+
+        // Untrained points are handled here, so the inner index never retrains on its own
+        m_dimensionIndexes[dimension].reset(new RecursiveModelIndex<KeyType, uint32_t, secondStageSize>(
+                m_firstStageParams, m_secondStageParams, m_maxSecondStageError, std::numeric_limits<int>::max()));
+        m_dimensionIndexes[dimension]->load(column);
+        m_dimensionIndexes[dimension]->train();
+    }
+
+    buildLayout();
+}
+
+template <typename KeyType, typename ValueType, int dimensions, int secondStageSize>
+size_t LearnedGridIndex<KeyType, ValueType, dimensions, secondStageSize>::tune(
+        const std::vector<std::pair<Point, Point>> &workload, const std::vector<size_t> &candidates) {
+    size_t bestColumns = m_columnsPerDimension;
+    double bestTime = std::numeric_limits<double>::max();
+
+    for (auto columns : candidates) {
+        m_columnsPerDimension = std::max<size_t>(1, columns);
+        buildLayout();
+
+        auto startTime = std::chrono::high_resolution_clock::now();
+        for (const auto &query : workload) {
+            findRange(query.first, query.second);
+        }
+        auto endTime = std::chrono::high_resolution_clock::now();
+
+        std::chrono::duration<double> duration = endTime - startTime;
+        if (duration.count() < bestTime) {
+            bestTime = duration.count();
+            bestColumns = m_columnsPerDimension;
+        }
+    }
+
+    m_columnsPerDimension = bestColumns;
+    buildLayout();
+    return bestColumns;
+}
+
+template <typename KeyType, typename ValueType, int dimensions, int secondStageSize>
+size_t LearnedGridIndex<KeyType, ValueType, dimensions, secondStageSize>::columnOf(int dimension, KeyType value) {
+    auto &index = *m_dimensionIndexes[dimension];
+    size_t distinct = index.lowerBound(value);
+    size_t position = distinct == index.distinctSize() ? index.trainedSize() : index.runAt(distinct).first;
+    return std::min(m_columnsPerDimension - 1, position * m_columnsPerDimension / std::max<size_t>(1, index.trainedSize()));
+}
+
+template <typename KeyType, typename ValueType, int dimensions, int secondStageSize>
+void LearnedGridIndex<KeyType, ValueType, dimensions, secondStageSize>::buildLayout() {
+    size_t numCells = 1;
+    for (int dimension = 0; dimension < gridDimensions; ++dimension) {
+        numCells *= m_columnsPerDimension;
+    }
+
+    std::vector<size_t> cells;
+    cells.reserve(m_data.size());
+    for (const auto &pair : m_data) {
+        size_t cell = 0;
+        for (int dimension = 0; dimension < gridDimensions; ++dimension) {
+            cell = cell * m_columnsPerDimension + columnOf(dimension, pair.first[dimension]);
+        }
+        cells.push_back(cell);
+    }
+
+    // Counting sort into cells, then sort each cell by the sort dimension
+    m_cellStarts.assign(numCells + 1, 0);
+    for (auto cell : cells) {
+        m_cellStarts[cell + 1]++;
+    }
+    for (size_t cell = 0; cell < numCells; ++cell) {
+        m_cellStarts[cell + 1] += m_cellStarts[cell];
+    }
+
+    std::vector<size_t> next(m_cellStarts.begin(), m_cellStarts.end() - 1);
+    std::vector<std::pair<Point, ValueType>> laidOut(m_data.size());
+    for (size_t ii = 0; ii < m_data.size(); ++ii) {
+        laidOut[next[cells[ii]]++] = std::move(m_data[ii]);
+    }
+    m_data.swap(laidOut);
+
+    m_sortKeys.clear();
+    m_sortKeys.reserve(m_data.size());
+    m_cellModels.assign(numCells, LinearModel());
+    for (size_t cell = 0; cell < numCells; ++cell) {
+        auto first = m_data.begin() + m_cellStarts[cell];
+        auto last = m_data.begin() + m_cellStarts[cell + 1];
+        std::sort(first, last, [](const std::pair<Point, ValueType> &p1, const std::pair<Point, ValueType> &p2) {
+            return p1.first[sortDimension] < p2.first[sortDimension];
+        });
+        for (auto it = first; it != last; ++it) {
+            m_sortKeys.push_back(Encoding::encode(it->first[sortDimension]));
+        }
+
+        if (first != last) {
+            KeyType origin = first->first[sortDimension];
+            m_cellModels[cell].fit(m_sortKeys.begin() + m_cellStarts[cell], m_sortKeys.end(),
+                                   [origin](typename Encoding::EncodedType encoded) {
+                                       return Encoding::toModelInput(Encoding::decode(encoded), origin);
+                                   });
+        }
+    }
+}
+
+template <typename KeyType, typename ValueType, int dimensions, int secondStageSize>
+size_t LearnedGridIndex<KeyType, ValueType, dimensions, secondStageSize>::cellLowerBound(size_t cell, KeyType key) const {
+    size_t first = m_cellStarts[cell];
+    size_t size = m_cellStarts[cell + 1] - first;
+    if (size == 0) {
+        return first;
+    }
+
+    KeyType origin = m_data[first].first[sortDimension];
+    return first + m_cellModels[cell].lowerBound(m_sortKeys.data() + first, size, Encoding::toModelInput(key, origin),
+                                                 Encoding::encode(key));
+}
+
+#endif //LEARNED_INDICES_LEARNEDGRIDINDEX_H
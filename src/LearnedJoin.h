@@ -0,0 +1,98 @@
+/**
+ * @file LearnedJoin.h
+ *
+ * @breif Merge join and set intersection between two Recursive Model Indices
+ *
+ * @date 1/07/2018
+ * @author Ben Caine
+ */
+
+#ifndef LEARNED_INDICES_LEARNEDJOIN_H
+#define LEARNED_INDICES_LEARNEDJOIN_H
+
+#include "RecursiveModelIndex.h"
+#include <vector>
+
+/**
+ * @brief Join two indices on equal keys, skipping ahead with each side's models
+ *
+ * Rather than advancing one element at a time like a classic merge, whichever side is behind
+ * asks its own models where the other side's current key lands and jumps straight there. When
+ * one side is much smaller, this touches roughly one neighbourhood of the larger side per key
+ * of the smaller one. Only trained data takes part, so call train() first to fold in pending inserts.
+ *
+ * @param left [in]: Left side of the join
+ * @param right [in]: Right side of the join
+ * @param onMatch [in]: Called as onMatch(key, leftValue, rightValue) for every matching pair,
+ *                      including every combination of duplicate keys
+ */
+template <typename KeyType, typename LeftValueType, int leftStageSize,
+          typename RightValueType, int rightStageSize, typename Callback>
+void learnedMergeJoin(RecursiveModelIndex<KeyType, LeftValueType, leftStageSize> &left,
+                      RecursiveModelIndex<KeyType, RightValueType, rightStageSize> &right,
+                      Callback onMatch) {
+    size_t leftIdx = 0;
+    size_t rightIdx = 0;
+    const size_t leftSize = left.distinctSize();
+    const size_t rightSize = right.distinctSize();
+
+    // Walk the distinct keys, runs of duplicates come along with each match
+    while (leftIdx < leftSize && rightIdx < rightSize) {
+        KeyType leftKey = left.distinctKeyAt(leftIdx);
+        KeyType rightKey = right.distinctKeyAt(rightIdx);
+
+        if (leftKey < rightKey) {
+            leftIdx = left.lowerBound(rightKey, leftIdx + 1);
+        } else if (rightKey < leftKey) {
+            rightIdx = right.lowerBound(leftKey, rightIdx + 1);
+        } else {
+            // Equal keys, emit the cross product of both runs of duplicates
+            auto leftRun = left.runAt(leftIdx);
+            auto rightRun = right.runAt(rightIdx);
+            for (size_t ii = leftRun.first; ii < leftRun.first + leftRun.second; ++ii) {
+                for (size_t jj = rightRun.first; jj < rightRun.first + rightRun.second; ++jj) {
+                    onMatch(leftKey, left.valueAt(ii), right.valueAt(jj));
+                }
+            }
+
+            leftIdx++;
+            rightIdx++;
+        }
+    }
+}
+
+/**
+ * @brief Intersect the key sets of two indices
+ * @param left [in]: First index
+ * @param right [in]: Second index
+ * @return The distinct keys present in both, in ascending order
+ */
+template <typename KeyType, typename LeftValueType, int leftStageSize, typename RightValueType, int rightStageSize>
+std::vector<KeyType> learnedIntersection(RecursiveModelIndex<KeyType, LeftValueType, leftStageSize> &left,
+                                         RecursiveModelIndex<KeyType, RightValueType, rightStageSize> &right) {
+    std::vector<KeyType> result;
+
+    size_t leftIdx = 0;
+    size_t rightIdx = 0;
+    const size_t leftSize = left.distinctSize();
+    const size_t rightSize = right.distinctSize();
+
+    while (leftIdx < leftSize && rightIdx < rightSize) {
+        KeyType leftKey = left.distinctKeyAt(leftIdx);
+        KeyType rightKey = right.distinctKeyAt(rightIdx);
+
+        if (leftKey < rightKey) {
+            leftIdx = left.lowerBound(rightKey, leftIdx + 1);
+        } else if (rightKey < leftKey) {
+            rightIdx = right.lowerBound(leftKey, rightIdx + 1);
+        } else {
+            result.push_back(leftKey);
+            leftIdx++;
+            rightIdx++;
+        }
+    }
+
+    return result;
+}
+
+#endif //LEARNED_INDICES_LEARNEDJOIN_H
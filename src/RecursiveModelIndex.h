@@ -11,23 +11,133 @@
 #define LEARNED_INDICES_RECURSIVEMODELINDEX_H
 
 #include "SecondStageNode.h"
+#include "utils/CompactLeafTable.h"
 #include "utils/DataUtils.h"
+#include "utils/DriftDetector.h"
+#include "utils/HotKeyCache.h"
+#include "utils/KeyColumn.h"
+#include "utils/KeyEncoding.h"
+#include "utils/ModelWeights.h"
 #include "utils/NetworkParameters.h"
+#include "utils/SearchUtils.h"
 #include "../external/nn_cpp/nn/Net.h"
 #include "../external/cpp-btree/btree_map.h"
 #include <boost/optional.hpp>
+#include <cmath>
+#include <functional>
+#include <iterator>
+#include <limits>
 
 
 /**
  * @brief An implementation of the recursive model index
+ *
+ * Keys may be any integer or floating point type. The sorted key column holds them in an order
+ * preserving unsigned encoding (see KeyEncoding), and the networks see each key as an offset
+ * from the smallest trained key.
+ *
  * @tparam KeyType: The key type of our index
  * @tparam ValueType: The value we are storing
- * @tparam secondStageSize: The size of our second stage of our index
+ * @tparam secondStageSize: The initial size of our second stage, a FanoutPolicy may change it at each training
  */
 template <typename KeyType, typename ValueType, int secondStageSize>
 class RecursiveModelIndex {
 public:
 
+    typedef KeyEncoding<KeyType> Encoding;                             ///< Order preserving key encoding
+    typedef typename Encoding::EncodedType EncodedKeyType;             ///< Unsigned type keys are stored as
+    typedef typename DriftDetector<KeyType>::Report DriftReport;       ///< What measureDrift() found
+
+    /**
+     * @brief How lookups into the trained data are served
+     */
+    enum class LookupMode {
+        Automatic,      ///< Learned models once trained and usable, interpolation search otherwise
+        Learned,        ///< Always the learned models (requires train())
+        Interpolation   ///< Always interpolation search, the models are ignored
+    };
+
+    /**
+     * @brief How keys are routed to second stage nodes
+     */
+    enum class RoutingMode {
+        Network,        ///< Evaluate the first stage network
+        BoundaryTable   ///< Search the leaf boundary keys, so each leaf owns a contiguous key range
+    };
+
+    /**
+     * @brief A lookup in progress, advanced one memory access at a time (see InterleavedLookups)
+     */
+    struct LookupState {
+        enum class Step {
+            Leaf,       ///< The leaf model is being prefetched
+            Window,     ///< The key window is being prefetched
+            Row,        ///< The matching row is being prefetched
+            Done        ///< result holds the answer
+        };
+
+        KeyType key;                                                ///< Key being looked up
+        Step step;                                                  ///< What the next resume does
+        int stage;                                                  ///< Leaf the key routed to
+        std::pair<size_t, size_t> window;                           ///< Distinct key window [first, last) to search
+        size_t row;                                                 ///< Matching row of the trained data
+        boost::optional<std::pair<KeyType, ValueType>> result;      ///< The answer, once step is Done
+    };
+
+    /**
+     * @brief Every step find() takes for one key (see explain())
+     */
+    struct LookupExplanation {
+        bool cacheHit;                      ///< Served by the hot key cache, none of the steps below ran
+        size_t pendingProbes;               ///< Pending inserts compared with the key, in arrival order
+        bool foundPending;                  ///< Whether the key was pending
+        bool usedModels;                    ///< Whether the models served the trained data, interpolation search otherwise
+        int leaf;                           ///< Leaf the key routed to, -1 without models
+        float rootPrediction;               ///< Root output as a fraction of the distinct keys, NaN when routed by boundaries
+        long leafPrediction;                ///< Distinct key position the leaf predicted, a block in sparse mode
+        std::pair<size_t, size_t> window;   ///< Distinct key window [first, last) searched
+        bool usedTree;                      ///< Whether the leaf's fallback tree served the key
+        size_t comparisons;                 ///< Key comparisons searching the window (estimated for trees, only the block in sparse mode)
+        bool found;                         ///< Whether the key is in the index
+
+        LookupExplanation(): cacheHit(false), pendingProbes(0), foundPending(false), usedModels(false), leaf(-1),
+                             rootPrediction(std::numeric_limits<float>::quiet_NaN()), leafPrediction(0), window(0, 0),
+                             usedTree(false), comparisons(0), found(false) {}
+    };
+
+    /**
+     * @brief Analytical lookup cost of the current models (see costModel())
+     */
+    struct LookupCostModel {
+        size_t pendingProbes;                   ///< Pending inserts a lookup of a trained key scans first
+        double expectedComparisons;             ///< Key comparisons per lookup of a trained key, averaged over the keys
+        double averageWindow;                   ///< Average keys spanned by the window, over keys served by linear leaves
+        double treeServedFraction;              ///< Fraction of trained keys served by fallback trees
+        std::vector<size_t> leafSizes;          ///< Keys each leaf was trained on (block first keys in sparse mode), empty without models
+        std::vector<double> leafComparisons;    ///< Expected comparisons for a key of each leaf
+
+        LookupCostModel(): pendingProbes(0), expectedComparisons(0), averageWindow(0), treeServedFraction(0) {}
+    };
+
+    /**
+     * @brief How many leaves each training builds (see setFanoutPolicy())
+     */
+    struct FanoutPolicy {
+        enum class Mode {
+            Fixed,          ///< Keep the current number of leaves
+            KeysPerLeaf,    ///< One leaf per target distinct keys
+            TargetWindow    ///< Scale the leaves so the average search window lands on target keys
+        };
+
+        Mode mode;          ///< How the number of leaves is chosen
+        double target;      ///< Distinct keys per leaf, or average window, depending on mode
+        int minLeaves;      ///< Never fewer leaves than this
+        int maxLeaves;      ///< Never more leaves than this
+
+        explicit FanoutPolicy(Mode mode = Mode::Fixed, double target = 0, int minLeaves = 1, int maxLeaves = 1 << 20):
+            mode(mode), target(target), minLeaves(minLeaves), maxLeaves(maxLeaves) {}
+    };
+
     /**
      * @brief Create a RMI
      * @param firstStageParams [in]: The first layer network parameters
@@ -56,12 +166,442 @@ public:
     boost::optional<std::pair<KeyType, ValueType>> find(KeyType key);
 
     /**
-     * @brief Train our index structure
+     * @brief Find every value stored under a key
+     * @param key [in]: A key to search for
+     * @return All values with this key, trained ones first then pending inserts in insertion order
+     */
+    std::vector<ValueType> equalRange(KeyType key);
+
+    /**
+     * @brief Find a specific item without copying its value
+     * @param key [in]: A key to search for
+     * @return A pointer to the stored value, or nullptr. Valid until the next insert, load or train
+     */
+    const ValueType *findRef(KeyType key);
+
+    /**
+     * @brief Start a lookup that is then advanced with resumeLookup()
+     *
+     * Each step issues a prefetch for the memory the next step needs and returns straight away,
+     * so the caller can work on other lookups while it arrives. The answer is the same as find().
+     *
+     * @param state [out]: The lookup to start
+     * @param key [in]: A key to search for
+     * @return Whether the lookup already finished (hot key, pending insert, or no models in use)
+     */
+    bool beginLookup(LookupState &state, KeyType key);
+
+    /**
+     * @brief Advance a lookup started with beginLookup() by one step
+     * @return Whether the lookup finished, the answer is then in state.result
+     */
+    bool resumeLookup(LookupState &state);
+
+    /**
+     * @brief Find a key among the inserts that haven't been trained on yet
+     * @param key [in]: A key to search for
+     * @return A pair of (key, value) if found in the overflow array.
+     */
+    boost::optional<std::pair<KeyType, ValueType>> findPending(KeyType key) const;
+
+    /**
+     * @brief Find a batch of keys that are already sorted (e.g. the probe side of a merge join)
+     *
+     * Consecutive probes reuse the previous hit: while a key stays within the key range of the
+     * stage that served the last probe we skip both models and gallop forward from the last
+     * position, and only fall back to evaluating the models when we cross into a new stage.
+     *
+     * @param keys [in]: Keys to search for, sorted in ascending order
+     * @return One result per key, in the same order as keys
+     */
+    std::vector<boost::optional<std::pair<KeyType, ValueType>>> findSorted(const std::vector<KeyType> &keys);
+
+    /**
+     * @brief Find where a key would sit among the distinct trained keys
+     *
+     * Uses the models to jump straight to the key's neighbourhood, so skipping far ahead costs
+     * about the same as a single lookup. Pending inserts in the overflow array are not included.
+     *
+     * @param key [in]: The key to search for
+     * @param hint [in]: A distinct key position known to be at or before the answer (e.g. the previous result)
+     * @return Position of the first distinct trained key not less than key, or distinctSize()
+     */
+    size_t lowerBound(KeyType key, size_t hint = 0);
+
+    /**
+     * @brief Run a lookup step by step, recording what each step did, to see why a key is slow
+     * @param key [in]: The key to look up
+     */
+    LookupExplanation explain(KeyType key);
+
+    /**
+     * @brief Expected lookup cost of the trained keys, from the leaf error bounds rather than by running lookups
+     *
+     * A linear leaf searches a window as wide as its error bounds, a tree leaf costs a tree
+     * descent. Without models, interpolation search depends on the data, so its cost is measured
+     * on evenly spaced keys instead.
+     */
+    LookupCostModel costModel();
+
+    /**
+     * @return The number of distinct keys in the trained data
+     */
+    size_t distinctSize() const {
+        return m_keys.size();
+    }
+
+    /**
+     * @return The distinct trained key at a position
+     */
+    KeyType distinctKeyAt(size_t position) const {
+        return Encoding::decode(m_keys[position]);
+    }
+
+    /**
+     * @return The (start, count) run in the trained data holding the distinct key at a position
+     */
+    std::pair<size_t, size_t> runAt(size_t position) const {
+        return {m_runStarts[position], m_runStarts[position + 1] - m_runStarts[position]};
+    }
+
+    /**
+     * @brief Split the distinct keys into contiguous leaves following the trained routing (e.g. to freeze the index)
+     *
+     * Same monotone assignment as RoutingMode::BoundaryTable, so in that mode these are exactly the trained leaves.
+     *
+     * @return The first distinct key position of each of the getNumLeaves() leaves, plus distinctSize()
+     */
+    std::vector<size_t> getLeafStarts();
+
+    /**
+     * @return The number of elements in the trained (sorted) data
+     */
+    size_t trainedSize() const {
+        return m_data.size();
+    }
+
+    /**
+     * @return The key at a position of the trained (sorted) data
+     */
+    KeyType keyAt(size_t position) const {
+        return m_data[position].first;
+    }
+
+    /**
+     * @return The value at a position of the trained (sorted) data
+     */
+    const ValueType &valueAt(size_t position) const {
+        return m_values[m_data[position].second];
+    }
+
+    /**
+     * @brief Load data that is served straight away, without waiting for train()
+     *
+     * Until the next train() completes, lookups use interpolation search over the sorted data.
+     *
+     * @param data [in]: The (key, value) pairs to add, in any order
+     */
+    void load(const std::vector<std::pair<KeyType, ValueType>> &data);
+
+    /**
+     * @brief Choose how lookups are served
+     */
+    void setLookupMode(LookupMode mode) {
+        m_lookupMode = mode;
+    }
+
+    /**
+     * @return Whether lookups currently go through the learned models
+     */
+    bool usingLearnedModels() const {
+        switch (m_lookupMode) {
+            case LookupMode::Learned:
+                return true;
+            case LookupMode::Interpolation:
+                return false;
+            default:
+                return m_modelsAreTrained && m_modelsAreUsable;
+        }
+    }
+
+    /**
+     * @return Whether the last training built models that beat the fallback, i.e. fallback trees
+     * serve at most half the keys. LookupMode::Automatic only uses models that do
+     */
+    bool areModelsUsable() const {
+        return m_modelsAreUsable;
+    }
+
+    /**
+     * @brief Choose how the distinct key column is stored (see KeyColumn), re-encoding it in place
+     *
+     * The frame-of-reference layout trades a block decode per lookup for a column that is often
+     * several times smaller, so more of it stays cache resident.
+     */
+    void setKeyLayout(KeyLayout layout) {
+        m_keys.setLayout(layout);
+    }
+
+    /**
+     * @return Bytes used by the distinct key column
+     */
+    size_t keyColumnBytes() const {
+        return m_keys.sizeInBytes();
+    }
+
+    /**
+     * @brief Choose how keys are routed to the second stage, takes effect at the next train()
+     *
+     * In BoundaryTable mode the first stage network only proposes the split: its assignment of the
+     * sorted keys is made monotone, the largest key of each leaf is stored, and routing becomes a
+     * (SIMD) search of those getNumLeaves() - 1 boundaries. Routing is exact and no network runs
+     * at lookup time.
+     */
+    void setRoutingMode(RoutingMode mode) {
+        m_routingMode = mode;
+    }
+
+    /**
+     * @brief Choose the number of leaves from the data at each training, instead of keeping secondStageSize
+     *
+     * KeysPerLeaf divides the distinct keys by the target. TargetWindow assumes windows grow with
+     * the keys per leaf, so it scales the leaves by the average window the last training measured,
+     * grown with the data since, over the target (the first training keeps the current count).
+     * trainLeaves() and imported weights always keep the current leaves.
+     */
+    void setFanoutPolicy(const FanoutPolicy &policy) {
+        m_fanoutPolicy = policy;
+    }
+
+    /**
+     * @brief Model only the first key of each block of consecutive distinct keys, from the next train()
+     *
+     * The models then predict a block rather than a key: the window search runs over the block
+     * first keys, and the key is searched (with SIMD) inside the one block it lands in. Training
+     * and model memory shrink by the block size, and leaves never fall back to trees, since a wide
+     * window over block first keys is still a short search. Lookups pay one more small search.
+     *
+     * @param blockSize [in]: Distinct keys per block, 0 or 1 models every key
+     */
+    void setSparseBlocks(size_t blockSize) {
+        m_sparseBlockSize = blockSize > 1 ? blockSize : 0;
+    }
+
+    /**
+     * @return The number of second stage leaves
+     */
+    int getNumLeaves() const {
+        return m_numLeaves;
+    }
+
+    /**
+     * @brief Use weights trained elsewhere (see ModelWeights) instead of training, from the next train()
+     *
+     * The root and every leaf come from the weights as is, and train() only measures the leaf error
+     * bounds (falling back to a tree where they exceed maxSecondStageError, as usual). The models
+     * must have been trained on inputs relative to the smallest key of the data train() will see.
+     *
+     * @return Whether the weights have one leaf per second stage node (see getNumLeaves())
+     */
+    bool importWeights(const ModelWeights &weights);
+
+    /**
+     * @brief Read a weights file and use it from the next train()
+     * @return Whether the file was read and has one leaf per second stage node
+     */
+    bool importWeights(const std::string &path) {
+        ModelWeights weights;
+        return weights.read(path) && importWeights(weights);
+    }
+
+    /**
+     * @brief Go back to training our own networks from the next train()
+     */
+    void clearImportedWeights() {
+        m_useImportedWeights = false;
+        m_importedWeights = ModelWeights();
+    }
+
+    /**
+     * @brief Serve second stage predictions from a quantized copy of the leaf models (see CompactLeafTable)
+     *
+     * Each leaf shrinks to 16 bytes, so the whole leaf table stays cache resident, at the cost of
+     * slightly wider search windows. Leaves that don't quantize well keep using their full model.
+     */
+    void setCompactLeaves(bool enabled);
+
+    /**
+     * @brief Put a set associative cache of hot keys in front of find() and findRef()
+     *
+     * A hit skips the overflow scan and both models. Inserts invalidate their key, and train()
+     * and load() clear the cache since positions move.
+     *
+     * @param numBuckets [in]: Number of one cache line buckets (rounded up to a power of two), 0 disables it
+     */
+    void setHotKeyCache(size_t numBuckets) {
+        m_hotKeys.resize(numBuckets);
+    }
+
+    /**
+     * @return How many times train() has completed, so callers can tell when models changed under them
+     */
+    size_t getTrainingGeneration() const {
+        return m_trainingGeneration;
+    }
+
+    /**
+     * @brief Train our index structure (mergePending() then trainModels())
      */
     void train();
 
+    /**
+     * @brief Fold pending inserts into the sorted trained data, without training
+     *
+     * Lookups are served with interpolation search until trainModels() completes.
+     */
+    void mergePending();
+
+    /**
+     * @brief Train the models on the current trained data, without touching the data itself
+     *
+     * Only the models are written, so a forked child can run this against a copy on write view
+     * of the data without duplicating it.
+     */
+    void trainModels();
+
+    /**
+     * @brief Sample inserts so measureDrift() can compare them with the trained models
+     *
+     * Recording an insert costs a counter and, rarely, a store into the sample. The leaf sizes and
+     * the root's baseline misrouting are counted by training anyway, so tracking adds nothing to it.
+     *
+     * @param sampleSize [in]: Inserted keys kept in the sample, 0 disables tracking
+     */
+    void setDriftTracking(size_t sampleSize) {
+        m_drift.resize(sampleSize);
+        if (m_drift.isEnabled() && m_modelsAreTrained) {
+            resetDrift();
+        }
+    }
+
+    /**
+     * @brief How far the inserts since the last training moved the data away from the models (see DriftDetector)
+     * @param leafThreshold [in]: Estimated inserts per trained key above which a leaf should be retrained
+     * @param rootThreshold [in]: Increase in the misrouted fraction of keys above which the root should be retrained
+     * @return The per leaf scores and a recommendation, NoOp when tracking is off or nothing was trained
+     */
+    DriftReport measureDrift(float leafThreshold = 0.1f, float rootThreshold = 0.05f);
+
+    /**
+     * @brief Merge pending inserts and retrain only some leaves, keeping the root
+     *
+     * The other leaves keep their line, moved by the number of keys merged in before them, and
+     * only have their error bounds measured again. Falls back to train() when there are no
+     * usable models to keep.
+     *
+     * @param leaves [in]: Leaves to retrain, e.g. DriftReport::driftedLeaves
+     */
+    void trainLeaves(const std::vector<int> &leaves);
+
 private:
 
+    /**
+     * @brief Run the first stage network and pick the second stage node for a key
+     * @param key [in]: The key to route
+     * @return The second stage node index in [0, m_numLeaves)
+     */
+    int routeToStage(KeyType key);
+
+    /**
+     * @brief The root output for a key, as a fraction of the distinct keys (not used when routing by boundaries)
+     */
+    float predictRootFraction(KeyType key);
+
+    /**
+     * @brief The distinct key position a (non tree) second stage node predicts for a key
+     */
+    long predictStagePosition(int stage, KeyType key) {
+        if (m_leafTable.isCompact(stage)) {
+            return m_leafTable.predict(stage, modelInput(key));
+        }
+        return m_secondStage[stage].predict(modelInput(key), modelKeys().size());
+    }
+
+    /**
+     * @brief The network input for a key
+     */
+    float modelInput(KeyType key) const {
+        return Encoding::toModelInput(key, m_keyOrigin);
+    }
+
+    /**
+     * @brief Find the distinct key position holding a key
+     * @param key [in]: The key to search for
+     * @return The position in m_keys, or m_keys.size() if the key wasn't trained on
+     */
+    size_t findDistinct(KeyType key);
+
+    /**
+     * @brief The window a (non tree) second stage node predicts for a key
+     * @param stage [in]: The second stage node to use
+     * @param key [in]: The key to search for
+     * @param lowestStart [in]: Never start the window before this position
+     * @return The window [first, last) of distinct key positions, in sparse mode the block the key lands in
+     */
+    std::pair<size_t, size_t> predictStageWindow(int stage, KeyType key, size_t lowestStart = 0);
+
+    /**
+     * @brief Search the window a (non tree) second stage node predicts for a key
+     * @param stage [in]: The second stage node to use
+     * @param key [in]: The key to search for
+     * @param lowestStart [in]: Never start the window before this position
+     * @return Position of the first distinct key not less than key inside the window
+     */
+    size_t searchStageWindow(int stage, KeyType key, size_t lowestStart = 0) {
+        auto window = predictStageWindow(stage, key, lowestStart);
+        return m_keys.lowerBound(window.first, window.second, Encoding::encode(key));
+    }
+
+    /**
+     * @brief Whether position is the lower bound of key in our distinct keys
+     */
+    bool isLowerBound(size_t position, KeyType key) const;
+
+    /**
+     * @brief Lower bound of key in our distinct keys with interpolation search, no models involved
+     * @param key [in]: The key to search for
+     * @param first [in]: A position known to be at or before the answer
+     */
+    size_t interpolationSearch(KeyType key, size_t first = 0) const;
+
+    /**
+     * @return A copy of the (key, value) pair at a position of the trained data
+     */
+    std::pair<KeyType, ValueType> pairAt(size_t position) const {
+        return std::pair<KeyType, ValueType>(m_data[position].first, m_values[m_data[position].second]);
+    }
+
+    /**
+     * @brief Move (key, value) pairs into the trained data, values into m_values and their slots into m_data
+     */
+    template <typename Iterator>
+    void appendData(Iterator first, Iterator last);
+
+    /**
+     * @brief Quantize the trained second stage into m_leafTable, measuring errors with the quantized models
+     */
+    void buildLeafTable();
+
+    /**
+     * @brief Sort our data by key
+     */
+    void sortData();
+
+    /**
+     * @brief Collapse the sorted data into distinct keys and the runs of duplicates they map to
+     */
+    void buildRuns();
+
     /**
      * @brief Train the first stage of the network
      */
@@ -72,18 +612,77 @@ private:
      */
     void trainSecondStage();
 
+    /**
+     * @return The keys the models are trained on: every distinct key, or the first of each block in sparse mode
+     */
+    const KeyColumn<EncodedKeyType> &modelKeys() const {
+        return m_modelBlockSize ? m_blockBases : m_keys;
+    }
+
+    /**
+     * @brief Collect the first key of each block into m_blockBases, when in sparse mode
+     */
+    void buildBlockBases();
+
+    /**
+     * @brief The number of leaves the fanout policy picks for the current data
+     */
+    int chooseNumLeaves() const;
+
+    /**
+     * @brief Point drift tracking at the current models: leaf sizes and the root's misrouting on trained keys
+     */
+    void resetDrift();
+
+    /**
+     * @brief Count the keys each leaf was trained on, and how many of them the root misrouted
+     * @param perStageDataset [in]: The (key, position) pairs each leaf was trained on
+     */
+    void countLeafSizes(const std::vector<std::vector<std::pair<KeyType, size_t>>> &perStageDataset);
+
     ///------------ Data members ----------------
-    std::vector<std::pair<KeyType, ValueType>> m_data;                 ///< The data our learned index tries to find
+    std::vector<std::pair<KeyType, uint32_t>> m_data;                  ///< The data our learned index tries to find, as (key, slot in m_values)
+    std::vector<ValueType> m_values;                                   ///< Trained values in arrival order, they never move when m_data is sorted
+    KeyColumn<EncodedKeyType> m_keys;                                  ///< Encoded distinct keys of m_data, what the models are trained on (see modelKeys())
+    std::vector<size_t> m_runStarts;                                   ///< Start of each distinct key's run in m_data, plus the end
+    size_t m_sparseBlockSize;                                          ///< Distinct keys per modelled block from the next train(), 0 for all
+    size_t m_modelBlockSize;                                           ///< Distinct keys per block the current models were trained with
+    KeyColumn<EncodedKeyType> m_blockBases;                            ///< First key of each block, when m_modelBlockSize is set
+
+    KeyType m_keyOrigin;                                               ///< Smallest trained key, network inputs are offsets from it
 
     NetworkParameters m_firstStageParams;                              ///< First stage network parameters
     NetworkParameters m_secondStageParams;                             ///< Our second stage network parameters
     std::unique_ptr<nn::Net<float>> m_firstStageNetwork;               ///< The first stage neural network
+    bool m_useImportedWeights;                                         ///< Whether train() uses m_importedWeights instead of training
+    ModelWeights m_importedWeights;                                    ///< Externally trained root and leaf weights
+    bool m_routeByImportedRoot;                                        ///< Whether the current models were built with m_importedRoot
+    ModelWeights m_importedRoot;                                       ///< The imported weights the current models were built with
+    RoutingMode m_routingMode;                                         ///< Routing used from the next train()
+    bool m_routeByBoundaries;                                          ///< Whether the current leaves were trained on m_stageBoundaries
+    std::vector<EncodedKeyType> m_stageBoundaries;                     ///< Largest key of leaves [0, m_numLeaves - 1), when routing by boundaries
     std::vector<SecondStageNode<KeyType>> m_secondStage;                   ///< The second stage (network or btree)
+    int m_numLeaves;                                                   ///< Number of second stage nodes
+    FanoutPolicy m_fanoutPolicy;                                       ///< How trainModels() picks m_numLeaves
+    std::vector<size_t> m_leafSizes;                                   ///< Model keys each leaf was trained on, empty without models
+    float m_rootMisrouted;                                             ///< Fraction of model keys routed over a leaf away from their rank's leaf
+    double m_averageWindow;                                            ///< Average window of the last trainSecondStage() in keys, 0 if unknown
+    size_t m_averageWindowKeys;                                        ///< Distinct keys m_averageWindow was measured on
     int m_maxSecondStageError;                                         ///< Max second stage error before replacing with btree
+    bool m_useCompactLeaves;                                           ///< Whether predictions come from m_leafTable
+    CompactLeafTable m_leafTable;                                      ///< Quantized second stage, when enabled
+
+    LookupMode m_lookupMode;                                           ///< How lookups into m_data are served
+    bool m_modelsAreTrained;                                           ///< Whether the models were trained on the current m_data
+    bool m_modelsAreUsable;                                            ///< Whether the trained models beat the fallback
+    size_t m_trainingGeneration;                                       ///< Number of completed train() calls
 
     int m_currentOverflowSize;                                         ///< Number of inserts stored in overflow array
     int m_maxOverflowSize;                                             ///< Max size we let overflow array get before retraining
     std::vector<std::pair<KeyType, ValueType>> m_overflowArray;        ///< The overflow array
+
+    HotKeyCache<EncodedKeyType> m_hotKeys;                             ///< Hot key to position in m_data, when enabled
+    DriftDetector<KeyType> m_drift;                                    ///< Sample of inserts since training, when enabled
 };
 
 
@@ -92,8 +691,13 @@ RecursiveModelIndex<KeyType, ValueType, secondStageSize>::RecursiveModelIndex(co
                                                                               const NetworkParameters &secondStageParams,
                                                                               int maxSecondStageError,
                                                                               int maxOverflowSize):
-    m_firstStageParams(firstStageParams), m_secondStageParams(secondStageParams),
-    m_maxSecondStageError(maxSecondStageError), m_maxOverflowSize(maxOverflowSize)
+    m_sparseBlockSize(0), m_modelBlockSize(0), m_keyOrigin(), m_firstStageParams(firstStageParams), m_secondStageParams(secondStageParams),
+    m_useImportedWeights(false), m_routeByImportedRoot(false),
+    m_routingMode(RoutingMode::Network), m_routeByBoundaries(false),
+    m_numLeaves(secondStageSize), m_rootMisrouted(0), m_averageWindow(0), m_averageWindowKeys(0),
+    m_maxSecondStageError(maxSecondStageError), m_useCompactLeaves(false), m_lookupMode(LookupMode::Automatic),
+    m_modelsAreTrained(false), m_modelsAreUsable(false), m_trainingGeneration(0),
+    m_currentOverflowSize(0), m_maxOverflowSize(maxOverflowSize)
 {
 
     // Create our first network
@@ -103,14 +707,17 @@ RecursiveModelIndex<KeyType, ValueType, secondStageSize>::RecursiveModelIndex(co
     m_firstStageNetwork->add(new nn::Dense<float, 2>(firstStageParams.batchSize, firstStageParams.numNeurons, 1, true, nn::InitializationScheme::GlorotNormal));
 
     // Create all our second stage models
-    for (size_t ii = 0; ii < secondStageSize; ++ii) {
+    for (int ii = 0; ii < m_numLeaves; ++ii) {
         m_secondStage.emplace_back(SecondStageNode<KeyType>(m_maxSecondStageError, secondStageParams.batchSize));
     }
 }
 
 template <typename KeyType, typename ValueType, int secondStageSize>
 void RecursiveModelIndex<KeyType, ValueType, secondStageSize>::insert(KeyType key, ValueType value) {
+    assert(key == key && "NaN keys can't be ordered");
     m_overflowArray.push_back({key, value});
+    m_hotKeys.invalidate(Encoding::encode(key));
+    m_drift.record(key);
     m_currentOverflowSize ++;
 
     // TODO: This should really be a background task
@@ -121,88 +728,879 @@ void RecursiveModelIndex<KeyType, ValueType, secondStageSize>::insert(KeyType ke
 
 template <typename KeyType, typename ValueType, int secondStageSize>
 boost::optional<std::pair<KeyType, ValueType>> RecursiveModelIndex<KeyType, ValueType, secondStageSize>::find(KeyType key) {
-    // TODO: Order of searching?
-    auto overflowResult = std::find_if(m_overflowArray.begin(), m_overflowArray.end(), [&](const std::pair<KeyType, ValueType> &pair) {
-        return pair.first == key;
-    });
+    // Cached keys are never pending, inserting a key drops it from the cache
+    uint32_t cached = m_hotKeys.lookup(Encoding::encode(key));
+    if (cached != HotKeyCache<EncodedKeyType>::notFound) {
+        return pairAt(cached);
+    }
 
-    if (overflowResult != m_overflowArray.end()) {
-        return *overflowResult;
+    // TODO: Order of searching?
+    auto overflowResult = findPending(key);
+    if (overflowResult) {
+        return overflowResult;
     }
 
     // Now search using the RecursiveModelIndex!
-    Eigen::Tensor<float, 2> input(1, 1);
-    input(0, 0) = static_cast<float>(key);
+    size_t position = findDistinct(key);
+    if (position < m_keys.size()) {
+        m_hotKeys.store(Encoding::encode(key), m_runStarts[position]);
+        return pairAt(m_runStarts[position]);
+    }
+    return {};
+};
 
-    auto result = m_firstStageNetwork->forward<2, 2>(input);
-    auto resultIdx = result * result.constant(m_data.size());
+template <typename KeyType, typename ValueType, int secondStageSize>
+const ValueType *RecursiveModelIndex<KeyType, ValueType, secondStageSize>::findRef(KeyType key) {
+    uint32_t cached = m_hotKeys.lookup(Encoding::encode(key));
+    if (cached != HotKeyCache<EncodedKeyType>::notFound) {
+        return &m_values[m_data[cached].second];
+    }
 
-    // Calculate which stage we want to send this data to
-    // If we take the result (unscaled, so closer to 0-1), and multiply by the
-    // number of stages we get an assignment
-    int stage = static_cast<int>(result(0, 0) * secondStageSize);
+    for (const auto &pair : m_overflowArray) {
+        if (pair.first == key) {
+            return &pair.second;
+        }
+    }
 
-    // Cap the range of stages to 0 -> (secondStageSize - 1)
-    stage = std::max(0, stage);
-    stage = std::min(secondStageSize - 1, stage);
+    size_t position = findDistinct(key);
+    if (position < m_keys.size()) {
+        m_hotKeys.store(Encoding::encode(key), m_runStarts[position]);
+        return &m_values[m_data[m_runStarts[position]].second];
+    }
+    return nullptr;
+}
 
-    std::cout << "Finding: " << key << " Predicted: " << resultIdx << " assigned to stage: " << stage << std::endl;
+template <typename KeyType, typename ValueType, int secondStageSize>
+bool RecursiveModelIndex<KeyType, ValueType, secondStageSize>::beginLookup(LookupState &state, KeyType key) {
+    state.key = key;
+    state.step = LookupState::Step::Done;
+    state.result = boost::none;
 
-    if (m_secondStage[stage].isValid()) {
-        if (m_secondStage[stage].useTree()) {
+    uint32_t cached = m_hotKeys.lookup(Encoding::encode(key));
+    if (cached != HotKeyCache<EncodedKeyType>::notFound) {
+        state.result = pairAt(cached);
+        return true;
+    }
 
-            std::cout << "Using tree" << std::endl;
-            auto treeResult = m_secondStage[stage].treeFind(key);
+    state.result = findPending(key);
+    if (state.result || m_keys.empty()) {
+        return true;
+    }
+
+    // Interpolation search has no fixed sequence of accesses to prefetch, so it runs in one go
+    if (!usingLearnedModels()) {
+        state.result = find(key);
+        return true;
+    }
+
+    state.stage = routeToStage(key);
+    if (m_leafTable.isCompact(state.stage)) {
+        m_leafTable.prefetch(state.stage);
+    } else {
+        __builtin_prefetch(&m_secondStage[state.stage]);
+    }
+    state.step = LookupState::Step::Leaf;
+    return false;
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+bool RecursiveModelIndex<KeyType, ValueType, secondStageSize>::resumeLookup(LookupState &state) {
+    switch (state.step) {
+        case LookupState::Step::Leaf: {
+            if (!m_leafTable.isCompact(state.stage)) {
+                const auto &node = m_secondStage[state.stage];
+                if (!node.isValid() && !m_modelBlockSize) {
+                    state.step = LookupState::Step::Done;
+                    return true;
+                }
+                if (node.useTree()) {
+                    auto treeResult = m_secondStage[state.stage].treeFind(state.key);
+                    if (!treeResult) {
+                        state.step = LookupState::Step::Done;
+                        return true;
+                    }
+                    state.row = m_runStarts[treeResult.get().second];
+                    __builtin_prefetch(&m_data[state.row]);
+                    state.step = LookupState::Step::Row;
+                    return false;
+                }
+            }
+
+            state.window = predictStageWindow(state.stage, state.key);
+            m_keys.prefetch(state.window.first, state.window.second);
+            state.step = LookupState::Step::Window;
+            return false;
+        }
+        case LookupState::Step::Window: {
+            const EncodedKeyType encodedKey = Encoding::encode(state.key);
+            size_t position = m_keys.lowerBound(state.window.first, state.window.second, encodedKey);
+            if (position == m_keys.size() || m_keys[position] != encodedKey) {
+                state.step = LookupState::Step::Done;
+                return true;
+            }
+
+            state.row = m_runStarts[position];
+            m_hotKeys.store(encodedKey, state.row);
+            __builtin_prefetch(&m_data[state.row]);
+            state.step = LookupState::Step::Row;
+            return false;
+        }
+        case LookupState::Step::Row:
+            state.result = pairAt(state.row);
+            state.step = LookupState::Step::Done;
+            return true;
+        default:
+            return true;
+    }
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+std::vector<ValueType> RecursiveModelIndex<KeyType, ValueType, secondStageSize>::equalRange(KeyType key) {
+    std::vector<ValueType> result;
+
+    size_t position = findDistinct(key);
+    if (position < m_keys.size()) {
+        for (size_t ii = m_runStarts[position]; ii < m_runStarts[position + 1]; ++ii) {
+            result.push_back(m_values[m_data[ii].second]);
+        }
+    }
+
+    for (const auto &pair : m_overflowArray) {
+        if (pair.first == key) {
+            result.push_back(pair.second);
+        }
+    }
+    return result;
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+size_t RecursiveModelIndex<KeyType, ValueType, secondStageSize>::findDistinct(KeyType key) {
+    if (m_keys.empty()) {
+        return 0;
+    }
+
+    size_t position;
+    if (!usingLearnedModels()) {
+        position = interpolationSearch(key);
+    } else {
+        int stage = routeToStage(key);
+
+        // Compact leaves are always valid linear models, so the full node is only needed otherwise
+        if (!m_leafTable.isCompact(stage)) {
+            // In sparse mode the window search still finds the block (see predictStageWindow)
+            if (!m_secondStage[stage].isValid() && !m_modelBlockSize) {
+                std::cerr << "Key: " << key << " requested an invalid stage two node" << std::endl;
+                return m_keys.size();
+            }
+
+            if (m_secondStage[stage].useTree()) {
+                auto treeResult = m_secondStage[stage].treeFind(key);
+                return treeResult ? treeResult.get().second : m_keys.size();
+            }
+        }
+
+        position = searchStageWindow(stage, key);
+    }
+
+    if (position < m_keys.size() && m_keys[position] == Encoding::encode(key)) {
+        return position;
+    }
+    return m_keys.size();
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+boost::optional<std::pair<KeyType, ValueType>> RecursiveModelIndex<KeyType, ValueType, secondStageSize>::findPending(KeyType key) const {
+    auto overflowResult = std::find_if(m_overflowArray.begin(), m_overflowArray.end(), [&](const std::pair<KeyType, ValueType> &pair) {
+        return pair.first == key;
+    });
+
+    if (overflowResult != m_overflowArray.end()) {
+        return *overflowResult;
+    }
+    return {};
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+std::vector<boost::optional<std::pair<KeyType, ValueType>>>
+RecursiveModelIndex<KeyType, ValueType, secondStageSize>::findSorted(const std::vector<KeyType> &keys) {
+    assert(std::is_sorted(keys.begin(), keys.end()) && "findSorted requires keys in ascending order");
+
+    std::vector<boost::optional<std::pair<KeyType, ValueType>>> results;
+    results.reserve(keys.size());
+
+    // The overflow array is in insertion order, so sort a copy once and merge against it.
+    // Stable so duplicates resolve to the earliest insert, the same as find()
+    std::vector<std::pair<KeyType, ValueType>> sortedOverflow(m_overflowArray);
+    std::stable_sort(sortedOverflow.begin(), sortedOverflow.end(), [](const std::pair<KeyType, ValueType> &p1,
+                                                                      const std::pair<KeyType, ValueType> &p2) {
+        return p1.first < p2.first;
+    });
+
+    size_t overflowPosition = 0;
+    int currentStage = -1;        // Stage that served the last model evaluation
+    size_t lastPosition = 0;      // Lower bound of the last probe, valid for every later (larger) key
+
+    for (const auto &key : keys) {
+        while (overflowPosition < sortedOverflow.size() && sortedOverflow[overflowPosition].first < key) {
+            overflowPosition++;
+        }
+        if (overflowPosition < sortedOverflow.size() && sortedOverflow[overflowPosition].first == key) {
+            results.push_back(sortedOverflow[overflowPosition]);
+            continue;
+        }
+
+        if (m_keys.empty()) {
+            results.push_back({});
+            continue;
+        }
+
+        size_t position;
+        if (!usingLearnedModels()) {
+            position = lowerBound(key, lastPosition);
+        } else if (currentStage >= 0 && key <= m_secondStage[currentStage].getMaxKey()) {
+            // Still inside the stage we used last time, the next hit can't be far
+            position = gallopingLowerBound(m_keys.begin() + lastPosition, m_keys.end(), Encoding::encode(key),
+                                           std::less<EncodedKeyType>()) - m_keys.begin();
+        } else {
+            currentStage = routeToStage(key);
+            const auto &node = m_secondStage[currentStage];
+
+            if (!node.isValid() && !m_modelBlockSize) {
+                currentStage = -1;
+                results.push_back({});
+                continue;
+            }
+
+            if (node.useTree()) {
+                auto treeResult = m_secondStage[currentStage].treeFind(key);
+                if (treeResult) {
+                    lastPosition = std::max(lastPosition, treeResult.get().second);
+                    results.push_back(pairAt(m_runStarts[treeResult.get().second]));
+                } else {
+                    results.push_back({});
+                }
+                continue;
+            }
+
+            position = searchStageWindow(currentStage, key, lastPosition);
+            if (!node.isValid()) {
+                // Served by searching every block first key, the stage's key range means nothing
+                currentStage = -1;
+            }
+        }
+
+        // A miss inside a window doesn't tell us where the key would be, so only move forward on a real lower bound
+        if (isLowerBound(position, key)) {
+            lastPosition = position;
+        }
+
+        if (position < m_keys.size() && m_keys[position] == Encoding::encode(key)) {
+            results.push_back(pairAt(m_runStarts[position]));
+        } else {
+            results.push_back({});
+        }
+    }
+
+    return results;
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+size_t RecursiveModelIndex<KeyType, ValueType, secondStageSize>::lowerBound(KeyType key, size_t hint) {
+    // How far ahead we look before deciding a model evaluation is cheaper than galloping
+    const size_t gallopDistance = 16;
+
+    if (hint >= m_keys.size()) {
+        return m_keys.size();
+    }
+
+    const EncodedKeyType encodedKey = Encoding::encode(key);
+    size_t nearEnd = std::min(hint + gallopDistance, m_keys.size() - 1);
+    if (!(m_keys[nearEnd] < encodedKey)) {
+        return m_keys.lowerBound(hint, nearEnd + 1, encodedKey);
+    }
+
+    if (!usingLearnedModels()) {
+        return interpolationSearch(key, nearEnd + 1);
+    }
+
+    // The key is far away, let the models predict where it lands
+    int stage = routeToStage(key);
+    const auto &node = m_secondStage[stage];
+    if (node.isValid()) {
+        size_t position = m_keys.size();
+        if (node.useTree()) {
+            auto treeResult = m_secondStage[stage].treeFind(key);
             if (treeResult) {
-                return {key, m_data[treeResult.get().second]};
-            } else {
-                return {};
+                position = treeResult.get().second;
             }
         } else {
-            // TODO: Too much casting, long vs size_t vs int... Clean this mess up. Bugs have to be everywhere
-            long predictedIdx = m_secondStage[stage].predict(key, m_data.size());
-            // Search from min to max around predictedIdx
-            size_t startIdx = std::max(static_cast<long>(0), predictedIdx + m_secondStage[stage].getMaxNegativeError());
-            size_t endIdx = std::min(m_data.size() - 1, static_cast<size_t>(predictedIdx + m_secondStage[stage].getMaxPositiveError()));
-
-            auto findResult = std::find_if(m_data.begin() + startIdx, m_data.begin() + endIdx,
-                                           [&](const std::pair<KeyType, ValueType> &pair) {
-                                               return pair.first == key;
-                                           });
-
-            if (findResult != m_data.begin() + endIdx) {
-                return *findResult;
-            } else {
-                return {};
+            position = searchStageWindow(stage, key, nearEnd + 1);
+        }
+
+        if (isLowerBound(position, key)) {
+            return position;
+        }
+
+        // Missed the window, but we still know which side of the prediction the key is on
+        if (position < m_keys.size() && m_keys[position] < encodedKey) {
+            return gallopingLowerBound(m_keys.begin() + position, m_keys.end(), encodedKey,
+                                       std::less<EncodedKeyType>()) - m_keys.begin();
+        }
+        if (position > nearEnd + 1 && position <= m_keys.size()) {
+            return m_keys.lowerBound(nearEnd + 1, position, encodedKey);
+        }
+    }
+
+    return gallopingLowerBound(m_keys.begin() + nearEnd + 1, m_keys.end(), encodedKey,
+                               std::less<EncodedKeyType>()) - m_keys.begin();
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+typename RecursiveModelIndex<KeyType, ValueType, secondStageSize>::LookupExplanation
+RecursiveModelIndex<KeyType, ValueType, secondStageSize>::explain(KeyType key) {
+    LookupExplanation explanation;
+    const EncodedKeyType encodedKey = Encoding::encode(key);
+    if (m_hotKeys.lookup(encodedKey) != HotKeyCache<EncodedKeyType>::notFound) {
+        explanation.cacheHit = true;
+        explanation.found = true;
+        return explanation;
+    }
+
+    for (const auto &pair : m_overflowArray) {
+        explanation.pendingProbes++;
+        if (pair.first == key) {
+            explanation.foundPending = true;
+            explanation.found = true;
+            return explanation;
+        }
+    }
+    if (m_keys.empty()) {
+        return explanation;
+    }
+
+    size_t position;
+    explanation.usedModels = usingLearnedModels();
+    if (!explanation.usedModels) {
+        explanation.window = {0, m_keys.size()};
+        position = interpolationLowerBound(m_keys.begin(), m_keys.end(), encodedKey, [&](EncodedKeyType key) {
+            explanation.comparisons++;
+            return key;
+        }) - m_keys.begin();
+    } else {
+        explanation.leaf = routeToStage(key);
+        if (!m_routeByBoundaries) {
+            explanation.rootPrediction = predictRootFraction(key);
+        }
+
+        const auto &node = m_secondStage[explanation.leaf];
+        const bool isValid = m_leafTable.isCompact(explanation.leaf) || node.isValid();
+        if (!isValid && !m_modelBlockSize) {
+            return explanation;
+        }
+        if (!m_leafTable.isCompact(explanation.leaf) && node.useTree()) {
+            // The tree doesn't count its comparisons, a descent costs about log2 of its size
+            explanation.usedTree = true;
+            explanation.comparisons = static_cast<size_t>(std::ceil(std::log2(node.getTreeSize() + 1.0)));
+            explanation.found = static_cast<bool>(m_secondStage[explanation.leaf].treeFind(key));
+            return explanation;
+        }
+
+        if (isValid) {
+            explanation.leafPrediction = predictStagePosition(explanation.leaf, key);
+        }
+        explanation.window = predictStageWindow(explanation.leaf, key);
+        explanation.comparisons = m_keys.lowerBoundComparisons(explanation.window.first, explanation.window.second, encodedKey);
+        position = m_keys.lowerBound(explanation.window.first, explanation.window.second, encodedKey);
+    }
+
+    explanation.found = position < m_keys.size() && m_keys[position] == encodedKey;
+    return explanation;
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+typename RecursiveModelIndex<KeyType, ValueType, secondStageSize>::LookupCostModel
+RecursiveModelIndex<KeyType, ValueType, secondStageSize>::costModel() {
+    LookupCostModel model;
+    model.pendingProbes = m_overflowArray.size();
+    if (m_keys.empty()) {
+        return model;
+    }
+
+    if (!usingLearnedModels()) {
+        const size_t numSamples = std::min<size_t>(m_keys.size(), 1024);
+        size_t comparisons = 0;
+        for (size_t ii = 0; ii < numSamples; ++ii) {
+            EncodedKeyType key = m_keys[ii * m_keys.size() / numSamples];
+            interpolationLowerBound(m_keys.begin(), m_keys.end(), key, [&](EncodedKeyType key) {
+                comparisons++;
+                return key;
+            });
+        }
+        model.expectedComparisons = static_cast<double>(comparisons) / numSamples;
+        return model;
+    }
+
+    // Counted at training, so this only walks the leaves
+    model.leafSizes = m_leafSizes;
+    model.leafSizes.resize(m_numLeaves, 0);
+    size_t trainedSize = 0;
+    for (size_t leafSize : model.leafSizes) {
+        trainedSize += leafSize;
+    }
+    if (trainedSize == 0) {
+        return model;
+    }
+
+    model.leafComparisons.assign(m_numLeaves, 0.0);
+    double totalComparisons = 0;
+    double totalWindow = 0;
+    size_t windowServedSize = 0;
+    size_t treeServedSize = 0;
+    for (int stage = 0; stage < m_numLeaves; ++stage) {
+        const auto &node = m_secondStage[stage];
+        if (model.leafSizes[stage] == 0) {
+            continue;
+        }
+
+        if (!m_leafTable.isCompact(stage) && node.useTree()) {
+            model.leafComparisons[stage] = std::ceil(std::log2(node.getTreeSize() + 1.0));
+            treeServedSize += model.leafSizes[stage];
+        } else {
+            long width = m_leafTable.isCompact(stage) ?
+                         m_leafTable.getMaxPositiveError(stage) - m_leafTable.getMaxNegativeError(stage) + 1 :
+                         node.getMaxPositiveError() - node.getMaxNegativeError() + 1;
+            width = std::min(width, static_cast<long>(modelKeys().size()));
+            model.leafComparisons[stage] = expectedSimdLowerBoundComparisons(static_cast<size_t>(width));
+            if (m_modelBlockSize) {
+                // The window holds block first keys, then the key is searched inside its block
+                model.leafComparisons[stage] += expectedSimdLowerBoundComparisons(m_modelBlockSize);
             }
+            totalWindow += static_cast<double>(width) * std::max<size_t>(1, m_modelBlockSize) * model.leafSizes[stage];
+            windowServedSize += model.leafSizes[stage];
         }
+        totalComparisons += model.leafComparisons[stage] * model.leafSizes[stage];
+    }
+
+    model.expectedComparisons = totalComparisons / trainedSize;
+    model.averageWindow = windowServedSize ? totalWindow / windowServedSize : 0.0;
+    model.treeServedFraction = static_cast<double>(treeServedSize) / trainedSize;
+    return model;
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+std::vector<size_t> RecursiveModelIndex<KeyType, ValueType, secondStageSize>::getLeafStarts() {
+    std::vector<size_t> leafStarts(1, 0);
+    const bool modelsTrained = m_modelsAreTrained && m_keys.size() >= static_cast<size_t>(m_firstStageParams.batchSize);
+
+    for (size_t ii = 1; ii < m_keys.size() && modelsTrained; ++ii) {
+        int stage = std::max(routeToStage(Encoding::decode(m_keys[ii])), static_cast<int>(leafStarts.size()) - 1);
+        while (static_cast<int>(leafStarts.size()) <= stage) {
+            leafStarts.push_back(ii);
+        }
+    }
+    while (leafStarts.size() <= static_cast<size_t>(m_numLeaves)) {
+        leafStarts.push_back(m_keys.size());
+    }
+    return leafStarts;
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+int RecursiveModelIndex<KeyType, ValueType, secondStageSize>::routeToStage(KeyType key) {
+    if (m_routeByBoundaries) {
+        // Leaf s holds the keys above boundary s - 1, up to and including boundary s
+        return static_cast<int>(simdLowerBound(m_stageBoundaries.data(), m_stageBoundaries.size(), Encoding::encode(key)));
+    }
+
+    float fraction = predictRootFraction(key);
+
+    // Calculate which stage we want to send this data to
+    // If we take the result (unscaled, so closer to 0-1), and multiply by the
+    // number of stages we get an assignment
+    int stage = static_cast<int>(fraction * m_numLeaves);
+
+    // Cap the range of stages to 0 -> (m_numLeaves - 1)
+    stage = std::max(0, stage);
+    stage = std::min(m_numLeaves - 1, stage);
+    return stage;
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+float RecursiveModelIndex<KeyType, ValueType, secondStageSize>::predictRootFraction(KeyType key) {
+    if (m_routeByImportedRoot) {
+        return m_importedRoot.evaluateRoot(modelInput(key));
+    }
+
+    Eigen::Tensor<float, 2> input(1, 1);
+    input(0, 0) = modelInput(key);
+
+    auto result = m_firstStageNetwork->forward<2, 2>(input);
+    return result(0, 0);
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+std::pair<size_t, size_t> RecursiveModelIndex<KeyType, ValueType, secondStageSize>::predictStageWindow(int stage, KeyType key,
+                                                                                                      size_t lowestStart) {
+    const long lastIdx = static_cast<long>(modelKeys().size()) - 1;
+    long predictedIdx = 0;
+    int maxNegativeError;
+    int maxPositiveError;
+    if (!m_leafTable.isCompact(stage) && !m_secondStage[stage].isValid()) {
+        // Only in sparse mode: the leaf got no block first key, so predict an empty window and let
+        // the check below search every block first key
+        maxNegativeError = 0;
+        maxPositiveError = -1;
+    } else if (m_leafTable.isCompact(stage)) {
+        predictedIdx = predictStagePosition(stage, key);
+        maxNegativeError = m_leafTable.getMaxNegativeError(stage);
+        maxPositiveError = m_leafTable.getMaxPositiveError(stage);
     } else {
-        std::cerr << "Key: " << key << " requested an invalid stage two node" << std::endl;
+        predictedIdx = predictStagePosition(stage, key);
+        maxNegativeError = m_secondStage[stage].getMaxNegativeError();
+        maxPositiveError = m_secondStage[stage].getMaxPositiveError();
     }
 
-    return {};
-};
+    // Search from min to max around predictedIdx, both ends inclusive
+    const size_t lowestModelIdx = m_modelBlockSize ? lowestStart / m_modelBlockSize : lowestStart;
+    long startIdx = std::max(static_cast<long>(lowestModelIdx), predictedIdx + maxNegativeError);
+    long endIdx = std::min(lastIdx, predictedIdx + maxPositiveError);
+    startIdx = std::min(startIdx, lastIdx + 1);
+    endIdx = std::max(endIdx, startIdx - 1);
+
+    if (!m_modelBlockSize) {
+        return {static_cast<size_t>(startIdx), static_cast<size_t>(endIdx + 1)};
+    }
+
+    // The window holds block first keys. Keys between them were never trained on, so check the
+    // block found is right and search all the first keys if not
+    const EncodedKeyType encodedKey = Encoding::encode(key);
+    size_t block = m_blockBases.lowerBound(static_cast<size_t>(startIdx), static_cast<size_t>(endIdx + 1), encodedKey);
+    if ((block > 0 && !(m_blockBases[block - 1] < encodedKey)) ||
+        (block < m_blockBases.size() && m_blockBases[block] < encodedKey)) {
+        block = m_blockBases.lowerBound(0, m_blockBases.size(), encodedKey);
+    }
+
+    // The previous block's first key is below key and this block's isn't, so the answer is in between
+    size_t first = block == 0 ? 0 : (block - 1) * m_modelBlockSize + 1;
+    size_t last = std::min(m_keys.size(), block * m_modelBlockSize + 1);
+    first = std::min(std::max(first, lowestStart), m_keys.size());
+    return {first, std::max(first, last)};
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+bool RecursiveModelIndex<KeyType, ValueType, secondStageSize>::isLowerBound(size_t position, KeyType key) const {
+    const EncodedKeyType encodedKey = Encoding::encode(key);
+    if (position > 0 && !(m_keys[position - 1] < encodedKey)) {
+        return false;
+    }
+    return position == m_keys.size() || !(m_keys[position] < encodedKey);
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+size_t RecursiveModelIndex<KeyType, ValueType, secondStageSize>::interpolationSearch(KeyType key, size_t first) const {
+    first = std::min(first, m_keys.size());
+    return interpolationLowerBound(m_keys.begin() + first, m_keys.end(), Encoding::encode(key), [](EncodedKeyType key) {
+        return key;
+    }) - m_keys.begin();
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+void RecursiveModelIndex<KeyType, ValueType, secondStageSize>::load(const std::vector<std::pair<KeyType, ValueType>> &data) {
+    appendData(data.begin(), data.end());
+    sortData();
+    buildRuns();
+
+    // The models no longer describe m_data, serve from interpolation search until the next train()
+    m_modelsAreTrained = false;
+    m_leafTable.clear();
+    m_hotKeys.clear();
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+void RecursiveModelIndex<KeyType, ValueType, secondStageSize>::sortData() {
+    // Only (key, slot) pairs move, and slots are in arrival order so duplicates keep their insertion order
+    std::sort(m_data.begin(), m_data.end(), [](const std::pair<KeyType, uint32_t> &p1, const std::pair<KeyType, uint32_t> &p2) {
+        return p1.first < p2.first || (p1.first == p2.first && p1.second < p2.second);
+    });
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+template <typename Iterator>
+void RecursiveModelIndex<KeyType, ValueType, secondStageSize>::appendData(Iterator first, Iterator last) {
+    assert(m_values.size() + std::distance(first, last) <= std::numeric_limits<uint32_t>::max() && "Too many values for 32 bit slots");
+    m_data.reserve(m_data.size() + std::distance(first, last));
+    m_values.reserve(m_values.size() + std::distance(first, last));
+    for (Iterator it = first; it != last; ++it) {
+        m_data.push_back({it->first, static_cast<uint32_t>(m_values.size())});
+        m_values.push_back(std::move(it->second));
+    }
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+void RecursiveModelIndex<KeyType, ValueType, secondStageSize>::buildRuns() {
+    std::vector<EncodedKeyType> keys;
+    m_runStarts.clear();
+
+    for (size_t ii = 0; ii < m_data.size(); ++ii) {
+        EncodedKeyType encodedKey = Encoding::encode(m_data[ii].first);
+        if (ii == 0 || encodedKey != keys.back()) {
+            keys.push_back(encodedKey);
+            m_runStarts.push_back(ii);
+        }
+    }
+    m_runStarts.push_back(m_data.size());
+
+    m_keys.assign(std::move(keys));
+    m_runStarts.shrink_to_fit();
+}
 
 template <typename KeyType, typename ValueType, int secondStageSize>
 void RecursiveModelIndex<KeyType, ValueType, secondStageSize>::train() {
     std::cout << "Retraining..." << std::endl;
-    m_data.insert(m_data.end(), m_overflowArray.begin(), m_overflowArray.end());
+    mergePending();
+    trainModels();
+}
 
-    // Sort data
-    std::sort(m_data.begin(), m_data.end(), [](std::pair<KeyType, ValueType> p1, std::pair<KeyType, ValueType> p2) {
-        return p1.first < p2.first;
-    });
+template <typename KeyType, typename ValueType, int secondStageSize>
+void RecursiveModelIndex<KeyType, ValueType, secondStageSize>::mergePending() {
+    appendData(m_overflowArray.begin(), m_overflowArray.end());
 
-    trainFirstStage();
-    trainSecondStage();
+    // Sort data
+    sortData();
+    buildRuns();
 
     // Clear out overflow tree
     m_overflowArray.clear();
     m_currentOverflowSize = 0;
+    m_hotKeys.clear();
+
+    // Until training finishes, lookups fall back to interpolation search over the new data
+    m_modelsAreTrained = false;
+
+    m_leafTable.clear();
+    if (!m_data.empty()) {
+        m_keyOrigin = m_data.front().first;
+    }
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+void RecursiveModelIndex<KeyType, ValueType, secondStageSize>::trainModels() {
+    m_modelsAreTrained = false;
+    m_leafTable.clear();
+    m_leafSizes.clear();
+    m_modelBlockSize = m_sparseBlockSize;
+    buildBlockBases();
+
+    // Too few keys to fill a batch, interpolation search over them is as fast as any model
+    if (modelKeys().size() < static_cast<size_t>(m_firstStageParams.batchSize)) {
+        m_modelsAreUsable = false;
+    } else {
+        int numLeaves = m_useImportedWeights ? m_numLeaves : chooseNumLeaves();
+        if (numLeaves != m_numLeaves) {
+            m_numLeaves = numLeaves;
+            m_secondStage.clear();
+            for (int ii = 0; ii < m_numLeaves; ++ii) {
+                m_secondStage.emplace_back(SecondStageNode<KeyType>(m_maxSecondStageError, m_secondStageParams.batchSize));
+            }
+        }
+        for (auto &node : m_secondStage) {
+            node.setPositionErrorThreshold(m_modelBlockSize ? std::numeric_limits<int>::max() : m_maxSecondStageError);
+        }
+        trainFirstStage();
+        trainSecondStage();
+        if (m_useCompactLeaves) {
+            buildLeafTable();
+        }
+    }
+
+    m_modelsAreTrained = true;
+    m_trainingGeneration++;
+    if (m_drift.isEnabled()) {
+        resetDrift();
+    }
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+void RecursiveModelIndex<KeyType, ValueType, secondStageSize>::buildBlockBases() {
+    std::vector<EncodedKeyType> bases;
+    if (m_modelBlockSize) {
+        bases.reserve((m_keys.size() + m_modelBlockSize - 1) / m_modelBlockSize);
+        for (size_t ii = 0; ii < m_keys.size(); ii += m_modelBlockSize) {
+            bases.push_back(m_keys[ii]);
+        }
+    }
+    m_blockBases.assign(std::move(bases));
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+int RecursiveModelIndex<KeyType, ValueType, secondStageSize>::chooseNumLeaves() const {
+    double numLeaves = m_numLeaves;
+    switch (m_fanoutPolicy.mode) {
+        case FanoutPolicy::Mode::Fixed:
+            return m_numLeaves;
+        case FanoutPolicy::Mode::KeysPerLeaf:
+            numLeaves = std::ceil(m_keys.size() / std::max(1.0, m_fanoutPolicy.target));
+            break;
+        case FanoutPolicy::Mode::TargetWindow:
+            if (m_averageWindow > 0 && m_averageWindowKeys > 0) {
+                double grownWindow = m_averageWindow * m_keys.size() / m_averageWindowKeys;
+                numLeaves = std::ceil(m_numLeaves * grownWindow / std::max(1.0, m_fanoutPolicy.target));
+            }
+            break;
+    }
+    numLeaves = std::max(numLeaves, static_cast<double>(m_fanoutPolicy.minLeaves));
+    numLeaves = std::min(numLeaves, static_cast<double>(m_fanoutPolicy.maxLeaves));
+    return std::max(1, static_cast<int>(numLeaves));
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+void RecursiveModelIndex<KeyType, ValueType, secondStageSize>::resetDrift() {
+    if (m_leafSizes.empty()) {
+        // No models to drift from
+        m_drift.reset(std::vector<size_t>(), 0.0f);
+        return;
+    }
+
+    // Inserts are whole keys, so a sparse mode leaf stands for a block of keys per first key
+    std::vector<size_t> leafSizes(m_leafSizes);
+    for (auto &leafSize : leafSizes) {
+        leafSize *= std::max<size_t>(1, m_modelBlockSize);
+    }
+    m_drift.reset(std::move(leafSizes), m_rootMisrouted);
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+void RecursiveModelIndex<KeyType, ValueType, secondStageSize>::countLeafSizes(
+        const std::vector<std::vector<std::pair<KeyType, size_t>>> &perStageDataset) {
+    const size_t numKeys = modelKeys().size();
+    m_leafSizes.assign(m_numLeaves, 0);
+    size_t misrouted = 0;
+    for (int stage = 0; stage < m_numLeaves; ++stage) {
+        m_leafSizes[stage] = perStageDataset[stage].size();
+        for (const auto &pair : perStageDataset[stage]) {
+            int idealStage = static_cast<int>(static_cast<double>(pair.second) / numKeys * m_numLeaves);
+            if (std::abs(idealStage - stage) > 1) {
+                misrouted++;
+            }
+        }
+    }
+    m_rootMisrouted = numKeys ? static_cast<float>(misrouted) / numKeys : 0.0f;
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+typename RecursiveModelIndex<KeyType, ValueType, secondStageSize>::DriftReport
+RecursiveModelIndex<KeyType, ValueType, secondStageSize>::measureDrift(float leafThreshold, float rootThreshold) {
+    auto trainedRank = [this](KeyType key) {
+        return m_keys.lowerBound(0, m_keys.size(), Encoding::encode(key));
+    };
+    auto route = [this](KeyType key) {
+        return routeToStage(key);
+    };
+    return m_drift.report(m_keys.size(), trainedRank, route, leafThreshold, rootThreshold);
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+void RecursiveModelIndex<KeyType, ValueType, secondStageSize>::trainLeaves(const std::vector<int> &leaves) {
+    const KeyColumn<EncodedKeyType> &keys = modelKeys();
+    if (!m_modelsAreTrained || !m_modelsAreUsable || keys.size() < static_cast<size_t>(m_firstStageParams.batchSize)) {
+        train();
+        return;
+    }
+
+    std::vector<bool> retrain(m_numLeaves, false);
+    for (int leaf : leaves) {
+        assert(leaf >= 0 && leaf < m_numLeaves && "Leaf out of range");
+        retrain[leaf] = true;
+    }
+
+    // Remember each kept leaf's line and where its first key sits before merging
+    const size_t oldSize = keys.size();
+    std::vector<std::pair<float, float>> lines(m_numLeaves);
+    std::vector<size_t> oldStarts(m_numLeaves);
+    for (int stage = 0; stage < m_numLeaves; ++stage) {
+        auto &node = m_secondStage[stage];
+        if (!node.isValid() || node.useTree()) {
+            retrain[stage] = true;
+        }
+        if (!retrain[stage]) {
+            lines[stage] = node.getLinearModel(oldSize);
+            oldStarts[stage] = keys.lowerBound(0, oldSize, Encoding::encode(node.getMinKey()));
+        }
+    }
+
+    // The root and the kept leaves take inputs relative to the old origin
+    const KeyType keyOrigin = m_keyOrigin;
+    mergePending();
+    m_keyOrigin = keyOrigin;
+    buildBlockBases();
+
+    std::vector<std::vector<std::pair<KeyType, size_t>>> perStageDataset(m_numLeaves);
+    for (size_t ii = 0; ii < keys.size(); ++ii) {
+        KeyType key = Encoding::decode(keys[ii]);
+        perStageDataset[routeToStage(key)].push_back({key, ii});
+    }
+    countLeafSizes(perStageDataset);
+
+    size_t treeServedSize = 0;
+    auto inputOf = [this](KeyType key) {
+        return modelInput(key);
+    };
+    const float total = static_cast<float>(keys.size());
+    for (int stage = 0; stage < m_numLeaves; ++stage) {
+        if (retrain[stage]) {
+            m_secondStage[stage].train(perStageDataset[stage], m_secondStageParams, keys.size(), inputOf);
+        } else {
+            // Keys never leave, so the old first key finds where the leaf moved to
+            float shift = static_cast<float>(keys.lowerBound(0, keys.size(), Encoding::encode(m_secondStage[stage].getMinKey()))) -
+                          static_cast<float>(oldStarts[stage]);
+            m_secondStage[stage].assignLinearModel(perStageDataset[stage], lines[stage].first / total,
+                                                   (lines[stage].second + shift) / total, keys.size(), inputOf);
+        }
+        if (m_secondStage[stage].useTree()) {
+            treeServedSize += perStageDataset[stage].size();
+        }
+    }
+
+    m_modelsAreUsable = treeServedSize * 2 <= keys.size();
+    if (m_useCompactLeaves) {
+        buildLeafTable();
+    }
+    m_modelsAreTrained = true;
+    m_trainingGeneration++;
+    if (m_drift.isEnabled()) {
+        resetDrift();
+    }
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+bool RecursiveModelIndex<KeyType, ValueType, secondStageSize>::importWeights(const ModelWeights &weights) {
+    if (weights.leaves.size() != static_cast<size_t>(m_numLeaves)) {
+        std::cerr << "Weights have " << weights.leaves.size() << " leaves, expected " << m_numLeaves << std::endl;
+        return false;
+    }
+    if (weights.hiddenBiases.size() != weights.hiddenWeights.size()) {
+        std::cerr << "Weights have " << weights.hiddenBiases.size() << " hidden biases, expected "
+                  << weights.hiddenWeights.size() << std::endl;
+        return false;
+    }
+    if (weights.outputWeights.size() != weights.hiddenWeights.size()) {
+        std::cerr << "Weights have " << weights.outputWeights.size() << " output weights, expected "
+                  << weights.hiddenWeights.size() << std::endl;
+        return false;
+    }
+    m_importedWeights = weights;
+    m_useImportedWeights = true;
+    return true;
 }
 
 template <typename KeyType, typename ValueType, int secondStageSize>
 void RecursiveModelIndex<KeyType, ValueType, secondStageSize>::trainFirstStage() {
+    const KeyColumn<EncodedKeyType> &keys = modelKeys();
+    m_routeByImportedRoot = m_useImportedWeights;
+    if (m_useImportedWeights) {
+        m_importedRoot = m_importedWeights;
+        return;
+    }
+
     // TODO: Do we want to clear out the old network or use it's previous weights?
     std::cout << "Training first stage" << std::endl;
 
@@ -216,18 +1614,18 @@ void RecursiveModelIndex<KeyType, ValueType, secondStageSize>::trainFirstStage()
     Eigen::Tensor<float, 2> positions(m_firstStageParams.batchSize, 1);
 
     for (int currentEpoch = 0; currentEpoch < m_firstStageParams.maxNumEpochs; ++currentEpoch) {
-        auto newBatch = getRandomBatch<KeyType>(m_firstStageParams.batchSize, m_data.size());
+        auto newBatch = getRandomBatch<size_t>(m_firstStageParams.batchSize, keys.size());
         int ii = 0;
         for (auto idx : newBatch) {
             // Input is the key
-            input(ii, 0) = static_cast<float>(m_data[idx].first);
+            input(ii, 0) = modelInput(Encoding::decode(keys[idx]));
             // Label is the position in our sorted array
             positions(ii, 0) = static_cast<float>(idx);
             ii++;
         }
 
         auto result = m_firstStageNetwork->forward<2, 2>(input);
-        result = result * result.constant(m_data.size());
+        result = result * result.constant(keys.size());
 
         auto loss = lossFunction.loss(result, positions);
         // TODO: Add logging, make this Debug
@@ -236,7 +1634,7 @@ void RecursiveModelIndex<KeyType, ValueType, secondStageSize>::trainFirstStage()
         auto lossBack = lossFunction.backward(result, positions);
         // Divide loss back by dataset size to stabilize training and remove relationship between
         // learning rate and dataset size
-        lossBack = lossBack / lossBack.constant(m_data.size());
+        lossBack = lossBack / lossBack.constant(keys.size());
 
         m_firstStageNetwork->backward<2>(lossBack);
         m_firstStageNetwork->step();
@@ -245,33 +1643,109 @@ void RecursiveModelIndex<KeyType, ValueType, secondStageSize>::trainFirstStage()
 
 template <typename KeyType, typename ValueType, int secondStageSize>
 void RecursiveModelIndex<KeyType, ValueType, secondStageSize>::trainSecondStage() {
+    const KeyColumn<EncodedKeyType> &keys = modelKeys();
     std::cout << "Creating per stage dataset" << std::endl;
 
     // Create training sets for second stage models
-    std::array<std::vector<std::pair<KeyType, size_t>>, secondStageSize> perStageDataset;
-    Eigen::Tensor<float, 2> predictInput(1, 1);
-    for (int ii = 0; ii < m_data.size(); ++ii) {
-        predictInput(0, 0) = static_cast<float>(m_data[ii].first);
-
-        // Get result from first stage, and then scale
-        auto result = m_firstStageNetwork->forward<2, 2>(predictInput);
-        auto resultIdx = result * result.constant(m_data.size());
-
-        // Calculate which stage we want to send this data to
-        // If we take the result (unscaled, so closer to 0-1), and multiply by the
-        // number of stages we get an assignment
-        int stage = static_cast<int>(result(0, 0) * secondStageSize);
+    m_routeByBoundaries = false;
+    m_stageBoundaries.clear();
+    std::vector<std::vector<std::pair<KeyType, size_t>>> perStageDataset(m_numLeaves);
+    for (size_t ii = 0; ii < keys.size(); ++ii) {
+        KeyType key = Encoding::decode(keys[ii]);
+        int stage = routeToStage(key);
+        if (m_routingMode == RoutingMode::BoundaryTable) {
+            // Never route a key below the previous one, so every leaf owns one contiguous range.
+            // The first key always starts leaf 0, so no leaf before it is left without a boundary
+            stage = ii == 0 ? 0 : std::max(stage, static_cast<int>(m_stageBoundaries.size()));
+            while (static_cast<int>(m_stageBoundaries.size()) < stage) {
+                m_stageBoundaries.push_back(keys[ii - 1]);
+            }
+        }
+        perStageDataset[stage].push_back({key, ii});
+    }
 
-        // Cap the range of stages to 0 -> (secondStageSize - 1)
-        stage = std::max(0, stage);
-        stage = std::min(secondStageSize - 1, stage);
-        perStageDataset[stage].push_back({m_data[ii].first, ii});
+    if (m_routingMode == RoutingMode::BoundaryTable) {
+        // Leaves after the last key's leaf end at the last key, so larger keys fall past them
+        while (m_stageBoundaries.size() < static_cast<size_t>(m_numLeaves - 1)) {
+            m_stageBoundaries.push_back(keys[keys.size() - 1]);
+        }
+        m_routeByBoundaries = true;
     }
+    countLeafSizes(perStageDataset);
 
     std::cout << "Training second stage" << std::endl;
     // Train each stage
-    for (int stage = 0; stage < secondStageSize; ++stage) {
-        m_secondStage[stage].train(perStageDataset[stage], m_secondStageParams, m_data.size());
+    size_t treeServedSize = 0;
+    double totalWindow = 0;
+    auto inputOf = [this](KeyType key) {
+        return modelInput(key);
+    };
+    for (int stage = 0; stage < m_numLeaves; ++stage) {
+        if (m_useImportedWeights) {
+            const auto &leaf = m_importedWeights.leaves[stage];
+            m_secondStage[stage].assignLinearModel(perStageDataset[stage], leaf.first, leaf.second, keys.size(), inputOf);
+        } else {
+            m_secondStage[stage].train(perStageDataset[stage], m_secondStageParams, keys.size(), inputOf);
+        }
+        if (m_secondStage[stage].useTree()) {
+            treeServedSize += perStageDataset[stage].size();
+        } else if (m_secondStage[stage].isValid()) {
+            long width = m_secondStage[stage].getMaxPositiveError() - m_secondStage[stage].getMaxNegativeError() + 1;
+            totalWindow += static_cast<double>(width) * perStageDataset[stage].size();
+        }
+    }
+    size_t windowServedSize = keys.size() - treeServedSize;
+    m_averageWindow = windowServedSize ? totalWindow / windowServedSize * std::max<size_t>(1, m_modelBlockSize) : 0.0;
+    m_averageWindowKeys = m_keys.size();
+
+    // If the data doesn't model well most keys end up in fallback trees, at which point
+    // interpolation search over the whole array is the better floor
+    m_modelsAreUsable = treeServedSize * 2 <= keys.size();
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+void RecursiveModelIndex<KeyType, ValueType, secondStageSize>::setCompactLeaves(bool enabled) {
+    m_useCompactLeaves = enabled;
+    m_leafTable.clear();
+    if (enabled && m_modelsAreTrained && m_keys.size() >= static_cast<size_t>(m_firstStageParams.batchSize)) {
+        buildLeafTable();
+    }
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+void RecursiveModelIndex<KeyType, ValueType, secondStageSize>::buildLeafTable() {
+    const KeyColumn<EncodedKeyType> &keys = modelKeys();
+    m_leafTable.reset(m_numLeaves);
+    for (int stage = 0; stage < m_numLeaves; ++stage) {
+        auto &node = m_secondStage[stage];
+        if (node.isValid() && !node.useTree()) {
+            auto line = node.getLinearModel(keys.size());
+            m_leafTable.setModel(stage, line.first, line.second, modelInput(node.getMinKey()), modelInput(node.getMaxKey()));
+        }
+    }
+
+    // The stored errors must cover the quantized predictions, not the original ones
+    std::vector<long> maxNegativeErrors(m_numLeaves, 0);
+    std::vector<long> maxPositiveErrors(m_numLeaves, 0);
+    std::vector<bool> isLinear(m_numLeaves);
+    for (int stage = 0; stage < m_numLeaves; ++stage) {
+        isLinear[stage] = m_secondStage[stage].isValid() && !m_secondStage[stage].useTree();
+    }
+
+    for (size_t ii = 0; ii < keys.size(); ++ii) {
+        KeyType key = Encoding::decode(keys[ii]);
+        int stage = routeToStage(key);
+        if (isLinear[stage]) {
+            long error = static_cast<long>(ii) - m_leafTable.predict(stage, modelInput(key));
+            maxNegativeErrors[stage] = std::min(maxNegativeErrors[stage], error);
+            maxPositiveErrors[stage] = std::max(maxPositiveErrors[stage], error);
+        }
+    }
+
+    for (int stage = 0; stage < m_numLeaves; ++stage) {
+        if (isLinear[stage]) {
+            m_leafTable.setErrors(stage, maxNegativeErrors[stage], maxPositiveErrors[stage]);
+        }
     }
 }
 
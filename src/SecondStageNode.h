@@ -29,6 +29,10 @@ public:
 
     /**
      * @brief Create a second stage
+     *
+     * The network is only created when the node is first trained on data, so a large second stage
+     * whose leaves mostly stay empty (or get assigned models) costs next to nothing to construct.
+     *
      * @param positionErrorThreshold [in]: The error threshold before we switch to a BTree
      * @param netBatchSize [in]: The batch size to initialize the net with for training
      */
@@ -37,47 +41,97 @@ public:
     /**
      * @brief Whether the current node is valid
      */
-    bool isValid() {
+    bool isValid() const {
         return m_nodeIsValid;
     }
 
     /**
      * @return Return the max negative error of this stage
      */
-    int getMaxNegativeError() {
+    int getMaxNegativeError() const {
         return m_maxNegativeError;
     }
 
     /**
      * @return Return the max positive error of this stage
      */
-    int getMaxPositiveError() {
+    int getMaxPositiveError() const {
         return m_maxPositiveError;
     }
 
+    /**
+     * @return The smallest key this stage was trained on
+     */
+    KeyType getMinKey() const {
+        return m_minKey;
+    }
+
+    /**
+     * @return The largest key this stage was trained on
+     */
+    KeyType getMaxKey() const {
+        return m_maxKey;
+    }
+
     /**
      * @brief Predict a location with the network
-     * @param key [in]: Key to use as input
+     * @param modelInput [in]: The network input for the key (see KeyEncoding::toModelInput)
+     * @param totalDatasetSize [in]: The dataset size of the WHOLE dataset
+     * @return A predicted location (may fall outside the dataset, callers clamp)
+     */
+    long predict(float modelInput, size_t totalDatasetSize);
+
+    /**
+     * @brief The network as a line, since a single Dense layer is exactly slope * input + intercept
      * @param totalDatasetSize [in]: The dataset size of the WHOLE dataset
-     * @return A predicted location
+     * @return (slope, intercept), in positions
      */
-    size_t predict(KeyType key, size_t totalDatasetSize);
+    std::pair<float, float> getLinearModel(size_t totalDatasetSize);
 
     /**
      * @brief Train this stages network
      * @param data [in]: A reference to the training data (key, idx)
      * @param trainingParameters [in]: The current network parameters
      * @param totalDatasetSize [in]: The size of the WHOLE dataset
+     * @param modelInput [in]: Maps a key to its network input
+     */
+    template <typename ModelInputFunc>
+    void train(const std::vector<std::pair<KeyType, size_t>> &data, const NetworkParameters &trainingParameters,
+               size_t totalDatasetSize, ModelInputFunc modelInput);
+
+    /**
+     * @brief Use a line trained elsewhere (e.g. imported weights) instead of training, only measuring its errors
+     * @param data [in]: A reference to the training data (key, idx)
+     * @param weight [in]: The Linear(1, 1) weight, predicting a fraction of the WHOLE dataset
+     * @param bias [in]: The Linear(1, 1) bias
+     * @param totalDatasetSize [in]: The size of the WHOLE dataset
+     * @param modelInput [in]: Maps a key to its network input
      */
-    void train(const std::vector<std::pair<KeyType, size_t>> &data, const NetworkParameters &trainingParameters, size_t totalDatasetSize);
+    template <typename ModelInputFunc>
+    void assignLinearModel(const std::vector<std::pair<KeyType, size_t>> &data, float weight, float bias,
+                           size_t totalDatasetSize, ModelInputFunc modelInput);
 
     /**
      * @return Whether to use the tree
      */
-    bool useTree() {
+    bool useTree() const {
         return m_useTree;
     }
 
+    /**
+     * @brief Change the max position error before the next training falls back to the tree
+     */
+    void setPositionErrorThreshold(int positionErrorThreshold) {
+        m_positionErrorThreshold = positionErrorThreshold;
+    }
+
+    /**
+     * @return Number of keys in the tree
+     */
+    size_t getTreeSize() const {
+        return m_tree.size();
+    }
+
     /**
      * @brief Use the tree to find an item
      * @param key [in]: The key to use to search
@@ -86,14 +140,28 @@ public:
     boost::optional<std::pair<KeyType, size_t>> treeFind(KeyType key);
 
 private:
+
+    /**
+     * @brief Measure the error bounds of the current model over its data, switching to the tree if they're too large
+     */
+    template <typename ModelInputFunc>
+    void measureErrors(const std::vector<std::pair<KeyType, size_t>> &data, size_t totalDatasetSize,
+                       ModelInputFunc modelInput);
+
     bool m_useTree;                           ///< Whether to use the tree or not
     int m_positionErrorThreshold;             ///< The max position error before swapping to a BTree
     bool m_nodeIsValid;                       ///< Whether this node is valid (has data)
 
     /// Net related items
-    std::unique_ptr<nn::Net<float>> m_net;    ///< Our network for this stage
+    std::unique_ptr<nn::Net<float>> m_net;    ///< Our network for this stage, created on first training
+    int m_netBatchSize;                       ///< Batch size m_net is (or will be) created with
+    bool m_useAssignedModel;                  ///< Whether predictions come from the assigned line instead of m_net
+    float m_assignedWeight;                   ///< Assigned line weight, when used
+    float m_assignedBias;                     ///< Assigned line bias, when used
     int m_maxNegativeError;                   ///< Max error (negative) of a prediction
     int m_maxPositiveError;                   ///< Max error (positive) of a prediction
+    KeyType m_minKey;                         ///< Smallest key routed to this stage
+    KeyType m_maxKey;                         ///< Largest key routed to this stage
 
     /// Tree related items
     btree::btree_map<KeyType, size_t> m_tree; ///< The tree if needed
@@ -102,11 +170,9 @@ private:
 template <typename KeyType>
 SecondStageNode<KeyType>::SecondStageNode(int positionErrorThreshold, int netBatchSize):
     m_useTree(false), m_positionErrorThreshold(positionErrorThreshold), m_nodeIsValid(false),
-    m_maxNegativeError(0), m_maxPositiveError(0)
+    m_netBatchSize(netBatchSize), m_useAssignedModel(false), m_assignedWeight(0), m_assignedBias(0),
+    m_maxNegativeError(0), m_maxPositiveError(0), m_minKey(), m_maxKey()
 {
-    // Init net
-    m_net.reset(new nn::Net<float>());
-    m_net->add(new nn::Dense<float, 2>(netBatchSize, 1, 1, true, nn::InitializationScheme::GlorotNormal));
 }
 
 template <typename KeyType>
@@ -121,34 +187,67 @@ boost::optional<std::pair<KeyType, size_t>> SecondStageNode<KeyType>::treeFind(K
 }
 
 template <typename KeyType>
-size_t SecondStageNode<KeyType>::predict(KeyType key, size_t totalDatasetSize) {
+long SecondStageNode<KeyType>::predict(float modelInput, size_t totalDatasetSize) {
+    if (m_useAssignedModel) {
+        return static_cast<long>((m_assignedWeight * modelInput + m_assignedBias) * totalDatasetSize);
+    }
+    assert(m_net && "Called predict on a node that was never trained");
+
     Eigen::Tensor<float, 2> input(1, 1);
-    input(0, 0) = static_cast<float>(key);
+    input(0, 0) = modelInput;
 
     auto result = m_net->forward<2, 2>(input);
     result = result * result.constant(totalDatasetSize);
-    return static_cast<size_t>(result(0, 0));
+    return static_cast<long>(result(0, 0));
 }
 
 template <typename KeyType>
+std::pair<float, float> SecondStageNode<KeyType>::getLinearModel(size_t totalDatasetSize) {
+    if (m_useAssignedModel) {
+        return {m_assignedWeight * totalDatasetSize, m_assignedBias * totalDatasetSize};
+    }
+    assert(m_net && "Called getLinearModel on a node that was never trained");
+
+    // Evaluate at 0 and 1 rather than reaching into the layer's weights
+    Eigen::Tensor<float, 2> input(2, 1);
+    input(0, 0) = 0.0f;
+    input(1, 0) = 1.0f;
+
+    auto result = m_net->forward<2, 2>(input);
+    float intercept = result(0, 0) * totalDatasetSize;
+    float slope = (result(1, 0) - result(0, 0)) * totalDatasetSize;
+    return {slope, intercept};
+}
+
+template <typename KeyType>
+template <typename ModelInputFunc>
 void SecondStageNode<KeyType>::train(const std::vector<std::pair<KeyType, size_t>> &data,
-                                 const NetworkParameters &trainingParameters, size_t totalDatasetSize) {
+                                     const NetworkParameters &trainingParameters, size_t totalDatasetSize,
+                                     ModelInputFunc modelInput) {
     size_t trainingDatasetSize = data.size();
 
     if (trainingDatasetSize == 0) {
         // TODO: Flag the object somehow...
         std::cerr << "Dataset for this stage is empty" << std::endl;
         m_nodeIsValid = false;
+        m_useTree = false;
+        m_tree.clear();
         return;
     }
     // If we have data, we have a valid node
     m_nodeIsValid = true;
+    m_useAssignedModel = false;
+
+    // Data arrives in sorted order, so the key range is just the ends
+    m_minKey = data.front().first;
+    m_maxKey = data.back().first;
 
     // Make sure batchSize is <= dataset size
     int batchSize = std::min(trainingParameters.batchSize, static_cast<int>(trainingDatasetSize));
 
-    // If batch size is smaller than what we preassigned, reassign net
-    if (batchSize < trainingParameters.batchSize) {
+    // Create the net on first use, or again if the batch size changed
+    if (!m_net || batchSize != m_netBatchSize) {
+        m_netBatchSize = batchSize;
         m_net.reset(new nn::Net<float>());
         m_net->add(new nn::Dense<float, 2>(batchSize, 1, 1, true, nn::InitializationScheme::GlorotNormal));
     }
@@ -161,12 +260,12 @@ void SecondStageNode<KeyType>::train(const std::vector<std::pair<KeyType, size_t
 
     // Train this stage
     for (int currentEpoch = 0; currentEpoch < trainingParameters.maxNumEpochs; ++currentEpoch) {
-        auto newBatch = getRandomBatch<KeyType>(batchSize, trainingDatasetSize);
+        auto newBatch = getRandomBatch<size_t>(batchSize, trainingDatasetSize);
         int ii = 0;
         for (auto idx : newBatch) {
             // In this stage, perStageDataset is pair {key, idx}
             // Input is the key
-            input(ii, 0) = static_cast<float>(data[idx].first);
+            input(ii, 0) = modelInput(data[idx].first);
             // Label is the position in our sorted array
             positions(ii, 0) = static_cast<float>(data[idx].second);
             ii++;
@@ -186,21 +285,41 @@ void SecondStageNode<KeyType>::train(const std::vector<std::pair<KeyType, size_t
         m_net->step();
     }
 
-    // Now calculate our error
-    Eigen::Tensor<float, 2> testInput(1, 1);
+    measureErrors(data, totalDatasetSize, modelInput);
+}
+
+template <typename KeyType>
+template <typename ModelInputFunc>
+void SecondStageNode<KeyType>::assignLinearModel(const std::vector<std::pair<KeyType, size_t>> &data, float weight,
+                                                 float bias, size_t totalDatasetSize, ModelInputFunc modelInput) {
+    m_nodeIsValid = !data.empty();
+    m_useAssignedModel = true;
+    m_assignedWeight = weight;
+    m_assignedBias = bias;
+    if (!m_nodeIsValid) {
+        m_useTree = false;
+        m_tree.clear();
+        return;
+    }
+
+    m_minKey = data.front().first;
+    m_maxKey = data.back().first;
+    measureErrors(data, totalDatasetSize, modelInput);
+}
+
+template <typename KeyType>
+template <typename ModelInputFunc>
+void SecondStageNode<KeyType>::measureErrors(const std::vector<std::pair<KeyType, size_t>> &data,
+                                             size_t totalDatasetSize, ModelInputFunc modelInput) {
     long currentMaxAbsoluteError = 0;
     m_maxNegativeError = 0;
     m_maxPositiveError = 0;
 
-    for (int ii = 0; ii < trainingDatasetSize; ++ii) {
+    for (size_t ii = 0; ii < data.size(); ++ii) {
         const KeyType &key = data[ii].first;
         const size_t &idx = data[ii].second;
-        testInput(0, 0) = static_cast<float>(key);
-
-        auto result = m_net->forward<2, 2>(testInput);
-        result = result * result.constant(totalDatasetSize);
 
-        long predictedIdx = static_cast<long>(result(0, 0));
+        long predictedIdx = predict(modelInput(key), totalDatasetSize);
         auto error = static_cast<long>(idx) - predictedIdx;
 
         if (error < m_maxNegativeError) {
@@ -216,6 +335,7 @@ void SecondStageNode<KeyType>::train(const std::vector<std::pair<KeyType, size_t
         }
     }
 
+    m_tree.clear();
     if (currentMaxAbsoluteError > m_positionErrorThreshold) {
         m_useTree = true;
         for (size_t ii = 0; ii < data.size(); ++ii) {
@@ -0,0 +1,351 @@
+/**
+ * @file SnapshotIndex.h
+ *
+ * @breif Consistent, lock free snapshot reads over published index versions and a sequenced insert log
+ *
+ * @date 1/07/2018
+ * @author Ben Caine
+ */
+
+#ifndef LEARNED_INDICES_SNAPSHOTINDEX_H
+#define LEARNED_INDICES_SNAPSHOTINDEX_H
+
+#include "FrozenIndex.h"
+#include "RecursiveModelIndex.h"
+#include "utils/EpochManager.h"
+#include <atomic>
+#include <cerrno>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * @brief An index whose readers see one consistent version, however many lookups they make
+ *
+ * Every insert gets the next sequence number and is appended to the current version's delta log.
+ * publish() retrains on everything inserted so far and installs a new version: a FrozenIndex of
+ * the data up to some sequence number plus an empty log. A Snapshot pins one version and the
+ * sequence number current when it was taken, so it sees exactly the inserts before it, never
+ * part of a later batch or a half installed retrain.
+ *
+ * Readers never lock: they pin an epoch (see EpochManager), load the current version and read
+ * the log up to their sequence number. Replaced versions are freed once no snapshot pins them.
+ * Writers (insert() and publish()) are serialized by a mutex.
+ *
+ * With RetrainStrategy::ForkedChild, publish() only merges pending inserts in process, then forks a
+ * child that trains against a copy on write view of the data and freezes the result straight into
+ * a file, which the parent maps as the new version. The data is never duplicated: peak overhead is
+ * the models plus whatever pages concurrent inserts dirty, and inserts carry on while it trains.
+ *
+ * @tparam KeyType: The key type of the index
+ * @tparam ValueType: The value type, stored by copy so it must be trivially copyable
+ * @tparam secondStageSize: The second stage size of the index retrained on publish()
+ */
+template <typename KeyType, typename ValueType, int secondStageSize>
+class SnapshotIndex {
+    struct Version;
+
+public:
+
+    typedef FrozenIndex<KeyType, ValueType> Frozen;
+
+    /**
+     * @brief Where publish() trains
+     */
+    enum class RetrainStrategy {
+        InProcess,      ///< In publish() itself, inserts wait until it finishes
+        ForkedChild     ///< In a forked child process, inserts carry on meanwhile
+    };
+
+    /**
+     * @brief A read view pinned to one version and sequence number, released on destruction
+     */
+    class Snapshot {
+    public:
+        Snapshot(Snapshot &&other) = default;
+        Snapshot &operator=(Snapshot &&other) = default;
+
+        /**
+         * @brief Find a specific item as of this snapshot
+         * @return A pair of (key, value) if found.
+         */
+        boost::optional<std::pair<KeyType, ValueType>> find(KeyType key) const;
+
+        /**
+         * @return The sequence number of the last insert this snapshot sees
+         */
+        uint64_t getSequence() const {
+            return m_sequence;
+        }
+
+    private:
+        friend class SnapshotIndex;
+
+        Snapshot(EpochManager::Guard &&guard, const Version *version, uint64_t sequence):
+            m_guard(std::move(guard)), m_version(version), m_sequence(sequence) {}
+
+        EpochManager::Guard m_guard;    ///< Keeps m_version alive
+        const Version *m_version;       ///< The version we read
+        uint64_t m_sequence;            ///< Last insert we see
+    };
+
+    /**
+     * @param firstStageParams [in]: The first layer network parameters used by publish()
+     * @param secondStageParams [in]: The second stage network parameters used by publish()
+     * @param maxSecondStageError [in]: The max second stage error allowed before replacing with BTree
+     * @param deltaCapacity [in]: Inserts a version's log holds before it is copied into a larger one
+     */
+    explicit SnapshotIndex(const NetworkParameters &firstStageParams, const NetworkParameters &secondStageParams,
+                           int maxSecondStageError = 256, size_t deltaCapacity = 1024);
+
+    ~SnapshotIndex() {
+        delete m_current.load();
+    }
+
+    SnapshotIndex(const SnapshotIndex &) = delete;
+    SnapshotIndex &operator=(const SnapshotIndex &) = delete;
+
+    /**
+     * @brief Insert, visible to snapshots taken after this returns
+     * @return The sequence number of the insert
+     */
+    uint64_t insert(KeyType key, ValueType value) {
+        return insert(std::vector<std::pair<KeyType, ValueType>>(1, std::pair<KeyType, ValueType>(key, value)));
+    }
+
+    /**
+     * @brief Insert a batch atomically: a snapshot sees either all of it or none of it
+     * @return The sequence number of the last insert of the batch
+     */
+    uint64_t insert(const std::vector<std::pair<KeyType, ValueType>> &batch);
+
+    /**
+     * @brief Retrain on everything inserted so far and install it as the new version
+     *
+     * Snapshots taken before keep reading the old version until released.
+     */
+    void publish();
+
+    /**
+     * @brief Choose where publish() trains
+     * @param strategy [in]: The strategy
+     * @param directory [in]: Where a forked child writes the new version (it is unlinked once mapped)
+     */
+    void setRetrainStrategy(RetrainStrategy strategy, const std::string &directory = "/tmp") {
+        std::lock_guard<std::mutex> lock(m_publishMutex);
+        m_retrainStrategy = strategy;
+        m_retrainDirectory = directory;
+    }
+
+    /**
+     * @brief Take a consistent read view of the current version
+     *
+     * A snapshot holds one of EpochManager::maxReaders reader slots until released, and taking one
+     * waits while every slot is held. A thread must not keep that many snapshots open itself, it
+     * would wait on itself forever.
+     */
+    Snapshot snapshot();
+
+    /**
+     * @brief Briefly takes a reader slot, so like snapshot() it waits while every slot is held
+     * @return The sequence number of the last insert
+     */
+    uint64_t getSequence() {
+        // Pin before loading, like snapshot(), a publish may retire the version meanwhile
+        EpochManager::Guard guard = m_epochs.pin();
+        const Version *version = m_current.load();
+        return version->baseSequence + version->deltaSize.load(std::memory_order_acquire);
+    }
+
+    /**
+     * @return Versions replaced but still pinned by some snapshot
+     */
+    size_t retiredVersions() {
+        return m_epochs.pendingSize();
+    }
+
+private:
+
+    /**
+     * @brief A published FrozenIndex and the inserts since it was built
+     */
+    struct Version {
+        std::shared_ptr<const Frozen> frozen;                       ///< Data up to and including baseSequence
+        uint64_t baseSequence;                                      ///< Last insert folded into frozen
+        std::unique_ptr<std::pair<KeyType, ValueType>[]> delta;     ///< Inserts after baseSequence, in order
+        size_t deltaCapacity;                                       ///< Slots in delta
+        std::atomic<size_t> deltaSize;                              ///< Entries of delta published to readers
+
+        Version(std::shared_ptr<const Frozen> frozenIndex, uint64_t sequence, size_t capacity):
+            frozen(std::move(frozenIndex)), baseSequence(sequence),
+            delta(new std::pair<KeyType, ValueType>[capacity]), deltaCapacity(capacity), deltaSize(0) {}
+    };
+
+    /**
+     * @brief Make version current and retire the one it replaces, m_writerMutex must be held
+     */
+    void install(Version *version);
+
+    /**
+     * @brief The sequence number of the last insert, m_writerMutex must be held
+     *
+     * Versions are only retired under m_writerMutex, so unlike getSequence() this needs no reader slot.
+     */
+    uint64_t lockedSequence() const {
+        const Version *version = m_current.load();
+        return version->baseSequence + version->deltaSize.load();
+    }
+
+    /**
+     * @brief Train in a forked child and install the version it writes
+     * @return Whether it succeeded, publish() trains in process otherwise
+     */
+    bool publishForked();
+
+    ///------------ Data members ----------------
+    RecursiveModelIndex<KeyType, ValueType, secondStageSize> m_builder;     ///< Every insert, retrained by publish()
+    std::mutex m_writerMutex;                                               ///< Serializes insert() and publish()
+    std::mutex m_publishMutex;                                              ///< Serializes publish(), which may drop m_writerMutex
+    RetrainStrategy m_retrainStrategy;                                      ///< Where publish() trains
+    std::string m_retrainDirectory;                                         ///< Where forked children write new versions
+    size_t m_publishCount;                                                  ///< Forked publishes so far, to name their files
+    std::atomic<Version *> m_current;                                       ///< Version new snapshots read
+    EpochManager m_epochs;                                                  ///< Frees versions once unpinned
+};
+
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+SnapshotIndex<KeyType, ValueType, secondStageSize>::SnapshotIndex(const NetworkParameters &firstStageParams,
+                                                                  const NetworkParameters &secondStageParams,
+                                                                  int maxSecondStageError, size_t deltaCapacity):
+    m_builder(firstStageParams, secondStageParams, maxSecondStageError, std::numeric_limits<int>::max()),
+    m_retrainStrategy(RetrainStrategy::InProcess), m_retrainDirectory("/tmp"), m_publishCount(0)
+{
+    std::shared_ptr<Frozen> frozen(new Frozen());
+    frozen->attachBuffer(Frozen::freeze(m_builder));
+    m_current.store(new Version(frozen, 0, std::max<size_t>(1, deltaCapacity)));
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+uint64_t SnapshotIndex<KeyType, ValueType, secondStageSize>::insert(const std::vector<std::pair<KeyType, ValueType>> &batch) {
+    std::lock_guard<std::mutex> lock(m_writerMutex);
+    for (const auto &pair : batch) {
+        m_builder.insert(pair.first, pair.second);
+    }
+
+    Version *version = m_current.load();
+    size_t size = version->deltaSize.load();
+    if (size + batch.size() > version->deltaCapacity) {
+        // Readers may be scanning this log, so grow into a copy rather than in place
+        size_t capacity = std::max(2 * version->deltaCapacity, size + batch.size());
+        Version *grown = new Version(version->frozen, version->baseSequence, capacity);
+        std::copy(version->delta.get(), version->delta.get() + size, grown->delta.get());
+        grown->deltaSize.store(size);
+        install(grown);
+        version = grown;
+    }
+
+    // Readers only look below deltaSize, so the whole batch appears with the one store
+    std::copy(batch.begin(), batch.end(), version->delta.get() + size);
+    version->deltaSize.store(size + batch.size(), std::memory_order_release);
+    return version->baseSequence + size + batch.size();
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+void SnapshotIndex<KeyType, ValueType, secondStageSize>::publish() {
+    std::lock_guard<std::mutex> publishLock(m_publishMutex);
+    if (m_retrainStrategy == RetrainStrategy::ForkedChild && publishForked()) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(m_writerMutex);
+    m_builder.train();
+
+    std::shared_ptr<Frozen> frozen(new Frozen());
+    frozen->attachBuffer(Frozen::freeze(m_builder));
+
+    const Version *current = m_current.load();
+    install(new Version(frozen, current->baseSequence + current->deltaSize.load(), current->deltaCapacity));
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+bool SnapshotIndex<KeyType, ValueType, secondStageSize>::publishForked() {
+    std::unique_lock<std::mutex> lock(m_writerMutex);
+
+    // Sorting writes every page, so it stays in the parent. The child only reads the data
+    m_builder.mergePending();
+    const uint64_t sequence = lockedSequence();
+    const std::string path = m_retrainDirectory + "/snapshot_index_" + std::to_string(::getpid()) + "_" +
+                             std::to_string(m_publishCount++) + ".idx";
+
+    pid_t child = ::fork();
+    if (child < 0) {
+        std::cerr << "Failed to fork for retraining" << std::endl;
+        return false;
+    }
+    if (child == 0) {
+        m_builder.trainModels();
+        ::_exit(Frozen::publishFile(m_builder, path) ? 0 : 1);
+    }
+
+    // Inserts carry on while the child trains, copying only the pages they dirty
+    lock.unlock();
+    int status = 0;
+    pid_t waited;
+    do {
+        waited = ::waitpid(child, &status, 0);
+    } while (waited < 0 && errno == EINTR);
+
+    std::shared_ptr<Frozen> frozen(new Frozen());
+    bool success = waited == child && WIFEXITED(status) && WEXITSTATUS(status) == 0 && frozen->attachFile(path);
+    // The mapping outlives the name
+    ::unlink(path.c_str());
+    if (!success) {
+        std::cerr << "Forked retrain failed, training in process" << std::endl;
+        return false;
+    }
+
+    // The new version holds everything up to sequence, carry over the inserts made since
+    lock.lock();
+    const Version *current = m_current.load();
+    const size_t folded = static_cast<size_t>(sequence - current->baseSequence);
+    const size_t size = current->deltaSize.load();
+    Version *version = new Version(frozen, sequence, std::max(current->deltaCapacity, size - folded));
+    std::copy(current->delta.get() + folded, current->delta.get() + size, version->delta.get());
+    version->deltaSize.store(size - folded);
+    install(version);
+    return true;
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+void SnapshotIndex<KeyType, ValueType, secondStageSize>::install(Version *version) {
+    Version *replaced = m_current.exchange(version);
+    m_epochs.retire([replaced]() {
+        delete replaced;
+    });
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+typename SnapshotIndex<KeyType, ValueType, secondStageSize>::Snapshot SnapshotIndex<KeyType, ValueType, secondStageSize>::snapshot() {
+    // Pin before loading, so the version can't be freed under us
+    EpochManager::Guard guard = m_epochs.pin();
+    const Version *version = m_current.load();
+    uint64_t sequence = version->baseSequence + version->deltaSize.load(std::memory_order_acquire);
+    return Snapshot(std::move(guard), version, sequence);
+}
+
+template <typename KeyType, typename ValueType, int secondStageSize>
+boost::optional<std::pair<KeyType, ValueType>> SnapshotIndex<KeyType, ValueType, secondStageSize>::Snapshot::find(KeyType key) const {
+    // Newest insert first, like the overflow array of RecursiveModelIndex
+    size_t visible = static_cast<size_t>(m_sequence - m_version->baseSequence);
+    for (size_t ii = visible; ii > 0; --ii) {
+        if (m_version->delta[ii - 1].first == key) {
+            return m_version->delta[ii - 1];
+        }
+    }
+    return m_version->frozen->find(key);
+}
+
+#endif //LEARNED_INDICES_SNAPSHOTINDEX_H
@@ -0,0 +1,251 @@
+/**
+ * @file StringRecursiveModelIndex.h
+ *
+ * @breif A Recursive Model Index over string keys, using learned models on numeric key prefixes
+ *
+ * @date 1/07/2018
+ * @author Ben Caine
+ */
+
+#ifndef LEARNED_INDICES_STRINGRECURSIVEMODELINDEX_H
+#define LEARNED_INDICES_STRINGRECURSIVEMODELINDEX_H
+
+#include "RecursiveModelIndex.h"
+#include <boost/optional.hpp>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <string>
+
+/**
+ * @brief A learned index over variable length string keys
+ *
+ * Keys live back to back in a single arena with an offsets array. On train() the rows are sorted,
+ * the prefix shared by every key is dropped, and the next 8 bytes of each key are encoded as a
+ * big endian integer. That encoding preserves order, so a RecursiveModelIndex over it predicts
+ * the run of rows sharing a prefix; keys that collide in the encoding are told apart with a
+ * binary search comparing the full strings.
+ *
+ * @tparam ValueType: The value we are storing
+ * @tparam secondStageSize: The size of the second stage of the prefix index
+ */
+template <typename ValueType, int secondStageSize>
+class StringRecursiveModelIndex {
+public:
+
+    /**
+     * @brief Create a string RMI
+     * @param firstStageParams [in]: The first layer network parameters
+     * @param secondStageParams [in]: The second stage network parameters
+     * @param maxSecondStageError [in]: The max second stage error allowed before replacing with BTree
+     * @param maxOverflowSize [in]: The max number of untrained inserts before we force a retrain
+     */
+    explicit StringRecursiveModelIndex(const NetworkParameters &firstStageParams,
+                                       const NetworkParameters &secondStageParams,
+                                       int maxSecondStageError = 256,
+                                       int maxOverflowSize = 10000);
+
+    /**
+     * @brief Insert into our index new data
+     * @param key [in]: The key to insert
+     * @param value [in]: The value to insert
+     */
+    void insert(const std::string &key, ValueType value);
+
+    /**
+     * @brief Find a specific item
+     * @param key [in]: A key to search for
+     * @return A pair of (key, value) if found.
+     */
+    boost::optional<std::pair<std::string, ValueType>> find(const std::string &key);
+
+    /**
+     * @brief Sort the keys and train the prefix models
+     */
+    void train();
+
+    /**
+     * @return The total number of keys stored
+     */
+    size_t size() const {
+        return m_values.size();
+    }
+
+private:
+
+    /**
+     * @brief Compare the key stored in a row against key, like memcmp
+     */
+    int compareRow(size_t row, const char *key, size_t length) const;
+
+    /**
+     * @brief Order preserving 8 byte encoding of a key, after the shared prefix
+     */
+    uint64_t encodePrefix(const char *key, size_t length) const;
+
+    ///------------ Data members ----------------
+    NetworkParameters m_firstStageParams;                              ///< First stage network parameters
+    NetworkParameters m_secondStageParams;                             ///< Our second stage network parameters
+    int m_maxSecondStageError;                                         ///< Max second stage error before replacing with btree
+    int m_maxOverflowSize;                                             ///< Max untrained rows before retraining
+
+    std::vector<char> m_keyArena;                                      ///< Every key, back to back
+    std::vector<size_t> m_keyOffsets;                                  ///< Start of each row's key in the arena, plus the end
+    std::vector<ValueType> m_values;                                   ///< Value of each row
+
+    size_t m_trainedRows;                                              ///< Rows [0, m_trainedRows) are sorted and indexed
+    std::string m_sharedPrefix;                                        ///< Prefix every trained key starts with
+    std::unique_ptr<RecursiveModelIndex<uint64_t, uint32_t, secondStageSize>> m_prefixIndex;  ///< Encoded prefix to rows
+};
+
+
+template <typename ValueType, int secondStageSize>
+StringRecursiveModelIndex<ValueType, secondStageSize>::StringRecursiveModelIndex(const NetworkParameters &firstStageParams,
+                                                                                 const NetworkParameters &secondStageParams,
+                                                                                 int maxSecondStageError,
+                                                                                 int maxOverflowSize):
+    m_firstStageParams(firstStageParams), m_secondStageParams(secondStageParams),
+    m_maxSecondStageError(maxSecondStageError), m_maxOverflowSize(maxOverflowSize),
+    m_keyOffsets(1, 0), m_trainedRows(0)
+{
+}
+
+template <typename ValueType, int secondStageSize>
+void StringRecursiveModelIndex<ValueType, secondStageSize>::insert(const std::string &key, ValueType value) {
+    m_keyArena.insert(m_keyArena.end(), key.begin(), key.end());
+    m_keyOffsets.push_back(m_keyArena.size());
+    m_values.push_back(value);
+
+    if (m_values.size() - m_trainedRows > static_cast<size_t>(m_maxOverflowSize)) {
+        train();
+    }
+}
+
+template <typename ValueType, int secondStageSize>
+boost::optional<std::pair<std::string, ValueType>> StringRecursiveModelIndex<ValueType, secondStageSize>::find(const std::string &key) {
+    // Untrained rows first, same as the overflow array of the numeric index
+    for (size_t row = m_trainedRows; row < m_values.size(); ++row) {
+        if (compareRow(row, key.data(), key.size()) == 0) {
+            return std::pair<std::string, ValueType>(key, m_values[row]);
+        }
+    }
+
+    if (!m_prefixIndex) {
+        return {};
+    }
+
+    uint64_t prefix = encodePrefix(key.data(), key.size());
+    size_t position = m_prefixIndex->lowerBound(prefix);
+    if (position == m_prefixIndex->distinctSize() || m_prefixIndex->distinctKeyAt(position) != prefix) {
+        return {};
+    }
+
+    // Rows are sorted by the full key, so the run of this prefix is a contiguous block of rows
+    auto run = m_prefixIndex->runAt(position);
+    size_t first = run.first;
+    size_t last = run.first + run.second;
+    while (first < last) {
+        size_t middle = first + (last - first) / 2;
+        if (compareRow(middle, key.data(), key.size()) < 0) {
+            first = middle + 1;
+        } else {
+            last = middle;
+        }
+    }
+
+    if (first < run.first + run.second && compareRow(first, key.data(), key.size()) == 0) {
+        return std::pair<std::string, ValueType>(key, m_values[first]);
+    }
+    return {};
+}
+
+template <typename ValueType, int secondStageSize>
+void StringRecursiveModelIndex<ValueType, secondStageSize>::train() {
+    const size_t numRows = m_values.size();
+
+    std::vector<size_t> order(numRows);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) {
+        return compareRow(lhs, m_keyArena.data() + m_keyOffsets[rhs], m_keyOffsets[rhs + 1] - m_keyOffsets[rhs]) < 0;
+    });
+
+    // Rewrite the arena and values in key order
+    std::vector<char> sortedArena;
+    sortedArena.reserve(m_keyArena.size());
+    std::vector<size_t> sortedOffsets(1, 0);
+    sortedOffsets.reserve(numRows + 1);
+    std::vector<ValueType> sortedValues;
+    sortedValues.reserve(numRows);
+    for (auto row : order) {
+        sortedArena.insert(sortedArena.end(), m_keyArena.begin() + m_keyOffsets[row], m_keyArena.begin() + m_keyOffsets[row + 1]);
+        sortedOffsets.push_back(sortedArena.size());
+        sortedValues.push_back(std::move(m_values[row]));
+    }
+    m_keyArena.swap(sortedArena);
+    m_keyOffsets.swap(sortedOffsets);
+    m_values.swap(sortedValues);
+
+    // The prefix shared by every key carries no information, so the encoding starts after it
+    m_sharedPrefix.clear();
+    if (numRows > 0) {
+        const char *firstKey = m_keyArena.data() + m_keyOffsets[0];
+        const char *lastKey = m_keyArena.data() + m_keyOffsets[numRows - 1];
+        size_t length = std::min(m_keyOffsets[1] - m_keyOffsets[0], m_keyOffsets[numRows] - m_keyOffsets[numRows - 1]);
+        size_t shared = 0;
+        while (shared < length && firstKey[shared] == lastKey[shared]) {
+            shared++;
+        }
+        m_sharedPrefix.assign(firstKey, shared);
+    }
+
+    std::vector<std::pair<uint64_t, uint32_t>> encoded;
+    encoded.reserve(numRows);
+    for (size_t row = 0; row < numRows; ++row) {
+        encoded.push_back({encodePrefix(m_keyArena.data() + m_keyOffsets[row], m_keyOffsets[row + 1] - m_keyOffsets[row]),
+                           static_cast<uint32_t>(row)});
+    }
+
+    // Untrained rows are handled here, so the inner index never retrains on its own
+    m_prefixIndex.reset(new RecursiveModelIndex<uint64_t, uint32_t, secondStageSize>(
+            m_firstStageParams, m_secondStageParams, m_maxSecondStageError, std::numeric_limits<int>::max()));
+    m_prefixIndex->load(encoded);
+    m_prefixIndex->train();
+
+    m_trainedRows = numRows;
+}
+
+template <typename ValueType, int secondStageSize>
+int StringRecursiveModelIndex<ValueType, secondStageSize>::compareRow(size_t row, const char *key, size_t length) const {
+    size_t rowLength = m_keyOffsets[row + 1] - m_keyOffsets[row];
+    int result = rowLength == 0 || length == 0 ? 0 : std::memcmp(m_keyArena.data() + m_keyOffsets[row], key, std::min(rowLength, length));
+    if (result != 0) {
+        return result;
+    }
+    return rowLength < length ? -1 : (rowLength > length ? 1 : 0);
+}
+
+template <typename ValueType, int secondStageSize>
+uint64_t StringRecursiveModelIndex<ValueType, secondStageSize>::encodePrefix(const char *key, size_t length) const {
+    // Keys that don't start with the shared prefix sort entirely before or after every trained key
+    size_t sharedLength = m_sharedPrefix.size();
+    int sharedCompare = std::memcmp(key, m_sharedPrefix.data(), std::min(length, sharedLength));
+    if (sharedCompare < 0 || (sharedCompare == 0 && length < sharedLength)) {
+        return 0;
+    }
+    if (sharedCompare > 0) {
+        return std::numeric_limits<uint64_t>::max();
+    }
+
+    // Big endian, zero padded, so integer order matches byte order
+    uint64_t encoded = 0;
+    for (size_t ii = 0; ii < sizeof(uint64_t); ++ii) {
+        size_t idx = sharedLength + ii;
+        unsigned char byte = idx < length ? static_cast<unsigned char>(key[idx]) : 0;
+        encoded = (encoded << 8) | byte;
+    }
+    return encoded;
+}
+
+#endif //LEARNED_INDICES_STRINGRECURSIVEMODELINDEX_H
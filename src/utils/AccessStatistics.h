@@ -0,0 +1,181 @@
+/**
+ * @file AccessStatistics.h
+ *
+ * @breif Per key range lookup counts, saved so a restarted replica knows which ranges to warm first
+ *
+ * @date 1/07/2018
+ * @author Ben Caine
+ */
+
+#ifndef LEARNED_INDICES_ACCESSSTATISTICS_H
+#define LEARNED_INDICES_ACCESSSTATISTICS_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+/**
+ * @brief Counts lookups per bucket of consecutive distinct key positions
+ *
+ * Recording is one relaxed atomic increment, so many reader threads can share one instance.
+ * Positions only mean something for the index they were recorded on, so hot buckets are saved
+ * as key ranges, which stay valid across rebuilds of the same data.
+ *
+ * @tparam KeyType [in]: The key type of the index
+ */
+template <typename KeyType>
+class AccessStatistics {
+    static_assert(std::is_trivially_copyable<KeyType>::value, "Saved ranges store keys byte for byte");
+
+public:
+
+    /**
+     * @brief A range of keys and how many lookups landed in it
+     */
+    struct Range {
+        KeyType first;      ///< Smallest key of the range
+        KeyType last;       ///< Largest key of the range
+        uint64_t hits;      ///< Lookups recorded in the range
+    };
+
+    /**
+     * @param keysPerBucket [in]: Distinct key positions counted together
+     */
+    explicit AccessStatistics(size_t keysPerBucket = 4096):
+        m_keysPerBucket(std::max<size_t>(1, keysPerBucket)), m_numBuckets(0), m_numKeys(0) {}
+
+    /**
+     * @brief Size (and zero) the counts for an index of numKeys distinct keys
+     */
+    void reset(size_t numKeys) {
+        m_numKeys = numKeys;
+        m_numBuckets = (numKeys + m_keysPerBucket - 1) / m_keysPerBucket;
+        m_hits.reset(new std::atomic<uint64_t>[m_numBuckets]);
+        for (size_t ii = 0; ii < m_numBuckets; ++ii) {
+            m_hits[ii].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief Count a lookup that landed at a distinct key position (positions past the end are ignored)
+     */
+    void record(size_t position) {
+        size_t bucket = position / m_keysPerBucket;
+        if (bucket < m_numBuckets) {
+            m_hits[bucket].fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief The most looked up buckets, as key ranges
+     * @param count [in]: Max number of ranges
+     * @param keyAt [in]: Maps a distinct key position of the recorded index to its key
+     * @return Up to count ranges with at least one hit, most hit first
+     */
+    template <typename KeyAtFunc>
+    std::vector<Range> hottest(size_t count, KeyAtFunc keyAt) const;
+
+    /**
+     * @brief Save ranges to a file
+     * @return Whether the file was written
+     */
+    static bool save(const std::string &path, const std::vector<Range> &ranges);
+
+    /**
+     * @brief Load ranges saved with save()
+     * @return Whether the file was read in full
+     */
+    static bool load(const std::string &path, std::vector<Range> &ranges);
+
+private:
+
+    ///------------ Data members ----------------
+    size_t m_keysPerBucket;                             ///< Distinct key positions per bucket
+    size_t m_numBuckets;                                ///< Number of buckets
+    size_t m_numKeys;                                   ///< Distinct keys of the recorded index
+    std::unique_ptr<std::atomic<uint64_t>[]> m_hits;    ///< Lookups per bucket
+};
+
+
+template <typename KeyType>
+template <typename KeyAtFunc>
+std::vector<typename AccessStatistics<KeyType>::Range> AccessStatistics<KeyType>::hottest(size_t count,
+                                                                                         KeyAtFunc keyAt) const {
+    std::vector<std::pair<uint64_t, size_t>> buckets;
+    for (size_t ii = 0; ii < m_numBuckets; ++ii) {
+        uint64_t hits = m_hits[ii].load(std::memory_order_relaxed);
+        if (hits > 0) {
+            buckets.push_back({hits, ii});
+        }
+    }
+
+    count = std::min(count, buckets.size());
+    std::partial_sort(buckets.begin(), buckets.begin() + count, buckets.end(),
+                      [](const std::pair<uint64_t, size_t> &a, const std::pair<uint64_t, size_t> &b) {
+                          return a.first > b.first;
+                      });
+
+    std::vector<Range> ranges;
+    for (size_t ii = 0; ii < count; ++ii) {
+        size_t first = buckets[ii].second * m_keysPerBucket;
+        size_t last = std::min(first + m_keysPerBucket, m_numKeys) - 1;
+        ranges.push_back({keyAt(first), keyAt(last), buckets[ii].first});
+    }
+    return ranges;
+}
+
+template <typename KeyType>
+bool AccessStatistics<KeyType>::save(const std::string &path, const std::vector<Range> &ranges) {
+    std::ofstream output(path, std::ios::binary | std::ios::trunc);
+    uint64_t numRanges = ranges.size();
+    uint32_t keySize = sizeof(KeyType);
+    output.write("LIDXHOT1", 8);
+    output.write(reinterpret_cast<const char *>(&keySize), sizeof(keySize));
+    output.write(reinterpret_cast<const char *>(&numRanges), sizeof(numRanges));
+    for (const auto &range : ranges) {
+        output.write(reinterpret_cast<const char *>(&range.first), sizeof(KeyType));
+        output.write(reinterpret_cast<const char *>(&range.last), sizeof(KeyType));
+        output.write(reinterpret_cast<const char *>(&range.hits), sizeof(range.hits));
+    }
+    if (!output) {
+        std::cerr << "Failed to write access statistics: " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+template <typename KeyType>
+bool AccessStatistics<KeyType>::load(const std::string &path, std::vector<Range> &ranges) {
+    std::ifstream input(path, std::ios::binary);
+    char magic[8];
+    uint32_t keySize = 0;
+    uint64_t numRanges = 0;
+    if (!input.read(magic, sizeof(magic)) || std::memcmp(magic, "LIDXHOT1", sizeof(magic)) != 0 ||
+        !input.read(reinterpret_cast<char *>(&keySize), sizeof(keySize)) || keySize != sizeof(KeyType) ||
+        !input.read(reinterpret_cast<char *>(&numRanges), sizeof(numRanges))) {
+        std::cerr << "Not an access statistics file for this key type: " << path << std::endl;
+        return false;
+    }
+
+    ranges.clear();
+    for (uint64_t ii = 0; ii < numRanges; ++ii) {
+        Range range;
+        if (!input.read(reinterpret_cast<char *>(&range.first), sizeof(KeyType)) ||
+            !input.read(reinterpret_cast<char *>(&range.last), sizeof(KeyType)) ||
+            !input.read(reinterpret_cast<char *>(&range.hits), sizeof(range.hits))) {
+            std::cerr << "Truncated access statistics file: " << path << std::endl;
+            return false;
+        }
+        ranges.push_back(range);
+    }
+    return true;
+}
+
+#endif //LEARNED_INDICES_ACCESSSTATISTICS_H
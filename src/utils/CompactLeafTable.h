@@ -0,0 +1,158 @@
+/**
+ * @file CompactLeafTable.h
+ *
+ * @breif A quantized, 16 byte per leaf copy of the second stage linear models
+ *
+ * @date 1/07/2018
+ * @author Ben Caine
+ */
+
+#ifndef LEARNED_INDICES_COMPACTLEAFTABLE_H
+#define LEARNED_INDICES_COMPACTLEAFTABLE_H
+
+#include "HalfFloat.h"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+/**
+ * @brief Second stage linear models stored in reduced precision, four leaves per cache line
+ *
+ * Each leaf keeps the model input and predicted position at the start of its key range at full
+ * precision, and its slope as the number of positions spanned across the range, in float16. The
+ * error bounds are bit packed into a byte each, and are measured with the quantized model itself,
+ * so they already account for the quantization error. Leaves that don't fit (tree leaves, errors
+ * over maxError(), spans too large for float16) are flagged so callers use the full model instead.
+ */
+class CompactLeafTable {
+public:
+
+    /**
+     * @brief Reset to numLeaves leaves, none of them compact yet
+     */
+    void reset(size_t numLeaves) {
+        m_leaves.assign(numLeaves, Leaf());
+    }
+
+    /**
+     * @brief Drop every leaf
+     */
+    void clear() {
+        m_leaves.clear();
+        m_leaves.shrink_to_fit();
+    }
+
+    /**
+     * @brief Quantize a leaf's linear model (error bounds must be set afterwards with setErrors)
+     * @param leaf [in]: The leaf to set
+     * @param slope [in]: Positions per unit of model input
+     * @param intercept [in]: Position at model input 0
+     * @param minInput [in]: Model input of the smallest key of the leaf
+     * @param maxInput [in]: Model input of the largest key of the leaf
+     */
+    void setModel(size_t leaf, float slope, float intercept, float minInput, float maxInput) {
+        Leaf &entry = m_leaves[leaf];
+        const double inputRange = static_cast<double>(maxInput) - static_cast<double>(minInput);
+        const double base = static_cast<double>(intercept) + static_cast<double>(slope) * minInput;
+
+        entry.inputOrigin = minInput;
+        entry.inputScale = inputRange > 0 ? static_cast<float>(1.0 / inputRange) : 0.0f;
+        entry.span = floatToHalf(static_cast<float>(slope * inputRange));
+        entry.errors = notCompact;
+
+        // Out of range positions are stored as infinite spans, which setErrors() never marks compact
+        if (std::abs(base) < static_cast<double>(std::numeric_limits<int32_t>::max())) {
+            entry.basePosition = static_cast<int32_t>(std::floor(base));
+        } else {
+            entry.span = floatToHalf(std::numeric_limits<float>::infinity());
+        }
+    }
+
+    /**
+     * @brief Set a leaf's error bounds, marking it compact if they fit
+     * @param leaf [in]: The leaf to set
+     * @param maxNegativeError [in]: Max (negative) error of the quantized prediction
+     * @param maxPositiveError [in]: Max (positive) error of the quantized prediction
+     */
+    void setErrors(size_t leaf, long maxNegativeError, long maxPositiveError) {
+        Leaf &entry = m_leaves[leaf];
+        // A span float16 can't hold would predict nonsense, so that leaf stays with the full model
+        if (!std::isfinite(halfToFloat(entry.span)) || -maxNegativeError > maxError() || maxPositiveError > maxError()) {
+            entry.errors = notCompact;
+            return;
+        }
+        entry.errors = static_cast<uint16_t>((static_cast<uint16_t>(-maxNegativeError) << 8) |
+                                             static_cast<uint16_t>(maxPositiveError));
+    }
+
+    /**
+     * @return Whether a leaf can be served from this table
+     */
+    bool isCompact(size_t leaf) const {
+        return leaf < m_leaves.size() && m_leaves[leaf].errors != notCompact;
+    }
+
+    /**
+     * @brief Predict a position with a leaf's quantized model
+     * @return A predicted position (may be out of range, callers clamp)
+     */
+    long predict(size_t leaf, float modelInput) const {
+        const Leaf &entry = m_leaves[leaf];
+        float fraction = (modelInput - entry.inputOrigin) * entry.inputScale;
+        return entry.basePosition + static_cast<long>(std::floor(halfToFloat(entry.span) * fraction));
+    }
+
+    /**
+     * @brief Start loading a leaf into cache, without waiting for it
+     */
+    void prefetch(size_t leaf) const {
+        __builtin_prefetch(m_leaves.data() + leaf);
+    }
+
+    int getMaxNegativeError(size_t leaf) const {
+        return -static_cast<int>(m_leaves[leaf].errors >> 8);
+    }
+
+    int getMaxPositiveError(size_t leaf) const {
+        return static_cast<int>(m_leaves[leaf].errors & 0xff);
+    }
+
+    /**
+     * @return The largest error a compact leaf can store
+     */
+    static long maxError() {
+        return 254;
+    }
+
+    /**
+     * @return Bytes used by the table
+     */
+    size_t sizeInBytes() const {
+        return m_leaves.capacity() * sizeof(Leaf);
+    }
+
+private:
+
+    static const uint16_t notCompact = 0xffff;    ///< Error bits of a leaf served by the full model
+
+    /**
+     * @brief One leaf, 16 bytes
+     */
+    struct Leaf {
+        float inputOrigin;      ///< Model input of the leaf's smallest key
+        float inputScale;       ///< 1 / model input range of the leaf
+        int32_t basePosition;   ///< Predicted position at inputOrigin, rounded down
+        uint16_t span;          ///< Positions spanned across the leaf's input range (float16)
+        uint16_t errors;        ///< Negative error magnitude (high byte) and positive error (low byte)
+
+        Leaf(): inputOrigin(0), inputScale(0), basePosition(0), span(0), errors(notCompact) {}
+    };
+
+    ///------------ Data members ----------------
+    std::vector<Leaf> m_leaves;     ///< One entry per second stage node
+};
+
+#endif //LEARNED_INDICES_COMPACTLEAFTABLE_H
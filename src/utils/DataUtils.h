@@ -29,7 +29,7 @@ std::unordered_set<KeyType> getRandomBatch(int batchSize, int datasetSize) {
     std::unordered_set<KeyType> randomKeys;
     auto seed = std::chrono::high_resolution_clock::now().time_since_epoch().count();
     std::mt19937 rng(seed);
-    std::uniform_int_distribution<KeyType> distribution(0, datasetSize);
+    std::uniform_int_distribution<KeyType> distribution(0, datasetSize - 1);
 
     while (randomKeys.size() < batchSize) {
         auto val = distribution(rng);
@@ -0,0 +1,188 @@
+/**
+ * @file DriftDetector.h
+ *
+ * @breif A streaming sample of inserted keys, compared against the trained models to tell when and where to retrain
+ *
+ * @date 1/07/2018
+ * @author Ben Caine
+ */
+
+#ifndef LEARNED_INDICES_DRIFTDETECTOR_H
+#define LEARNED_INDICES_DRIFTDETECTOR_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief What a drift report recommends
+ */
+enum class DriftRecommendation {
+    NoOp,           ///< The models still describe the data
+    RetrainLeaves,  ///< Some leaves took many inserts, retrain them (see RecursiveModelIndex::trainLeaves)
+    RetrainRoot     ///< The root misroutes inserts, retrain everything
+};
+
+/**
+ * @brief Measures how far inserts since the last training moved the key distribution
+ *
+ * Keeps a fixed size reservoir sample of inserted keys (every insert has the same chance to be in
+ * it), so recording is a counter and, rarely, a store. A report estimates two things from the
+ * sample:
+ *
+ * - Per leaf drift: the inserts routed to a leaf, relative to the keys it was trained on. Inserts
+ *   shift positions inside the leaf, so its error window widens roughly in proportion.
+ * - Root drift: how often a sampled key routes more than one leaf away from where a root trained on
+ *   the combined data would send it (its combined rank times the number of leaves), minus the same
+ *   rate measured on trained keys at training time, so a root that was never perfect isn't flagged.
+ *
+ * @tparam KeyType [in]: The key type of the index
+ */
+template <typename KeyType>
+class DriftDetector {
+public:
+
+    /**
+     * @brief The outcome of measuring drift
+     */
+    struct Report {
+        DriftRecommendation recommendation;     ///< What to do about it
+        size_t insertsSinceTraining;            ///< Inserts recorded since reset()
+        float rootDrift;                        ///< Misrouted fraction of sampled inserts, over the trained baseline
+        std::vector<float> leafScores;          ///< Estimated inserts routed to each leaf / keys it was trained on
+        std::vector<int> driftedLeaves;         ///< Leaves whose score exceeds the leaf threshold
+
+        Report(): recommendation(DriftRecommendation::NoOp), insertsSinceTraining(0), rootDrift(0) {}
+    };
+
+    DriftDetector(): m_sampleSize(0), m_inserts(0), m_rootBaseline(0), m_state(0x2545f4914f6cdd1dull) {}
+
+    /**
+     * @brief Set the reservoir size, 0 disables recording
+     */
+    void resize(size_t sampleSize) {
+        m_sampleSize = sampleSize;
+        m_sample.clear();
+        m_sample.reserve(sampleSize);
+        m_inserts = 0;
+    }
+
+    bool isEnabled() const {
+        return m_sampleSize > 0;
+    }
+
+    /**
+     * @brief Start measuring against freshly trained models
+     * @param leafSizes [in]: Keys each leaf was trained on
+     * @param rootBaseline [in]: Misrouted fraction of trained keys (see the class comment)
+     */
+    void reset(std::vector<size_t> leafSizes, float rootBaseline) {
+        m_leafSizes = std::move(leafSizes);
+        m_rootBaseline = rootBaseline;
+        m_sample.clear();
+        m_inserts = 0;
+    }
+
+    /**
+     * @brief Record an inserted key
+     */
+    void record(KeyType key) {
+        if (m_sampleSize == 0) {
+            return;
+        }
+        m_inserts++;
+        if (m_sample.size() < m_sampleSize) {
+            m_sample.push_back(key);
+            return;
+        }
+        uint64_t slot = nextRandom() % m_inserts;
+        if (slot < m_sampleSize) {
+            m_sample[slot] = key;
+        }
+    }
+
+    /**
+     * @brief Measure drift of the recorded inserts
+     * @param trainedKeys [in]: Distinct keys the models were trained on
+     * @param trainedRank [in]: Maps a key to the number of trained keys below it
+     * @param route [in]: Maps a key to the leaf the models route it to
+     * @param leafThreshold [in]: Leaf score above which a leaf counts as drifted
+     * @param rootThreshold [in]: Root drift above which the root should be retrained
+     */
+    template <typename RankFunc, typename RouteFunc>
+    Report report(size_t trainedKeys, RankFunc trainedRank, RouteFunc route, float leafThreshold,
+                  float rootThreshold) const;
+
+private:
+
+    uint64_t nextRandom() {
+        // xorshift64*, plenty for sampling and cheaper than std::mt19937 on the insert path
+        m_state ^= m_state >> 12;
+        m_state ^= m_state << 25;
+        m_state ^= m_state >> 27;
+        return m_state * 0x2545f4914f6cdd1dull;
+    }
+
+    ///------------ Data members ----------------
+    size_t m_sampleSize;                ///< Max keys in the reservoir
+    std::vector<KeyType> m_sample;      ///< Reservoir sample of inserts since reset()
+    size_t m_inserts;                   ///< Inserts recorded since reset()
+    std::vector<size_t> m_leafSizes;    ///< Keys each leaf was trained on
+    float m_rootBaseline;               ///< Misrouted fraction of trained keys at training time
+    uint64_t m_state;                   ///< Random state for sampling
+};
+
+
+template <typename KeyType>
+template <typename RankFunc, typename RouteFunc>
+typename DriftDetector<KeyType>::Report DriftDetector<KeyType>::report(size_t trainedKeys, RankFunc trainedRank,
+                                                                       RouteFunc route, float leafThreshold,
+                                                                       float rootThreshold) const {
+    Report result;
+    result.insertsSinceTraining = m_inserts;
+    result.leafScores.assign(m_leafSizes.size(), 0.0f);
+    if (m_sample.empty() || m_leafSizes.empty()) {
+        return result;
+    }
+
+    std::vector<KeyType> sample(m_sample);
+    std::sort(sample.begin(), sample.end());
+
+    const int numLeaves = static_cast<int>(m_leafSizes.size());
+    const double insertsPerSample = static_cast<double>(m_inserts) / sample.size();
+    const double combinedKeys = static_cast<double>(trainedKeys) + m_inserts;
+    std::vector<size_t> routed(numLeaves, 0);
+    size_t misrouted = 0;
+    for (size_t ii = 0; ii < sample.size(); ++ii) {
+        int leaf = route(sample[ii]);
+        routed[leaf]++;
+
+        // Rank among trained keys plus the inserts estimated to be below it
+        double combinedRank = static_cast<double>(trainedRank(sample[ii])) + ii * insertsPerSample;
+        int idealLeaf = std::min(numLeaves - 1, static_cast<int>(combinedRank / combinedKeys * numLeaves));
+        if (std::abs(idealLeaf - leaf) > 1) {
+            misrouted++;
+        }
+    }
+
+    result.rootDrift = std::max(0.0f, static_cast<float>(misrouted) / sample.size() - m_rootBaseline);
+    for (int leaf = 0; leaf < numLeaves; ++leaf) {
+        result.leafScores[leaf] = static_cast<float>(routed[leaf] * insertsPerSample /
+                                                     std::max<size_t>(1, m_leafSizes[leaf]));
+        if (result.leafScores[leaf] > leafThreshold) {
+            result.driftedLeaves.push_back(leaf);
+        }
+    }
+
+    if (result.rootDrift > rootThreshold) {
+        result.recommendation = DriftRecommendation::RetrainRoot;
+    } else if (!result.driftedLeaves.empty()) {
+        result.recommendation = DriftRecommendation::RetrainLeaves;
+    }
+    return result;
+}
+
+#endif //LEARNED_INDICES_DRIFTDETECTOR_H
@@ -0,0 +1,192 @@
+/**
+ * @file EpochManager.h
+ *
+ * @breif Epoch based reclamation, so readers never lock or count references to what they read
+ *
+ * @date 1/07/2018
+ * @author Ben Caine
+ */
+
+#ifndef LEARNED_INDICES_EPOCHMANAGER_H
+#define LEARNED_INDICES_EPOCHMANAGER_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Defers freeing retired objects until no reader that could still see them remains
+ *
+ * A reader pins the current epoch into a slot before loading a shared pointer and unpins it when
+ * done. A writer first unpublishes an object, then retires it, which tags it with the current epoch
+ * and advances the epoch. A retired object is freed once every pinned slot holds a later epoch,
+ * since those readers pinned after it was unpublished and can't have loaded it.
+ */
+class EpochManager {
+public:
+
+    static const size_t maxReaders = 128;    ///< Readers that can be pinned at once, others wait for a slot (see pin())
+
+    /**
+     * @brief Keeps an epoch pinned while alive
+     */
+    class Guard {
+    public:
+        Guard(): m_manager(nullptr), m_slot(0) {}
+        Guard(EpochManager *manager, size_t slot): m_manager(manager), m_slot(slot) {}
+        ~Guard() {
+            release();
+        }
+
+        Guard(const Guard &) = delete;
+        Guard &operator=(const Guard &) = delete;
+
+        Guard(Guard &&other): m_manager(other.m_manager), m_slot(other.m_slot) {
+            other.m_manager = nullptr;
+        }
+
+        Guard &operator=(Guard &&other) {
+            if (this != &other) {
+                release();
+                m_manager = other.m_manager;
+                m_slot = other.m_slot;
+                other.m_manager = nullptr;
+            }
+            return *this;
+        }
+
+        /**
+         * @brief Unpin early
+         */
+        void release() {
+            if (m_manager) {
+                m_manager->unpin(m_slot);
+                m_manager = nullptr;
+            }
+        }
+
+    private:
+        EpochManager *m_manager;    ///< Manager we're pinned in, or nullptr
+        size_t m_slot;              ///< Slot holding our epoch
+    };
+
+    EpochManager(): m_epoch(1) {
+        for (auto &slot : m_slots) {
+            slot.store(idle);
+        }
+    }
+
+    /**
+     * @brief Frees everything still retired, no reader may be pinned
+     */
+    ~EpochManager() {
+        for (auto &retired : m_retired) {
+            retired.second();
+        }
+    }
+
+    EpochManager(const EpochManager &) = delete;
+    EpochManager &operator=(const EpochManager &) = delete;
+
+    /**
+     * @brief Pin the current epoch, before loading anything a writer may retire
+     *
+     * Waits while all maxReaders slots are pinned, so a thread must never hold that many guards
+     * itself: nobody else would release one.
+     */
+    Guard pin();
+
+    /**
+     * @brief Free an object once no reader can still see it (it must already be unpublished)
+     * @param deleter [in]: Frees the object
+     */
+    void retire(std::function<void()> deleter);
+
+    /**
+     * @brief Free every retired object no pinned reader can see
+     */
+    void collect();
+
+    /**
+     * @return Number of retired objects not freed yet
+     */
+    size_t pendingSize() {
+        std::lock_guard<std::mutex> lock(m_retiredMutex);
+        return m_retired.size();
+    }
+
+private:
+
+    static const uint64_t idle = 0;     ///< Epoch of a slot with no reader
+
+    void unpin(size_t slot) {
+        m_slots[slot].store(idle);
+    }
+
+    ///------------ Data members ----------------
+    std::atomic<uint64_t> m_epoch;                                          ///< Current epoch, starts at 1
+    std::array<std::atomic<uint64_t>, maxReaders> m_slots;                  ///< Epoch pinned by each reader slot, or idle
+    std::mutex m_retiredMutex;                                              ///< Guards m_retired
+    std::vector<std::pair<uint64_t, std::function<void()>>> m_retired;      ///< (retire epoch, deleter) not freed yet
+};
+
+
+inline EpochManager::Guard EpochManager::pin() {
+    // Start at a thread dependent slot so concurrent readers rarely contend
+    size_t start = std::hash<std::thread::id>()(std::this_thread::get_id()) % maxReaders;
+    while (true) {
+        for (size_t ii = 0; ii < maxReaders; ++ii) {
+            size_t slot = (start + ii) % maxReaders;
+            uint64_t expected = idle;
+            if (m_slots[slot].compare_exchange_strong(expected, m_epoch.load())) {
+                return Guard(this, slot);
+            }
+        }
+        std::this_thread::yield();
+    }
+}
+
+inline void EpochManager::retire(std::function<void()> deleter) {
+    {
+        std::lock_guard<std::mutex> lock(m_retiredMutex);
+        m_retired.push_back({m_epoch.fetch_add(1), std::move(deleter)});
+    }
+    collect();
+}
+
+inline void EpochManager::collect() {
+    // Anything retired from here on is tagged at least this epoch, so a reader pinning after its
+    // slot was scanned can't hold anything this pass frees
+    uint64_t oldestPinned = m_epoch.load();
+    for (const auto &slot : m_slots) {
+        uint64_t epoch = slot.load();
+        if (epoch != idle && epoch < oldestPinned) {
+            oldestPinned = epoch;
+        }
+    }
+
+    std::vector<std::function<void()>> freeable;
+    {
+        std::lock_guard<std::mutex> lock(m_retiredMutex);
+        auto keep = m_retired.begin();
+        for (auto it = m_retired.begin(); it != m_retired.end(); ++it) {
+            if (it->first < oldestPinned) {
+                freeable.push_back(std::move(it->second));
+            } else {
+                *keep++ = std::move(*it);
+            }
+        }
+        m_retired.erase(keep, m_retired.end());
+    }
+
+    for (auto &deleter : freeable) {
+        deleter();
+    }
+}
+
+#endif //LEARNED_INDICES_EPOCHMANAGER_H
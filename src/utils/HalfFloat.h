@@ -0,0 +1,106 @@
+/**
+ * @file HalfFloat.h
+ *
+ * @breif Conversions between float and IEEE-754 half precision (float16)
+ *
+ * @date 1/07/2018
+ * @author Ben Caine
+ */
+
+#ifndef LEARNED_INDICES_HALFFLOAT_H
+#define LEARNED_INDICES_HALFFLOAT_H
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+/**
+ * @brief Round a float to the nearest half precision value (ties to even)
+ * @return The half precision bits. Values too large for half precision become infinity
+ */
+inline uint16_t floatToHalf(float value) {
+#if defined(__F16C__)
+    return static_cast<uint16_t>(_cvtss_sh(value, 0));
+#else
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+
+    const uint32_t sign = (bits >> 16) & 0x8000u;
+    const uint32_t floatExponent = (bits >> 23) & 0xffu;
+    uint32_t mantissa = bits & 0x7fffffu;
+    const int exponent = static_cast<int>(floatExponent) - 127 + 15;
+
+    if (floatExponent == 0xffu) {
+        // Infinity stays infinity, NaN stays a (quiet) NaN
+        return static_cast<uint16_t>(sign | 0x7c00u | (mantissa ? 0x200u : 0));
+    }
+    if (exponent >= 31) {
+        return static_cast<uint16_t>(sign | 0x7c00u);
+    }
+    if (exponent <= 0) {
+        // Subnormal half, or too small to represent at all
+        if (exponent < -10) {
+            return static_cast<uint16_t>(sign);
+        }
+        mantissa |= 0x800000u;
+        const unsigned shift = static_cast<unsigned>(14 - exponent);
+        uint32_t half = mantissa >> shift;
+        const uint32_t remainder = mantissa & ((1u << shift) - 1);
+        const uint32_t halfway = 1u << (shift - 1);
+        if (remainder > halfway || (remainder == halfway && (half & 1))) {
+            half++;
+        }
+        return static_cast<uint16_t>(sign | half);
+    }
+
+    uint32_t half = (static_cast<uint32_t>(exponent) << 10) | (mantissa >> 13);
+    const uint32_t remainder = mantissa & 0x1fffu;
+    // A carry out of the mantissa correctly bumps the exponent (up to infinity)
+    if (remainder > 0x1000u || (remainder == 0x1000u && (half & 1))) {
+        half++;
+    }
+    return static_cast<uint16_t>(sign | half);
+#endif
+}
+
+/**
+ * @brief Widen half precision bits to a float (exact)
+ */
+inline float halfToFloat(uint16_t half) {
+#if defined(__F16C__)
+    return _cvtsh_ss(half);
+#else
+    const uint32_t sign = static_cast<uint32_t>(half & 0x8000u) << 16;
+    uint32_t exponent = (half >> 10) & 0x1fu;
+    uint32_t mantissa = half & 0x3ffu;
+
+    uint32_t bits;
+    if (exponent == 0) {
+        if (mantissa == 0) {
+            bits = sign;
+        } else {
+            // Subnormal half, normalize it for the float
+            int normalizedExponent = 1;
+            while (!(mantissa & 0x400u)) {
+                mantissa <<= 1;
+                normalizedExponent--;
+            }
+            mantissa &= 0x3ffu;
+            bits = sign | (static_cast<uint32_t>(normalizedExponent + 127 - 15) << 23) | (mantissa << 13);
+        }
+    } else if (exponent == 0x1fu) {
+        bits = sign | 0x7f800000u | (mantissa << 13);
+    } else {
+        bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    }
+
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+#endif
+}
+
+#endif //LEARNED_INDICES_HALFFLOAT_H
@@ -0,0 +1,205 @@
+/**
+ * @file HotKeyCache.h
+ *
+ * @breif A small set associative cache from hot keys to their position, one cache line per set
+ *
+ * @date 1/07/2018
+ * @author Ben Caine
+ */
+
+#ifndef LEARNED_INDICES_HOTKEYCACHE_H
+#define LEARNED_INDICES_HOTKEYCACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <type_traits>
+
+/**
+ * @brief Caches key to position lookups for skewed (e.g. Zipfian) read traffic
+ *
+ * Keys hash to a bucket, and each bucket is exactly one 64 byte aligned cache line holding a few
+ * (key, position) ways, so a probe touches a single line. A full bucket evicts round robin, which
+ * is cheap and keeps whatever stays hot. Owners must invalidate keys they update and clear the
+ * cache whenever positions move (e.g. on retrain).
+ *
+ * @tparam EncodedType [in]: The (unsigned) encoded key type
+ */
+template <typename EncodedType>
+class HotKeyCache {
+    static_assert(std::is_unsigned<EncodedType>::value, "The cache is keyed by encoded (unsigned) keys");
+
+public:
+
+    static const uint32_t notFound = std::numeric_limits<uint32_t>::max();  ///< Result of a miss
+    static const size_t cacheLineSize = 64;
+
+    HotKeyCache(): m_buckets(nullptr), m_bucketMask(0) {}
+
+    /**
+     * @brief Resize (and clear) the cache
+     * @param numBuckets [in]: Number of buckets, rounded up to a power of two. 0 disables the cache
+     */
+    void resize(size_t numBuckets);
+
+    /**
+     * @return Whether the cache has any buckets
+     */
+    bool isEnabled() const {
+        return m_buckets != nullptr;
+    }
+
+    /**
+     * @brief Find a cached position
+     * @return The cached position of key, or notFound
+     */
+    uint32_t lookup(EncodedType key) const {
+        if (!m_buckets) {
+            return notFound;
+        }
+        const Bucket &bucket = m_buckets[bucketOf(key)];
+        for (size_t way = 0; way < ways; ++way) {
+            if ((bucket.occupied >> way & 1) && bucket.keys[way] == key) {
+                return bucket.positions[way];
+            }
+        }
+        return notFound;
+    }
+
+    /**
+     * @brief Cache the position of a key, evicting another key of its bucket if needed
+     */
+    void store(EncodedType key, size_t position);
+
+    /**
+     * @brief Drop a key from the cache, if present
+     */
+    void invalidate(EncodedType key);
+
+    /**
+     * @brief Drop every key from the cache
+     */
+    void clear();
+
+    /**
+     * @return Bytes used by the buckets
+     */
+    size_t sizeInBytes() const {
+        return m_buckets ? (m_bucketMask + 1) * sizeof(Bucket) : 0;
+    }
+
+private:
+
+    /// As many (key, position) ways as fit in a line next to the occupancy and eviction bytes
+    static const size_t ways = (cacheLineSize - 3) / (sizeof(EncodedType) + sizeof(uint32_t)) > 16 ?
+                               16 : (cacheLineSize - 3) / (sizeof(EncodedType) + sizeof(uint32_t));
+
+    /**
+     * @brief One set of the cache, exactly one cache line
+     */
+    struct alignas(64) Bucket {
+        EncodedType keys[ways];         ///< Cached keys
+        uint32_t positions[ways];       ///< Position of each cached key
+        uint16_t occupied;              ///< Bit per way holding a key
+        uint8_t nextVictim;             ///< Way evicted next when the bucket is full
+    };
+    static_assert(sizeof(Bucket) == cacheLineSize, "A bucket must be exactly one cache line");
+
+    size_t bucketOf(EncodedType key) const {
+        // Fibonacci hashing spreads sequential keys over every bucket
+        uint64_t hash = static_cast<uint64_t>(key) * 0x9e3779b97f4a7c15ull;
+        return static_cast<size_t>(hash >> 32) & m_bucketMask;
+    }
+
+    ///------------ Data members ----------------
+    std::unique_ptr<char[]> m_storage;  ///< Raw storage, over allocated so buckets can be line aligned
+    Bucket *m_buckets;                  ///< Line aligned buckets inside m_storage
+    size_t m_bucketMask;                ///< Number of buckets - 1
+};
+
+template <typename EncodedType>
+const uint32_t HotKeyCache<EncodedType>::notFound;
+
+template <typename EncodedType>
+const size_t HotKeyCache<EncodedType>::cacheLineSize;
+
+template <typename EncodedType>
+const size_t HotKeyCache<EncodedType>::ways;
+
+
+template <typename EncodedType>
+void HotKeyCache<EncodedType>::resize(size_t numBuckets) {
+    m_storage.reset();
+    m_buckets = nullptr;
+    m_bucketMask = 0;
+    if (numBuckets == 0) {
+        return;
+    }
+
+    size_t roundedBuckets = 1;
+    while (roundedBuckets < numBuckets) {
+        roundedBuckets *= 2;
+    }
+
+    // Aligned by hand, std::allocator doesn't honour alignas before C++17
+    m_storage.reset(new char[roundedBuckets * cacheLineSize + cacheLineSize]);
+    uintptr_t address = reinterpret_cast<uintptr_t>(m_storage.get());
+    address = (address + cacheLineSize - 1) & ~static_cast<uintptr_t>(cacheLineSize - 1);
+    m_buckets = reinterpret_cast<Bucket *>(address);
+    m_bucketMask = roundedBuckets - 1;
+    clear();
+}
+
+template <typename EncodedType>
+void HotKeyCache<EncodedType>::store(EncodedType key, size_t position) {
+    if (!m_buckets || position >= notFound) {
+        return;
+    }
+
+    Bucket &bucket = m_buckets[bucketOf(key)];
+    size_t target = ways;
+    for (size_t way = 0; way < ways; ++way) {
+        if (!(bucket.occupied >> way & 1)) {
+            target = way;
+        } else if (bucket.keys[way] == key) {
+            target = way;
+            break;
+        }
+    }
+    if (target == ways) {
+        target = bucket.nextVictim;
+        bucket.nextVictim = static_cast<uint8_t>((bucket.nextVictim + 1) % ways);
+    }
+
+    bucket.keys[target] = key;
+    bucket.positions[target] = static_cast<uint32_t>(position);
+    bucket.occupied |= static_cast<uint16_t>(1u << target);
+}
+
+template <typename EncodedType>
+void HotKeyCache<EncodedType>::invalidate(EncodedType key) {
+    if (!m_buckets) {
+        return;
+    }
+
+    Bucket &bucket = m_buckets[bucketOf(key)];
+    for (size_t way = 0; way < ways; ++way) {
+        if ((bucket.occupied >> way & 1) && bucket.keys[way] == key) {
+            bucket.occupied &= static_cast<uint16_t>(~(1u << way));
+        }
+    }
+}
+
+template <typename EncodedType>
+void HotKeyCache<EncodedType>::clear() {
+    if (!m_buckets) {
+        return;
+    }
+    for (size_t ii = 0; ii <= m_bucketMask; ++ii) {
+        m_buckets[ii].occupied = 0;
+        m_buckets[ii].nextVictim = 0;
+    }
+}
+
+#endif //LEARNED_INDICES_HOTKEYCACHE_H
@@ -0,0 +1,362 @@
+/**
+ * @file KeyColumn.h
+ *
+ * @breif The sorted (encoded) key column of an index, either plain or frame-of-reference bit packed
+ *
+ * @date 1/07/2018
+ * @author Ben Caine
+ */
+
+#ifndef LEARNED_INDICES_KEYCOLUMN_H
+#define LEARNED_INDICES_KEYCOLUMN_H
+
+#include "SearchUtils.h"
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <type_traits>
+#include <vector>
+
+/**
+ * @brief How a key column stores its keys
+ */
+enum class KeyLayout {
+    Plain,              ///< Full width keys, searched in place
+    FrameOfReference    ///< Blocks of keys stored as bit packed deltas from the block's first key
+};
+
+/**
+ * @brief A sorted column of unsigned keys
+ *
+ * In the frame-of-reference layout, keys are split into blocks of blockSize. Each block keeps its
+ * first key at full width (so blocks can be binary searched without decoding anything) and the
+ * rest as deltas from it, bit packed at the smallest width that fits the block's range. Dense
+ * keys (e.g. timestamps or ids) pack to a fraction of their width. A search only decodes the one
+ * block the key falls into, then runs the same SIMD count as the plain layout over it.
+ *
+ * @tparam EncodedType [in]: An unsigned integer key type
+ */
+template <typename EncodedType>
+class KeyColumn {
+    static_assert(std::is_unsigned<EncodedType>::value, "Key columns hold encoded (unsigned) keys");
+
+public:
+
+    static const size_t blockSize = 64;     ///< Keys per frame-of-reference block
+
+    /**
+     * @brief Random access iterator over the (decoded) keys, so generic searches work on either layout
+     */
+    class ConstIterator : public std::iterator<std::random_access_iterator_tag, EncodedType, std::ptrdiff_t,
+                                               const EncodedType *, EncodedType> {
+    public:
+        ConstIterator(): m_column(nullptr), m_position(0) {}
+        ConstIterator(const KeyColumn *column, size_t position): m_column(column), m_position(position) {}
+
+        EncodedType operator*() const { return (*m_column)[m_position]; }
+        EncodedType operator[](std::ptrdiff_t offset) const { return (*m_column)[m_position + offset]; }
+
+        ConstIterator &operator++() { ++m_position; return *this; }
+        ConstIterator &operator--() { --m_position; return *this; }
+        ConstIterator operator++(int) { ConstIterator old(*this); ++m_position; return old; }
+        ConstIterator operator--(int) { ConstIterator old(*this); --m_position; return old; }
+        ConstIterator &operator+=(std::ptrdiff_t offset) { m_position += offset; return *this; }
+        ConstIterator &operator-=(std::ptrdiff_t offset) { m_position -= offset; return *this; }
+        ConstIterator operator+(std::ptrdiff_t offset) const { return ConstIterator(m_column, m_position + offset); }
+        ConstIterator operator-(std::ptrdiff_t offset) const { return ConstIterator(m_column, m_position - offset); }
+        friend ConstIterator operator+(std::ptrdiff_t offset, const ConstIterator &it) { return it + offset; }
+
+        std::ptrdiff_t operator-(const ConstIterator &other) const {
+            return static_cast<std::ptrdiff_t>(m_position) - static_cast<std::ptrdiff_t>(other.m_position);
+        }
+        bool operator==(const ConstIterator &other) const { return m_position == other.m_position; }
+        bool operator!=(const ConstIterator &other) const { return m_position != other.m_position; }
+        bool operator<(const ConstIterator &other) const { return m_position < other.m_position; }
+        bool operator>(const ConstIterator &other) const { return m_position > other.m_position; }
+        bool operator<=(const ConstIterator &other) const { return m_position <= other.m_position; }
+        bool operator>=(const ConstIterator &other) const { return m_position >= other.m_position; }
+
+    private:
+        const KeyColumn *m_column;   ///< Column we iterate over
+        size_t m_position;           ///< Current position in the column
+    };
+
+    KeyColumn(): m_layout(KeyLayout::Plain), m_size(0) {}
+
+    /**
+     * @brief Replace the contents of the column, stored in the current layout
+     * @param keys [in]: Keys in ascending order
+     */
+    void assign(std::vector<EncodedType> &&keys);
+
+    /**
+     * @brief Change how the keys are stored, re-encoding the current contents
+     */
+    void setLayout(KeyLayout layout);
+
+    KeyLayout getLayout() const {
+        return m_layout;
+    }
+
+    size_t size() const {
+        return m_size;
+    }
+
+    bool empty() const {
+        return m_size == 0;
+    }
+
+    /**
+     * @return The key at a position
+     */
+    EncodedType operator[](size_t position) const {
+        if (m_layout == KeyLayout::Plain) {
+            return m_plain[position];
+        }
+        size_t block = position / blockSize;
+        return m_blockBases[block] + unpack(block, position % blockSize);
+    }
+
+    ConstIterator begin() const {
+        return ConstIterator(this, 0);
+    }
+
+    ConstIterator end() const {
+        return ConstIterator(this, m_size);
+    }
+
+    /**
+     * @brief Find the first key not less than key in [first, last)
+     * @return The position of that key, or last
+     */
+    size_t lowerBound(size_t first, size_t last, EncodedType key) const;
+
+    /**
+     * @return The key comparisons lowerBound(first, last, key) makes (see simdLowerBoundComparisons)
+     */
+    size_t lowerBoundComparisons(size_t first, size_t last, EncodedType key) const;
+
+    /**
+     * @brief Start loading the start of [first, last) into cache, without waiting for it
+     */
+    void prefetch(size_t first, size_t last) const {
+        if (first >= last) {
+            return;
+        }
+        if (m_layout == KeyLayout::Plain) {
+            // The first two lines cover most windows, the hardware prefetcher picks up the rest
+            const char *start = reinterpret_cast<const char *>(m_plain.data() + first);
+            __builtin_prefetch(start);
+            __builtin_prefetch(start + 64);
+        } else {
+            size_t block = first / blockSize;
+            __builtin_prefetch(m_blockBases.data() + block);
+            __builtin_prefetch(m_words.data() + m_blockWordOffsets[block]);
+        }
+    }
+
+    /**
+     * @return Bytes used to store the keys
+     */
+    size_t sizeInBytes() const {
+        return m_plain.capacity() * sizeof(EncodedType) + m_blockBases.capacity() * sizeof(EncodedType) +
+               m_blockWidths.capacity() + m_blockWordOffsets.capacity() * sizeof(size_t) +
+               m_words.capacity() * sizeof(uint64_t);
+    }
+
+private:
+
+    /**
+     * @brief Bit pack keys into blocks of deltas
+     */
+    void pack(const std::vector<EncodedType> &keys);
+
+    /**
+     * @brief Decode every key in the column, whatever the layout
+     */
+    std::vector<EncodedType> unpackAll() const;
+
+    /**
+     * @brief Decode the delta at an offset of a block
+     *
+     * Always reads both words a delta may span and masks the result, so there are no branches on
+     * the width or on where the delta starts.
+     */
+    uint64_t unpack(size_t block, size_t offset) const {
+        const unsigned width = m_blockWidths[block];
+        const size_t bit = offset * width;
+        const uint64_t *words = m_words.data() + m_blockWordOffsets[block] + bit / 64;
+        const unsigned shift = bit % 64;
+
+        // Shifting the high word in two steps keeps every shift below 64, even when shift is 0
+        const uint64_t delta = (words[0] >> shift) | ((words[1] << 1) << (63 - shift));
+        const uint64_t mask = ((uint64_t(1) << (width & 63)) - 1) | (uint64_t(0) - (width >> 6));
+        return delta & mask;
+    }
+
+    /**
+     * @brief Decode a whole block into out (which must hold blockSize keys)
+     * @return Number of keys in the block
+     */
+    size_t decodeBlock(size_t block, EncodedType *out) const;
+
+    ///------------ Data members ----------------
+    KeyLayout m_layout;                     ///< How the keys are stored
+    size_t m_size;                          ///< Number of keys
+
+    std::vector<EncodedType> m_plain;       ///< Keys, in the plain layout
+    std::vector<EncodedType> m_blockBases;  ///< First key of each block, in the packed layout
+    std::vector<uint8_t> m_blockWidths;     ///< Bits per delta of each block
+    std::vector<size_t> m_blockWordOffsets; ///< First word of each block's deltas
+    std::vector<uint64_t> m_words;          ///< Bit packed deltas of every block, plus two padding words
+};
+
+template <typename EncodedType>
+const size_t KeyColumn<EncodedType>::blockSize;
+
+
+template <typename EncodedType>
+void KeyColumn<EncodedType>::assign(std::vector<EncodedType> &&keys) {
+    m_size = keys.size();
+    if (m_layout == KeyLayout::Plain) {
+        m_plain.swap(keys);
+        m_plain.shrink_to_fit();
+    } else {
+        pack(keys);
+    }
+}
+
+template <typename EncodedType>
+void KeyColumn<EncodedType>::setLayout(KeyLayout layout) {
+    if (layout == m_layout) {
+        return;
+    }
+
+    std::vector<EncodedType> keys = unpackAll();
+    m_plain = std::vector<EncodedType>();
+    m_blockBases = std::vector<EncodedType>();
+    m_blockWidths = std::vector<uint8_t>();
+    m_blockWordOffsets = std::vector<size_t>();
+    m_words = std::vector<uint64_t>();
+
+    m_layout = layout;
+    assign(std::move(keys));
+}
+
+template <typename EncodedType>
+size_t KeyColumn<EncodedType>::lowerBound(size_t first, size_t last, EncodedType key) const {
+    if (first >= last) {
+        return first;
+    }
+    if (m_layout == KeyLayout::Plain) {
+        return first + simdLowerBound(m_plain.data() + first, last - first, key);
+    }
+
+    // The answer is in the last block (of those overlapping the range) whose first key is below key
+    size_t firstBlock = first / blockSize;
+    size_t lastBlock = (last - 1) / blockSize;
+    size_t block = firstBlock + simdLowerBound(m_blockBases.data() + firstBlock + 1, lastBlock - firstBlock, key);
+
+    EncodedType decoded[blockSize];
+    size_t blockCount = decodeBlock(block, decoded);
+    size_t blockStart = block * blockSize;
+    size_t searchFirst = std::max(first, blockStart) - blockStart;
+    size_t searchLast = std::min(last - blockStart, blockCount);
+    return blockStart + searchFirst + simdLowerBound(decoded + searchFirst, searchLast - searchFirst, key);
+}
+
+template <typename EncodedType>
+size_t KeyColumn<EncodedType>::lowerBoundComparisons(size_t first, size_t last, EncodedType key) const {
+    if (first >= last) {
+        return 0;
+    }
+    if (m_layout == KeyLayout::Plain) {
+        return simdLowerBoundComparisons(m_plain.data() + first, last - first, key);
+    }
+
+    size_t firstBlock = first / blockSize;
+    size_t lastBlock = (last - 1) / blockSize;
+    size_t comparisons = simdLowerBoundComparisons(m_blockBases.data() + firstBlock + 1, lastBlock - firstBlock, key);
+    size_t block = firstBlock + simdLowerBound(m_blockBases.data() + firstBlock + 1, lastBlock - firstBlock, key);
+
+    EncodedType decoded[blockSize];
+    size_t blockCount = decodeBlock(block, decoded);
+    size_t blockStart = block * blockSize;
+    size_t searchFirst = std::max(first, blockStart) - blockStart;
+    size_t searchLast = std::min(last - blockStart, blockCount);
+    return comparisons + simdLowerBoundComparisons(decoded + searchFirst, searchLast - searchFirst, key);
+}
+
+template <typename EncodedType>
+void KeyColumn<EncodedType>::pack(const std::vector<EncodedType> &keys) {
+    const size_t numBlocks = (keys.size() + blockSize - 1) / blockSize;
+    m_blockBases.clear();
+    m_blockWidths.clear();
+    m_blockWordOffsets.clear();
+    m_words.clear();
+    m_blockBases.reserve(numBlocks);
+    m_blockWidths.reserve(numBlocks);
+    m_blockWordOffsets.reserve(numBlocks);
+
+    for (size_t start = 0; start < keys.size(); start += blockSize) {
+        size_t count = std::min(blockSize, keys.size() - start);
+        EncodedType base = keys[start];
+
+        // Keys are sorted, so the last delta is the largest
+        uint64_t range = static_cast<uint64_t>(keys[start + count - 1] - base);
+        unsigned width = 0;
+        while (width < 64 && (range >> width) != 0) {
+            width++;
+        }
+
+        m_blockBases.push_back(base);
+        m_blockWidths.push_back(static_cast<uint8_t>(width));
+        m_blockWordOffsets.push_back(m_words.size());
+
+        size_t firstWord = m_words.size();
+        m_words.resize(firstWord + (count * width + 63) / 64, 0);
+        // A zero width block (a single key) has no words, and every delta is 0 anyway
+        for (size_t ii = 0; width > 0 && ii < count; ++ii) {
+            uint64_t delta = static_cast<uint64_t>(keys[start + ii] - base);
+            size_t bit = ii * width;
+            unsigned shift = bit % 64;
+            m_words[firstWord + bit / 64] |= delta << shift;
+            if (shift + width > 64) {
+                m_words[firstWord + bit / 64 + 1] |= delta >> (64 - shift);
+            }
+        }
+    }
+
+    // Unpacking always reads two words, even past a zero width last block, the padding keeps that in bounds
+    m_words.resize(m_words.size() + 2, 0);
+    m_words.shrink_to_fit();
+}
+
+template <typename EncodedType>
+std::vector<EncodedType> KeyColumn<EncodedType>::unpackAll() const {
+    if (m_layout == KeyLayout::Plain) {
+        return m_plain;
+    }
+
+    std::vector<EncodedType> keys(m_size);
+    for (size_t block = 0; block * blockSize < m_size; ++block) {
+        decodeBlock(block, keys.data() + block * blockSize);
+    }
+    return keys;
+}
+
+template <typename EncodedType>
+size_t KeyColumn<EncodedType>::decodeBlock(size_t block, EncodedType *out) const {
+    const size_t count = std::min(blockSize, m_size - block * blockSize);
+    const EncodedType base = m_blockBases[block];
+
+    // The trip count is blockSize except in the last block, and unpack is branch free, so the
+    // loop body is straight line code the compiler can unroll. Decoding a full blockSize in the
+    // last block instead would read past its words and write past the end of unpackAll()'s keys
+    for (size_t ii = 0; ii < count; ++ii) {
+        out[ii] = static_cast<EncodedType>(base + unpack(block, ii));
+    }
+    return count;
+}
+
+#endif //LEARNED_INDICES_KEYCOLUMN_H
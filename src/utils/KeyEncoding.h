@@ -0,0 +1,114 @@
+/**
+ * @file KeyEncoding.h
+ *
+ * @breif Order preserving encodings of signed and floating point keys to unsigned integers
+ *
+ * @date 1/07/2018
+ * @author Ben Caine
+ */
+
+#ifndef LEARNED_INDICES_KEYENCODING_H
+#define LEARNED_INDICES_KEYENCODING_H
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+/**
+ * @brief Maps a key type onto an unsigned integer type with the same order
+ *
+ * The sorted key column stores encoded keys, so the last mile search only ever compares
+ * unsigned integers (which is what the SIMD search supports). Only arithmetic keys are supported.
+ *
+ * @tparam KeyType [in]: The key type to encode
+ */
+template <typename KeyType, typename Enable = void>
+struct KeyEncoding {
+    static_assert(std::is_arithmetic<KeyType>::value, "Only integer and floating point keys are supported");
+};
+
+/**
+ * @brief Integer keys: unsigned keys are stored as is, signed keys have their sign bit flipped
+ */
+template <typename KeyType>
+struct KeyEncoding<KeyType, typename std::enable_if<std::is_integral<KeyType>::value>::type> {
+    typedef typename std::make_unsigned<KeyType>::type EncodedType;
+
+    static const EncodedType signBit = std::is_signed<KeyType>::value ?
+                                       static_cast<EncodedType>(EncodedType(1) << (sizeof(EncodedType) * 8 - 1)) : 0;
+
+    static EncodedType encode(KeyType key) {
+        // Flipping the sign bit maps [min, max] onto [0, max unsigned] in order
+        return static_cast<EncodedType>(static_cast<EncodedType>(key) ^ signBit);
+    }
+
+    static KeyType decode(EncodedType encoded) {
+        return static_cast<KeyType>(static_cast<EncodedType>(encoded ^ signBit));
+    }
+
+    /**
+     * @brief The network input for a key, as an offset from origin (the smallest trained key)
+     *
+     * Taking the difference in the encoded domain is exact, so large keys (e.g. nanosecond
+     * timestamps) don't all collapse onto the same float.
+     */
+    static float toModelInput(KeyType key, KeyType origin) {
+        EncodedType encodedKey = encode(key);
+        EncodedType encodedOrigin = encode(origin);
+        if (encodedKey >= encodedOrigin) {
+            return static_cast<float>(encodedKey - encodedOrigin);
+        }
+        return -static_cast<float>(encodedOrigin - encodedKey);
+    }
+};
+
+/**
+ * @brief Floating point keys: the IEEE-754 bits, with negatives inverted so they sort below positives
+ */
+template <typename KeyType>
+struct KeyEncoding<KeyType, typename std::enable_if<std::is_floating_point<KeyType>::value>::type> {
+    static_assert(sizeof(KeyType) == sizeof(uint32_t) || sizeof(KeyType) == sizeof(uint64_t),
+                  "Only 32 and 64 bit floating point keys are supported");
+
+    typedef typename std::conditional<sizeof(KeyType) == sizeof(uint32_t), uint32_t, uint64_t>::type EncodedType;
+
+    static const EncodedType signBit = static_cast<EncodedType>(EncodedType(1) << (sizeof(EncodedType) * 8 - 1));
+
+    static EncodedType encode(KeyType key) {
+        assert(key == key && "NaN keys can't be ordered");
+
+        // -0.0 and 0.0 compare equal, so they must encode the same
+        if (key == 0) {
+            key = 0;
+        }
+
+        EncodedType bits;
+        std::memcpy(&bits, &key, sizeof(bits));
+        return (bits & signBit) ? static_cast<EncodedType>(~bits) : static_cast<EncodedType>(bits | signBit);
+    }
+
+    static KeyType decode(EncodedType encoded) {
+        EncodedType bits = (encoded & signBit) ? static_cast<EncodedType>(encoded & ~signBit) : static_cast<EncodedType>(~encoded);
+        KeyType key;
+        std::memcpy(&key, &bits, sizeof(key));
+        return key;
+    }
+
+    /**
+     * @brief The network input for a key, as an offset from origin (the smallest trained key)
+     */
+    static float toModelInput(KeyType key, KeyType origin) {
+        return static_cast<float>(static_cast<double>(key) - static_cast<double>(origin));
+    }
+};
+
+template <typename KeyType>
+const typename KeyEncoding<KeyType, typename std::enable_if<std::is_integral<KeyType>::value>::type>::EncodedType
+KeyEncoding<KeyType, typename std::enable_if<std::is_integral<KeyType>::value>::type>::signBit;
+
+template <typename KeyType>
+const typename KeyEncoding<KeyType, typename std::enable_if<std::is_floating_point<KeyType>::value>::type>::EncodedType
+KeyEncoding<KeyType, typename std::enable_if<std::is_floating_point<KeyType>::value>::type>::signBit;
+
+#endif //LEARNED_INDICES_KEYENCODING_H
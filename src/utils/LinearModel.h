@@ -0,0 +1,113 @@
+/**
+ * @file LinearModel.h
+ *
+ * @breif A closed form linear model of position, for places too numerous to train a network each
+ *
+ * @date 1/07/2018
+ * @author Ben Caine
+ */
+
+#ifndef LEARNED_INDICES_LINEARMODEL_H
+#define LEARNED_INDICES_LINEARMODEL_H
+
+#include "SearchUtils.h"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+/**
+ * @brief A least squares fit of position against model input, plus its max errors
+ *
+ * Same contract as a (non tree) SecondStageNode: the true position of any key it was fit on is
+ * within [predict() + maxNegativeError, predict() + maxPositiveError].
+ */
+struct LinearModel {
+    float slope;            ///< Positions per unit of model input
+    float intercept;        ///< Position at model input 0
+    int maxNegativeError;   ///< Max error (negative) of a prediction
+    int maxPositiveError;   ///< Max error (positive) of a prediction
+
+    LinearModel(): slope(0), intercept(0), maxNegativeError(0), maxPositiveError(0) {}
+
+    /**
+     * @brief Predict a position
+     * @param modelInput [in]: The model input of the key
+     * @return A predicted position (may be out of range, callers clamp)
+     */
+    long predict(float modelInput) const {
+        return static_cast<long>(slope * modelInput + intercept);
+    }
+
+    /**
+     * @brief Lower bound of a key in the sorted keys the model was fit on
+     *
+     * Searches the error window first. The error bounds only cover keys that were fit, so a
+     * missing key can land outside the window, in which case the search continues past it.
+     *
+     * @param keys [in]: The sorted (encoded) keys the model was fit on
+     * @param size [in]: Number of keys
+     * @param modelInput [in]: The model input of key
+     * @param key [in]: The (encoded) key to search for
+     * @return Offset of the first key not less than key, or size
+     */
+    template <typename EncodedType>
+    size_t lowerBound(const EncodedType *keys, size_t size, float modelInput, EncodedType key) const {
+        const long lastIdx = static_cast<long>(size) - 1;
+        long predictedIdx = predict(modelInput);
+        long startIdx = std::max(0L, std::min(lastIdx + 1, predictedIdx + maxNegativeError));
+        long endIdx = std::max(startIdx - 1, std::min(lastIdx, predictedIdx + maxPositiveError));
+
+        size_t position = startIdx + simdLowerBound(keys + startIdx, endIdx + 1 - startIdx, key);
+        if (position == static_cast<size_t>(endIdx + 1) && position < size) {
+            position += simdLowerBound(keys + position, size - position, key);
+        } else if (position == static_cast<size_t>(startIdx) && startIdx > 0 && !(keys[startIdx - 1] < key)) {
+            position = simdLowerBound(keys, startIdx, key);
+        }
+        return position;
+    }
+
+    /**
+     * @brief Fit to sorted keys, where the key at offset ii from first sits at position ii
+     * @param first [in]: Start of the sorted keys
+     * @param last [in]: End of the sorted keys
+     * @param modelInput [in]: Maps a key to its model input
+     */
+    template <typename Iterator, typename ModelInputFunc>
+    void fit(Iterator first, Iterator last, ModelInputFunc modelInput) {
+        const double count = static_cast<double>(last - first);
+        double meanInput = 0;
+        double meanPosition = (count - 1) / 2;
+        for (Iterator it = first; it != last; ++it) {
+            meanInput += modelInput(*it);
+        }
+        meanInput = count > 0 ? meanInput / count : 0;
+
+        double covariance = 0;
+        double variance = 0;
+        for (Iterator it = first; it != last; ++it) {
+            double input = modelInput(*it) - meanInput;
+            covariance += input * (static_cast<double>(it - first) - meanPosition);
+            variance += input * input;
+        }
+
+        slope = variance > 0 ? static_cast<float>(covariance / variance) : 0.0f;
+        intercept = static_cast<float>(meanPosition - slope * meanInput);
+        computeErrors(first, last, modelInput);
+    }
+
+    /**
+     * @brief Recompute the error bounds of the current slope and intercept over sorted keys
+     */
+    template <typename Iterator, typename ModelInputFunc>
+    void computeErrors(Iterator first, Iterator last, ModelInputFunc modelInput) {
+        maxNegativeError = 0;
+        maxPositiveError = 0;
+        for (Iterator it = first; it != last; ++it) {
+            long error = static_cast<long>(it - first) - predict(modelInput(*it));
+            maxNegativeError = static_cast<int>(std::min(static_cast<long>(maxNegativeError), error));
+            maxPositiveError = static_cast<int>(std::max(static_cast<long>(maxPositiveError), error));
+        }
+    }
+};
+
+#endif //LEARNED_INDICES_LINEARMODEL_H
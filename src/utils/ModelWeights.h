@@ -0,0 +1,186 @@
+/**
+ * @file ModelWeights.h
+ *
+ * @breif Root network and leaf weights trained outside the index, e.g. in PyTorch, and their file format
+ *
+ * @date 1/07/2018
+ * @author Ben Caine
+ */
+
+#ifndef LEARNED_INDICES_MODELWEIGHTS_H
+#define LEARNED_INDICES_MODELWEIGHTS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Weights of a whole RMI: the Linear(1, n) -> ReLU -> Linear(n, 1) root and a Linear(1, 1) per leaf
+ *
+ * Every model takes the model input of a key (its offset from the smallest trained key, see
+ * KeyEncoding::toModelInput) and outputs a fraction of the number of distinct keys, exactly like
+ * the networks the index trains itself (and the notebook's `model(x) * dataset_size`).
+ *
+ * On disk, everything is little endian:
+ *
+ *     char[8]    magic "LIDXWTS1"
+ *     uint32     number of hidden neurons n
+ *     uint32     number of leaves
+ *     float32[n] root hidden weights     (PyTorch Linear(1, n).weight, shape [n, 1])
+ *     float32[n] root hidden biases      (Linear(1, n).bias)
+ *     float32[n] root output weights     (Linear(n, 1).weight, shape [1, n])
+ *     float32    root output bias        (Linear(n, 1).bias)
+ *     float32[2] per leaf, its weight then its bias
+ */
+struct ModelWeights {
+    std::vector<float> hiddenWeights;                   ///< Root hidden layer weights
+    std::vector<float> hiddenBiases;                    ///< Root hidden layer biases
+    std::vector<float> outputWeights;                   ///< Root output layer weights
+    float outputBias;                                   ///< Root output layer bias
+    std::vector<std::pair<float, float>> leaves;        ///< (weight, bias) of each leaf
+
+    ModelWeights(): outputBias(0) {}
+
+    /**
+     * @brief Evaluate the root network
+     * @param modelInput [in]: The model input of a key
+     * @return The predicted fraction of the distinct keys below it
+     */
+    float evaluateRoot(float modelInput) const {
+        float output = outputBias;
+        for (size_t ii = 0; ii < hiddenWeights.size(); ++ii) {
+            output += std::max(0.0f, hiddenWeights[ii] * modelInput + hiddenBiases[ii]) * outputWeights[ii];
+        }
+        return output;
+    }
+
+    /**
+     * @brief Read weights from a file in the format above
+     * @return Whether the file was read in full
+     */
+    bool read(const std::string &path);
+
+    /**
+     * @brief Write weights to a file in the format above
+     * @return Whether the file was written
+     */
+    bool write(const std::string &path) const;
+
+private:
+
+    /**
+     * @brief Read a little endian uint32, whatever the host byte order
+     */
+    static bool readUint32(std::istream &input, uint32_t &out) {
+        unsigned char bytes[4];
+        if (!input.read(reinterpret_cast<char *>(bytes), sizeof(bytes))) {
+            return false;
+        }
+        out = static_cast<uint32_t>(bytes[0]) | static_cast<uint32_t>(bytes[1]) << 8 |
+              static_cast<uint32_t>(bytes[2]) << 16 | static_cast<uint32_t>(bytes[3]) << 24;
+        return true;
+    }
+
+    /**
+     * @brief Write a little endian uint32, whatever the host byte order
+     */
+    static void writeUint32(std::ostream &output, uint32_t value) {
+        const char bytes[4] = {static_cast<char>(value), static_cast<char>(value >> 8),
+                               static_cast<char>(value >> 16), static_cast<char>(value >> 24)};
+        output.write(bytes, sizeof(bytes));
+    }
+
+    /**
+     * @brief Read count little endian floats into out
+     */
+    static bool readFloats(std::istream &input, std::vector<float> &out, size_t count) {
+        out.resize(count);
+        for (size_t ii = 0; ii < count; ++ii) {
+            uint32_t bits;
+            if (!readUint32(input, bits)) {
+                return false;
+            }
+            std::memcpy(&out[ii], &bits, sizeof(float));
+        }
+        return true;
+    }
+
+    /**
+     * @brief Write a little endian float
+     */
+    static void writeFloat(std::ostream &output, float value) {
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        writeUint32(output, bits);
+    }
+};
+
+
+inline bool ModelWeights::read(const std::string &path) {
+    std::ifstream input(path, std::ios::binary);
+    char magic[8];
+    uint32_t numNeurons = 0;
+    uint32_t numLeaves = 0;
+    if (!input.read(magic, sizeof(magic)) || std::memcmp(magic, "LIDXWTS1", sizeof(magic)) != 0 ||
+        !readUint32(input, numNeurons) || !readUint32(input, numLeaves)) {
+        std::cerr << "Not a weights file: " << path << std::endl;
+        return false;
+    }
+
+    // Check the counts against the file size before allocating for them, a corrupt header could
+    // otherwise ask for gigabytes
+    const std::streampos header = input.tellg();
+    input.seekg(0, std::ios::end);
+    const uint64_t remaining = static_cast<uint64_t>(input.tellg() - header);
+    input.seekg(header);
+    const uint64_t expected = (3 * static_cast<uint64_t>(numNeurons) + 1 + 2 * static_cast<uint64_t>(numLeaves)) *
+                              sizeof(float);
+    if (!input || remaining < expected) {
+        std::cerr << "Truncated weights file: " << path << std::endl;
+        return false;
+    }
+
+    std::vector<float> outputBiases;
+    std::vector<float> leafWeights;
+    if (!readFloats(input, hiddenWeights, numNeurons) || !readFloats(input, hiddenBiases, numNeurons) ||
+        !readFloats(input, outputWeights, numNeurons) || !readFloats(input, outputBiases, 1) ||
+        !readFloats(input, leafWeights, 2 * static_cast<size_t>(numLeaves))) {
+        std::cerr << "Truncated weights file: " << path << std::endl;
+        return false;
+    }
+
+    outputBias = outputBiases[0];
+    leaves.clear();
+    for (size_t ii = 0; ii < numLeaves; ++ii) {
+        leaves.push_back({leafWeights[2 * ii], leafWeights[2 * ii + 1]});
+    }
+    return true;
+}
+
+inline bool ModelWeights::write(const std::string &path) const {
+    std::ofstream output(path, std::ios::binary | std::ios::trunc);
+    output.write("LIDXWTS1", 8);
+    writeUint32(output, static_cast<uint32_t>(hiddenWeights.size()));
+    writeUint32(output, static_cast<uint32_t>(leaves.size()));
+    for (const auto &layer : {&hiddenWeights, &hiddenBiases, &outputWeights}) {
+        for (float weight : *layer) {
+            writeFloat(output, weight);
+        }
+    }
+    writeFloat(output, outputBias);
+    for (const auto &leaf : leaves) {
+        writeFloat(output, leaf.first);
+        writeFloat(output, leaf.second);
+    }
+    if (!output) {
+        std::cerr << "Failed to write weights file: " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+#endif //LEARNED_INDICES_MODELWEIGHTS_H
@@ -0,0 +1,103 @@
+/**
+ * @file PayloadArena.h
+ *
+ * @breif Arena storage for variable length values, referenced from an index by small fixed size handles
+ *
+ * @date 1/07/2018
+ * @author Ben Caine
+ */
+
+#ifndef LEARNED_INDICES_PAYLOADARENA_H
+#define LEARNED_INDICES_PAYLOADARENA_H
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Handle to a payload in a PayloadArena, cheap to store as an index's ValueType
+ */
+struct PayloadRef {
+    uint32_t chunk;     ///< Chunk holding the payload
+    uint32_t offset;    ///< Offset of the payload in the chunk
+    uint32_t size;      ///< Payload size in bytes
+};
+
+/**
+ * @brief A read only view of a payload, pointing straight into the arena
+ */
+struct PayloadView {
+    const char *data;   ///< First byte of the payload
+    size_t size;        ///< Payload size in bytes
+
+    std::string toString() const {
+        return std::string(data, size);
+    }
+};
+
+/**
+ * @brief Append only storage for variable length payloads (strings, blobs)
+ *
+ * Payloads are copied in once, back to back in large chunks. Chunks never move, so a view stays
+ * valid for the lifetime of the arena, and an index storing PayloadRef values sorts and returns
+ * 12 byte handles instead of the payloads themselves.
+ */
+class PayloadArena {
+public:
+
+    /**
+     * @param chunkSize [in]: Bytes per chunk, larger payloads get a chunk of their own
+     */
+    explicit PayloadArena(size_t chunkSize = 1 << 20): m_chunkSize(chunkSize), m_used(0), m_totalSize(0) {}
+
+    /**
+     * @brief Copy a payload into the arena
+     * @return The handle to store in the index
+     */
+    PayloadRef append(const void *data, size_t size) {
+        assert(size <= UINT32_MAX && "Payloads are limited to 4GB");
+        if (m_chunks.empty() || m_used + size > m_chunkSize) {
+            m_chunks.emplace_back(new char[std::max(size, m_chunkSize)]);
+            m_used = 0;
+        }
+
+        PayloadRef ref = {static_cast<uint32_t>(m_chunks.size() - 1), static_cast<uint32_t>(m_used), static_cast<uint32_t>(size)};
+        if (size > 0) {
+            std::memcpy(m_chunks.back().get() + m_used, data, size);
+        }
+        m_used += size;
+        m_totalSize += size;
+        return ref;
+    }
+
+    PayloadRef append(const std::string &payload) {
+        return append(payload.data(), payload.size());
+    }
+
+    /**
+     * @return A view of a payload, without copying it
+     */
+    PayloadView view(const PayloadRef &ref) const {
+        return {m_chunks[ref.chunk].get() + ref.offset, ref.size};
+    }
+
+    /**
+     * @return Total bytes of payload stored
+     */
+    size_t size() const {
+        return m_totalSize;
+    }
+
+private:
+    ///------------ Data members ----------------
+    size_t m_chunkSize;                             ///< Bytes per chunk
+    size_t m_used;                                  ///< Bytes used in the last chunk
+    size_t m_totalSize;                             ///< Bytes of payload over every chunk
+    std::vector<std::unique_ptr<char[]>> m_chunks;  ///< Payload storage, never moved once allocated
+};
+
+#endif //LEARNED_INDICES_PAYLOADARENA_H
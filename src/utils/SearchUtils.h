@@ -0,0 +1,247 @@
+/**
+ * @file SearchUtils.h
+ *
+ * @breif Search helpers used by the last mile search of the Recursive Model Index
+ *
+ * @date 1/07/2018
+ * @author Ben Caine
+ */
+
+#ifndef LEARNED_INDICES_SEARCHUTILS_H
+#define LEARNED_INDICES_SEARCHUTILS_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * @brief Find the first element not less than value, galloping forward from first
+ *
+ * Cost is logarithmic in the distance between first and the result rather than in the
+ * size of the whole range, which makes it cheap when consecutive probes land close together.
+ *
+ * @tparam Iterator [in]: A random access iterator
+ * @tparam T [in]: The type of the value we are searching for
+ * @tparam Compare [in]: Comparator of (element, value) returning element < value
+ * @param first [in]: Where to start galloping from
+ * @param last [in]: End of the range
+ * @param value [in]: Value to search for
+ * @param comp [in]: The less than comparator
+ * @return An iterator to the first element not less than value, or last
+ */
+template <typename Iterator, typename T, typename Compare>
+Iterator gallopingLowerBound(Iterator first, Iterator last, const T &value, Compare comp) {
+    typedef typename std::iterator_traits<Iterator>::difference_type DifferenceType;
+    DifferenceType length = last - first;
+    if (length == 0 || !comp(*first, value)) {
+        return first;
+    }
+
+    // Double the step until we overshoot, then binary search the last step
+    DifferenceType previous = 0;
+    DifferenceType step = 1;
+    while (step < length && comp(*(first + step), value)) {
+        previous = step;
+        step *= 2;
+    }
+
+    return std::lower_bound(first + previous + 1, first + std::min(step, length), value, comp);
+}
+
+/**
+ * @brief Find the first element not less than value with interpolation search
+ *
+ * Each step assumes keys are spread evenly between the ends of the remaining range (a linear
+ * fit of the range), which needs no training at all. Interpolation search degrades badly on skewed
+ * data, so after a fixed number of steps we finish with a plain binary search.
+ *
+ * @tparam Iterator [in]: A random access iterator
+ * @tparam T [in]: The type of the value we are searching for (arithmetic)
+ * @tparam KeyFunc [in]: Extracts the (arithmetic) key from an element
+ * @param first [in]: Start of the sorted range
+ * @param last [in]: End of the sorted range
+ * @param value [in]: Value to search for
+ * @param keyOf [in]: Key extractor
+ * @return An iterator to the first element not less than value, or last
+ */
+template <typename Iterator, typename T, typename KeyFunc>
+Iterator interpolationLowerBound(Iterator first, Iterator last, const T &value, KeyFunc keyOf) {
+    typedef typename std::iterator_traits<Iterator>::difference_type DifferenceType;
+    const int maxInterpolationSteps = 16;
+    const DifferenceType smallRange = 16;
+
+    for (int step = 0; step < maxInterpolationSteps && last - first > smallRange; ++step) {
+        auto firstKey = keyOf(*first);
+        auto lastKey = keyOf(*(last - 1));
+
+        if (!(firstKey < value)) {
+            return first;
+        }
+        if (lastKey < value) {
+            return last;
+        }
+
+        // firstKey < value <= lastKey, so the answer is in (first, last - 1]
+        double fraction = (static_cast<double>(value) - static_cast<double>(firstKey)) /
+                          (static_cast<double>(lastKey) - static_cast<double>(firstKey));
+        DifferenceType offset = static_cast<DifferenceType>(fraction * static_cast<double>(last - 1 - first));
+        offset = std::max(static_cast<DifferenceType>(1), std::min(offset, last - first - 1));
+
+        Iterator probe = first + offset;
+        if (keyOf(*probe) < value) {
+            first = probe + 1;
+        } else {
+            last = probe + 1;
+        }
+    }
+
+    return std::lower_bound(first, last, value, [&](const typename std::iterator_traits<Iterator>::value_type &element,
+                                                    const T &target) {
+        return keyOf(element) < target;
+    });
+}
+
+/**
+ * @brief Count how many elements of a (small) array are less than key
+ *
+ * Scalar version for any type, the unsigned 32 and 64 bit overloads below use SIMD when available.
+ */
+template <typename T>
+inline size_t countLessThan(const T *data, size_t size, T key) {
+    size_t count = 0;
+    for (size_t ii = 0; ii < size; ++ii) {
+        count += data[ii] < key;
+    }
+    return count;
+}
+
+/**
+ * @brief Count how many elements of a (small) array are less than key, SIMD for unsigned 32 bit keys
+ *
+ * SSE/AVX only have signed comparisons, so both sides get their sign bit flipped first.
+ */
+inline size_t countLessThan(const uint32_t *data, size_t size, uint32_t key) {
+    size_t count = 0;
+    size_t ii = 0;
+#if defined(__AVX2__)
+    const __m256i signFlip256 = _mm256_set1_epi32(static_cast<int>(0x80000000u));
+    const __m256i key256 = _mm256_xor_si256(_mm256_set1_epi32(static_cast<int>(key)), signFlip256);
+    for (; ii + 8 <= size; ii += 8) {
+        __m256i values = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + ii)), signFlip256);
+        __m256i less = _mm256_cmpgt_epi32(key256, values);
+        count += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(less)));
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i signFlip = _mm_set1_epi32(static_cast<int>(0x80000000u));
+    const __m128i key128 = _mm_xor_si128(_mm_set1_epi32(static_cast<int>(key)), signFlip);
+    for (; ii + 4 <= size; ii += 4) {
+        __m128i values = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + ii)), signFlip);
+        __m128i less = _mm_cmpgt_epi32(key128, values);
+        count += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(less)));
+    }
+#endif
+    return count + countLessThan<uint32_t>(data + ii, size - ii, key);
+}
+
+/**
+ * @brief Count how many elements of a (small) array are less than key, SIMD for unsigned 64 bit keys
+ *
+ * 64 bit comparisons need SSE4.2 or AVX2, otherwise this is the scalar loop.
+ */
+inline size_t countLessThan(const uint64_t *data, size_t size, uint64_t key) {
+    size_t count = 0;
+    size_t ii = 0;
+#if defined(__AVX2__)
+    const __m256i signFlip256 = _mm256_set1_epi64x(static_cast<long long>(0x8000000000000000ull));
+    const __m256i key256 = _mm256_xor_si256(_mm256_set1_epi64x(static_cast<long long>(key)), signFlip256);
+    for (; ii + 4 <= size; ii += 4) {
+        __m256i values = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + ii)), signFlip256);
+        __m256i less = _mm256_cmpgt_epi64(key256, values);
+        count += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(less)));
+    }
+#endif
+#if defined(__SSE4_2__)
+    const __m128i signFlip = _mm_set1_epi64x(static_cast<long long>(0x8000000000000000ull));
+    const __m128i key128 = _mm_xor_si128(_mm_set1_epi64x(static_cast<long long>(key)), signFlip);
+    for (; ii + 2 <= size; ii += 2) {
+        __m128i values = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + ii)), signFlip);
+        __m128i less = _mm_cmpgt_epi64(key128, values);
+        count += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(less)));
+    }
+#endif
+    return count + countLessThan<uint64_t>(data + ii, size - ii, key);
+}
+
+/**
+ * @brief Find the first element not less than key in a sorted array
+ *
+ * Binary search narrows the range down to a few cache lines, then the rest is a branch free
+ * (SIMD where available) count of the elements below key.
+ *
+ * @param data [in]: Sorted array
+ * @param size [in]: Number of elements
+ * @param key [in]: Key to search for
+ * @return Index of the first element not less than key, or size
+ */
+template <typename T>
+size_t simdLowerBound(const T *data, size_t size, T key) {
+    const size_t linearThreshold = 64;
+
+    size_t first = 0;
+    while (size > linearThreshold) {
+        size_t half = size / 2;
+        if (data[first + half] < key) {
+            first += half + 1;
+            size -= half + 1;
+        } else {
+            size = half;
+        }
+    }
+    return first + countLessThan(data + first, size, key);
+}
+
+/**
+ * @brief The key comparisons simdLowerBound(data, size, key) makes, counting each element of the final count as one
+ */
+template <typename T>
+size_t simdLowerBoundComparisons(const T *data, size_t size, T key) {
+    const size_t linearThreshold = 64;
+
+    size_t first = 0;
+    size_t comparisons = 0;
+    while (size > linearThreshold) {
+        size_t half = size / 2;
+        comparisons++;
+        if (data[first + half] < key) {
+            first += half + 1;
+            size -= half + 1;
+        } else {
+            size = half;
+        }
+    }
+    return comparisons + size;
+}
+
+/**
+ * @brief The key comparisons simdLowerBound makes on average over an array of a given size
+ */
+inline double expectedSimdLowerBoundComparisons(size_t size) {
+    const size_t linearThreshold = 64;
+
+    // Each binary step keeps half or half - 1 of the elements, the final count reads the rest
+    double remaining = static_cast<double>(size);
+    double comparisons = 0;
+    while (remaining > linearThreshold) {
+        remaining = (remaining - 1) / 2;
+        comparisons++;
+    }
+    return comparisons + remaining;
+}
+
+#endif //LEARNED_INDICES_SEARCHUTILS_H
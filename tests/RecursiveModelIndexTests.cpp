@@ -0,0 +1,1253 @@
+/**
+ * @file RecursiveModelIndexTests.cpp
+ *
+ * @breif Tests on the Recursive Model Index itself
+ *
+ * @date 1/07/2018
+ * @author Ben Caine
+ */
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE RecursiveModelIndexTests
+
+#include <boost/test/unit_test.hpp>
+#include "../src/utils/DataGenerators.h"
+#include "../src/RecursiveModelIndex.h"
+#include "../src/LearnedJoin.h"
+#include "../src/AdaptiveIndex.h"
+#include "../src/StringRecursiveModelIndex.h"
+#include "../src/CompositeRecursiveModelIndex.h"
+#include "../src/LearnedGridIndex.h"
+#include "../src/InterleavedLookups.h"
+#include "../src/FrozenIndex.h"
+#include "../src/SnapshotIndex.h"
+#include "../src/utils/LinearModel.h"
+#include "../src/utils/PayloadArena.h"
+
+namespace {
+    // Small, quick to train networks. We only care about correctness here, not model quality
+    NetworkParameters getFirstStageParams() {
+        NetworkParameters params;
+        params.batchSize = 32;
+        params.maxNumEpochs = 200;
+        params.learningRate = 0.01;
+        params.numNeurons = 8;
+        return params;
+    }
+
+    NetworkParameters getSecondStageParams() {
+        NetworkParameters params;
+        params.batchSize = 8;
+        params.maxNumEpochs = 100;
+        params.learningRate = 0.01;
+        params.numNeurons = 1;
+        return params;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(rmi_find_test) {
+    const size_t datasetSize = 2000;
+    auto values = getIntegerLognormals<int, datasetSize>(1e5);
+
+    RecursiveModelIndex<int, int, 16> index(getFirstStageParams(), getSecondStageParams(), 256, 1e6);
+    for (auto value : values) {
+        index.insert(value, value + 1);
+    }
+    index.train();
+
+    for (auto value : values) {
+        auto result = index.find(value);
+        BOOST_REQUIRE_MESSAGE(result, "Failed to find key " << value);
+        BOOST_CHECK_EQUAL(result.get().first, value);
+        BOOST_CHECK_EQUAL(result.get().second, value + 1);
+    }
+
+    BOOST_CHECK(!index.find(-1));
+    BOOST_CHECK(!index.find(1e6));
+}
+
+BOOST_AUTO_TEST_CASE(rmi_find_sorted_test) {
+    const size_t datasetSize = 2000;
+    auto values = getIntegerLognormals<int, datasetSize>(1e5);
+
+    RecursiveModelIndex<int, int, 16> index(getFirstStageParams(), getSecondStageParams(), 256, 1e6);
+    for (auto value : values) {
+        // Only even keys, so odd probes are misses
+        index.insert(value * 2, value);
+    }
+    index.train();
+
+    // Pending inserts are found too
+    index.insert(-3, 42);
+
+    std::vector<int> probes = {-3};
+    for (int ii = 0; ii <= 2 * values.back() + 1; ii += 7) {
+        probes.push_back(ii);
+    }
+
+    auto results = index.findSorted(probes);
+    BOOST_REQUIRE_EQUAL(results.size(), probes.size());
+
+    BOOST_REQUIRE(results[0]);
+    BOOST_CHECK_EQUAL(results[0].get().second, 42);
+
+    for (size_t ii = 1; ii < probes.size(); ++ii) {
+        bool present = probes[ii] % 2 == 0 && std::binary_search(values.begin(), values.end(), probes[ii] / 2);
+        BOOST_CHECK_EQUAL(static_cast<bool>(results[ii]), present);
+        if (present && results[ii]) {
+            BOOST_CHECK_EQUAL(results[ii].get().first, probes[ii]);
+            BOOST_CHECK_EQUAL(results[ii].get().second, probes[ii] / 2);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(rmi_learned_join_test) {
+    const size_t datasetSize = 2000;
+    auto values = getIntegerLognormals<int, datasetSize>(1e5);
+
+    // Large side holds every lognormal, small side every 50th value plus some keys that aren't in the large side
+    RecursiveModelIndex<int, int, 16> large(getFirstStageParams(), getSecondStageParams(), 256, 1e6);
+    RecursiveModelIndex<int, int, 16> small(getFirstStageParams(), getSecondStageParams(), 256, 1e6);
+    for (auto value : values) {
+        large.insert(value, value + 1);
+    }
+    std::vector<int> smallKeys;
+    for (size_t ii = 0; ii < datasetSize; ii += 50) {
+        smallKeys.push_back(values[ii]);
+        smallKeys.push_back(-static_cast<int>(ii) - 1);
+    }
+    for (auto key : smallKeys) {
+        small.insert(key, key * 3);
+    }
+    large.train();
+    small.train();
+
+    std::vector<int> sortedSmall(smallKeys);
+    std::sort(sortedSmall.begin(), sortedSmall.end());
+    std::vector<int> expected;
+    std::set_intersection(sortedSmall.begin(), sortedSmall.end(), values.begin(), values.end(), std::back_inserter(expected));
+    expected.erase(std::unique(expected.begin(), expected.end()), expected.end());
+
+    BOOST_CHECK(learnedIntersection(small, large) == expected);
+    BOOST_CHECK(learnedIntersection(large, small) == expected);
+
+    size_t expectedMatches = 0;
+    for (auto key : smallKeys) {
+        expectedMatches += std::count(values.begin(), values.end(), key);
+    }
+
+    size_t matches = 0;
+    learnedMergeJoin(small, large, [&](int key, int smallValue, int largeValue) {
+        BOOST_CHECK_EQUAL(smallValue, key * 3);
+        BOOST_CHECK_EQUAL(largeValue, key + 1);
+        matches++;
+    });
+    BOOST_CHECK_EQUAL(matches, expectedMatches);
+}
+
+BOOST_AUTO_TEST_CASE(rmi_interpolation_mode_test) {
+    const size_t datasetSize = 2000;
+    auto values = getIntegerLognormals<int, datasetSize>(1e5);
+
+    std::vector<std::pair<int, int>> data;
+    for (auto value : values) {
+        data.push_back({value, value + 1});
+    }
+    std::reverse(data.begin(), data.end());
+
+    RecursiveModelIndex<int, int, 16> index(getFirstStageParams(), getSecondStageParams(), 256, 1e6);
+
+    // Served before any training
+    index.load(data);
+    BOOST_CHECK(!index.usingLearnedModels());
+    for (auto value : values) {
+        auto result = index.find(value);
+        BOOST_REQUIRE_MESSAGE(result, "Failed to find key " << value);
+        BOOST_CHECK_EQUAL(result.get().second, value + 1);
+    }
+    BOOST_CHECK(!index.find(-1));
+    BOOST_CHECK(!index.find(1e6));
+
+    // Forcing the fallback on a trained index gives the same answers
+    index.train();
+    BOOST_CHECK_EQUAL(index.usingLearnedModels(), index.areModelsUsable());
+    index.setLookupMode(RecursiveModelIndex<int, int, 16>::LookupMode::Interpolation);
+    BOOST_CHECK(!index.usingLearnedModels());
+
+    std::vector<int> probes(values.begin(), values.end());
+    auto results = index.findSorted(probes);
+    for (size_t ii = 0; ii < probes.size(); ++ii) {
+        BOOST_REQUIRE(results[ii]);
+        BOOST_CHECK_EQUAL(results[ii].get().second, probes[ii] + 1);
+    }
+
+    index.setLookupMode(RecursiveModelIndex<int, int, 16>::LookupMode::Learned);
+    BOOST_CHECK(index.usingLearnedModels());
+    BOOST_CHECK(index.find(values[datasetSize / 2]));
+}
+
+BOOST_AUTO_TEST_CASE(rmi_adaptive_index_test) {
+    const size_t datasetSize = 2000;
+    auto values = getIntegerLognormals<int, datasetSize>(1e5);
+
+    AdaptiveIndex<int, int, 16> index(getFirstStageParams(), getSecondStageParams(), 256, 1e6, 200);
+    for (auto value : values) {
+        index.insert(value, value + 1);
+    }
+    index.train();
+
+    // Whichever engine won, it has to give the same answers
+    index.insert(-5, 7);
+    for (auto value : values) {
+        auto result = index.find(value);
+        BOOST_REQUIRE_MESSAGE(result, "Failed to find key " << value);
+        BOOST_CHECK_EQUAL(result.get().second, value + 1);
+    }
+    BOOST_REQUIRE(index.find(-5));
+    BOOST_CHECK_EQUAL(index.find(-5).get().second, 7);
+    BOOST_CHECK(!index.find(-1));
+}
+
+BOOST_AUTO_TEST_CASE(rmi_duplicate_keys_test) {
+    // Heavy truncation gives long runs of duplicate keys
+    const size_t datasetSize = 5000;
+    auto values = getIntegerLognormals<int, datasetSize>(500);
+
+    RecursiveModelIndex<int, int, 16> index(getFirstStageParams(), getSecondStageParams(), 256, 1e6);
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        index.insert(values[ii], static_cast<int>(ii));
+    }
+    index.train();
+
+    std::vector<int> distinct(values.begin(), values.end());
+    distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+    BOOST_REQUIRE_EQUAL(index.distinctSize(), distinct.size());
+    BOOST_REQUIRE_EQUAL(index.trainedSize(), datasetSize);
+
+    index.insert(distinct[0], -1);
+    for (auto key : distinct) {
+        auto range = index.equalRange(key);
+        auto expected = std::equal_range(values.begin(), values.end(), key);
+        size_t expectedCount = expected.second - expected.first + (key == distinct[0] ? 1 : 0);
+        BOOST_REQUIRE_EQUAL(range.size(), expectedCount);
+
+        std::vector<int> expectedValues;
+        for (auto it = expected.first; it != expected.second; ++it) {
+            expectedValues.push_back(static_cast<int>(it - values.begin()));
+        }
+        if (key == distinct[0]) {
+            expectedValues.push_back(-1);
+        }
+        std::sort(range.begin(), range.end());
+        std::sort(expectedValues.begin(), expectedValues.end());
+        BOOST_CHECK(range == expectedValues);
+    }
+
+    BOOST_CHECK(index.equalRange(-10).empty());
+}
+
+BOOST_AUTO_TEST_CASE(rmi_string_keys_test) {
+    const size_t datasetSize = 2000;
+    auto values = getIntegerLognormals<int, datasetSize>(1e6);
+
+    // Long shared prefix, then keys that only differ deep into the string
+    std::vector<std::string> keys;
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        keys.push_back("https://example.com/users/" + std::to_string(values[ii]) + "/profile/" + std::to_string(ii % 3));
+    }
+
+    StringRecursiveModelIndex<int, 16> index(getFirstStageParams(), getSecondStageParams(), 256, 1e6);
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        index.insert(keys[ii], static_cast<int>(ii));
+    }
+    index.train();
+    index.insert("ftp://pending", -1);
+
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        auto result = index.find(keys[ii]);
+        BOOST_REQUIRE_MESSAGE(result, "Failed to find key " << keys[ii]);
+        BOOST_CHECK_EQUAL(result.get().first, keys[ii]);
+        BOOST_CHECK_EQUAL(keys[result.get().second], keys[ii]);
+    }
+
+    BOOST_REQUIRE(index.find("ftp://pending"));
+    BOOST_CHECK_EQUAL(index.find("ftp://pending").get().second, -1);
+    BOOST_CHECK(!index.find(""));
+    BOOST_CHECK(!index.find("https://example.com/users/"));
+    BOOST_CHECK(!index.find("https://example.com/users/1/profile/7"));
+    BOOST_CHECK(!index.find("zzz"));
+}
+
+BOOST_AUTO_TEST_CASE(rmi_key_encoding_test) {
+    std::vector<double> doubles = {-1e300, -2.5, -1.0, -1e-300, 0.0, 1e-300, 1.0, 2.5, 1e300};
+    for (size_t ii = 0; ii < doubles.size(); ++ii) {
+        BOOST_CHECK_EQUAL(KeyEncoding<double>::decode(KeyEncoding<double>::encode(doubles[ii])), doubles[ii]);
+        if (ii > 0) {
+            BOOST_CHECK(KeyEncoding<double>::encode(doubles[ii - 1]) < KeyEncoding<double>::encode(doubles[ii]));
+        }
+    }
+    BOOST_CHECK_EQUAL(KeyEncoding<double>::encode(-0.0), KeyEncoding<double>::encode(0.0));
+
+    std::vector<long> longs = {std::numeric_limits<long>::min(), -5, -1, 0, 1, 5, std::numeric_limits<long>::max()};
+    for (size_t ii = 0; ii < longs.size(); ++ii) {
+        BOOST_CHECK_EQUAL(KeyEncoding<long>::decode(KeyEncoding<long>::encode(longs[ii])), longs[ii]);
+        if (ii > 0) {
+            BOOST_CHECK(KeyEncoding<long>::encode(longs[ii - 1]) < KeyEncoding<long>::encode(longs[ii]));
+        }
+    }
+
+    std::vector<uint32_t> sorted;
+    for (uint32_t ii = 0; ii < 300; ++ii) {
+        sorted.push_back(ii * 3 + 0x7ffffff0u);
+    }
+    for (uint32_t key = 0x7fffffe0u; key < 0x7ffffff0u + 1000; ++key) {
+        BOOST_CHECK_EQUAL(simdLowerBound(sorted.data(), sorted.size(), key),
+                          std::lower_bound(sorted.begin(), sorted.end(), key) - sorted.begin());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(rmi_signed_and_floating_keys_test) {
+    const size_t datasetSize = 2000;
+    auto values = getIntegerLognormals<int, datasetSize>(1e5);
+
+    // Sensor style readings: doubles centred on zero
+    RecursiveModelIndex<double, int, 16> doubleIndex(getFirstStageParams(), getSecondStageParams(), 256, 1e6);
+    RecursiveModelIndex<long, int, 16> longIndex(getFirstStageParams(), getSecondStageParams(), 256, 1e6);
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        doubleIndex.insert(values[ii] / 7.0 - 1000.0, static_cast<int>(ii));
+        longIndex.insert(static_cast<long>(values[ii]) - 50000, static_cast<int>(ii));
+    }
+    doubleIndex.train();
+    longIndex.train();
+
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        auto doubleResult = doubleIndex.find(values[ii] / 7.0 - 1000.0);
+        BOOST_REQUIRE(doubleResult);
+        BOOST_CHECK_EQUAL(values[doubleResult.get().second], values[ii]);
+
+        auto longResult = longIndex.find(static_cast<long>(values[ii]) - 50000);
+        BOOST_REQUIRE(longResult);
+        BOOST_CHECK_EQUAL(values[longResult.get().second], values[ii]);
+    }
+
+    BOOST_CHECK(!doubleIndex.find(-1000.5));
+    BOOST_CHECK(!longIndex.find(-60000));
+    BOOST_CHECK_EQUAL(longIndex.distinctKeyAt(0), static_cast<long>(values[0]) - 50000);
+}
+
+BOOST_AUTO_TEST_CASE(rmi_composite_keys_test) {
+    const int numTenants = 20;
+    const int rowsPerTenant = 100;
+
+    // (tenant, timestamp) rows: each tenant's timestamps live in their own, differently scaled range
+    CompositeRecursiveModelIndex<int, long, int, 16> index(getFirstStageParams(), getSecondStageParams(), 256, 1e6);
+    for (int tenant = 0; tenant < numTenants; ++tenant) {
+        for (int ii = 0; ii < rowsPerTenant; ++ii) {
+            index.insert(tenant * 7, 1000000L * tenant + static_cast<long>(ii) * ii * (tenant + 1), tenant * rowsPerTenant + ii);
+        }
+    }
+    index.train();
+    index.insert(7, -5, -1);
+
+    for (int tenant = 0; tenant < numTenants; ++tenant) {
+        for (int ii = 0; ii < rowsPerTenant; ++ii) {
+            auto result = index.find(tenant * 7, 1000000L * tenant + static_cast<long>(ii) * ii * (tenant + 1));
+            BOOST_REQUIRE(result);
+            BOOST_CHECK_EQUAL(result.get().second, tenant * rowsPerTenant + ii);
+        }
+    }
+
+    BOOST_REQUIRE(index.find(7, -5));
+    BOOST_CHECK_EQUAL(index.find(7, -5).get().second, -1);
+    BOOST_CHECK(!index.find(8, 1000000L));
+    BOOST_CHECK(!index.find(7, 1000001L));
+
+    // Tenant 1 has timestamps 1000000 + 2 * ii * ii, plus the pending row
+    auto range = index.findRange(7, -10, 1000000L + 2 * 10 * 10);
+    BOOST_REQUIRE_EQUAL(range.size(), 12);
+    BOOST_CHECK_EQUAL(range.front().second, -1);
+    for (size_t ii = 1; ii < range.size(); ++ii) {
+        BOOST_CHECK_EQUAL(range[ii].first.leading, 7);
+        BOOST_CHECK_EQUAL(range[ii].second, rowsPerTenant + static_cast<int>(ii) - 1);
+    }
+    BOOST_CHECK(index.findRange(7, 1000003L, 1000007L).empty());
+}
+
+BOOST_AUTO_TEST_CASE(rmi_learned_grid_test) {
+    const size_t datasetSize = 2000;
+    auto xs = getIntegerLognormals<int, datasetSize>(1e5);
+    auto ys = getIntegerLognormals<int, datasetSize>(1e3);
+
+    // (x, y, time) points, with skewed x and y and uniform time
+    typedef LearnedGridIndex<int, int, 3, 16> GridIndex;
+    std::vector<GridIndex::Point> points;
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        points.push_back({{xs[ii], ys[(ii * 7) % datasetSize], static_cast<int>(ii)}});
+    }
+
+    GridIndex index(getFirstStageParams(), getSecondStageParams(), 8, 256, 1e6);
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        index.insert(points[ii], static_cast<int>(ii));
+    }
+    index.train();
+    index.insert({{-1, -1, -1}}, -1);
+
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        auto result = index.find(points[ii]);
+        BOOST_REQUIRE(result);
+        BOOST_CHECK(result.get().first == points[ii]);
+    }
+    BOOST_CHECK(index.find({{-1, -1, -1}}));
+    BOOST_CHECK(!index.find({{-1, -1, 0}}));
+
+    std::vector<std::pair<GridIndex::Point, GridIndex::Point>> queries;
+    for (size_t ii = 0; ii < 20; ++ii) {
+        const auto &corner = points[(ii * 97) % datasetSize];
+        queries.push_back({{{corner[0] - 500, corner[1] - 50, corner[2] - 300}},
+                           {{corner[0] + 500, corner[1] + 50, corner[2] + 300}}});
+    }
+    queries.push_back({{{-10, -10, -10}}, {{std::numeric_limits<int>::max(), std::numeric_limits<int>::max(), 0}}});
+
+    for (size_t columns : {4, 1, 32}) {
+        if (columns != 4) {
+            index.tune(queries, {columns});
+        }
+        for (const auto &query : queries) {
+            std::vector<int> expected;
+            if (query.first[0] <= -1 && query.first[1] <= -1 && query.first[2] <= -1) {
+                expected.push_back(-1);
+            }
+            for (size_t ii = 0; ii < datasetSize; ++ii) {
+                bool inside = true;
+                for (int dimension = 0; dimension < 3; ++dimension) {
+                    inside = inside && query.first[dimension] <= points[ii][dimension] && points[ii][dimension] <= query.second[dimension];
+                }
+                if (inside) {
+                    expected.push_back(static_cast<int>(ii));
+                }
+            }
+
+            std::vector<int> found;
+            for (const auto &pair : index.findRange(query.first, query.second)) {
+                found.push_back(pair.second);
+            }
+            std::sort(expected.begin(), expected.end());
+            std::sort(found.begin(), found.end());
+            BOOST_CHECK(found == expected);
+        }
+    }
+
+    size_t chosen = index.tune(queries, {2, 8});
+    BOOST_CHECK(chosen == 2 || chosen == 8);
+    BOOST_CHECK_EQUAL(index.getColumnsPerDimension(), chosen);
+}
+
+BOOST_AUTO_TEST_CASE(rmi_compressed_key_column_test) {
+    // Dense timestamps with a few large gaps, so blocks pack at different widths
+    std::vector<uint64_t> keys;
+    uint64_t key = 1500000000000000000ull;
+    for (size_t ii = 0; ii < 1000; ++ii) {
+        key += (ii % 300 == 0) ? 1ull << 40 : ii % 7;
+        if (keys.empty() || key != keys.back()) {
+            keys.push_back(key);
+        }
+    }
+
+    KeyColumn<uint64_t> column;
+    column.assign(std::vector<uint64_t>(keys));
+    size_t plainBytes = column.sizeInBytes();
+    column.setLayout(KeyLayout::FrameOfReference);
+    BOOST_CHECK(column.sizeInBytes() < plainBytes);
+    BOOST_REQUIRE_EQUAL(column.size(), keys.size());
+
+    for (size_t ii = 0; ii < keys.size(); ++ii) {
+        BOOST_CHECK_EQUAL(column[ii], keys[ii]);
+    }
+    for (size_t first : {0, 5, 64, 130}) {
+        for (size_t last : {first, first + 1, first + 63, keys.size()}) {
+            for (size_t ii = 0; ii < keys.size(); ii += 3) {
+                for (uint64_t probe : {keys[ii] - 1, keys[ii], keys[ii] + 1}) {
+                    size_t expected = std::lower_bound(keys.begin() + first, keys.begin() + last, probe) - keys.begin();
+                    BOOST_CHECK_EQUAL(column.lowerBound(first, last, probe), expected);
+                }
+            }
+        }
+    }
+
+    column.setLayout(KeyLayout::Plain);
+    BOOST_CHECK(std::equal(keys.begin(), keys.end(), column.begin()));
+
+    // The index serves the same lookups from either layout
+    const size_t datasetSize = 2000;
+    auto values = getIntegerLognormals<int, datasetSize>(1e6);
+    typedef RecursiveModelIndex<int, int, 16> Index;
+    Index index(getFirstStageParams(), getSecondStageParams(), 256, 1e6);
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        index.insert(values[ii], static_cast<int>(ii));
+    }
+    index.train();
+    index.setKeyLayout(KeyLayout::FrameOfReference);
+
+    for (Index::LookupMode mode : {Index::LookupMode::Learned, Index::LookupMode::Interpolation}) {
+        index.setLookupMode(mode);
+        for (size_t ii = 0; ii < datasetSize; ++ii) {
+            auto result = index.find(values[ii]);
+            BOOST_REQUIRE(result);
+            BOOST_CHECK_EQUAL(values[result.get().second], values[ii]);
+        }
+        BOOST_CHECK(!index.find(-1));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(rmi_compact_leaves_test) {
+    for (float value : {0.0f, 1.0f, -2.5f, 1000.0f, 65504.0f, 1e-6f, 0.1f}) {
+        float roundTrip = halfToFloat(floatToHalf(value));
+        BOOST_CHECK_CLOSE(roundTrip + 1.0f, value + 1.0f, 0.1);
+    }
+    BOOST_CHECK(std::isinf(halfToFloat(floatToHalf(1e6f))));
+
+    const size_t datasetSize = 2000;
+    auto values = getIntegerLognormals<int, datasetSize>(1e6);
+    typedef RecursiveModelIndex<int, int, 16> Index;
+    Index index(getFirstStageParams(), getSecondStageParams(), 256, 1e6);
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        index.insert(values[ii], static_cast<int>(ii));
+    }
+    index.setCompactLeaves(true);
+    index.train();
+    index.setLookupMode(Index::LookupMode::Learned);
+
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        auto result = index.find(values[ii]);
+        BOOST_REQUIRE(result);
+        BOOST_CHECK_EQUAL(values[result.get().second], values[ii]);
+    }
+    BOOST_CHECK(!index.find(-1));
+
+    // Toggling after training rebuilds (or drops) the table in place
+    index.setCompactLeaves(false);
+    index.setCompactLeaves(true);
+    for (size_t ii = 0; ii < datasetSize; ii += 7) {
+        BOOST_CHECK(index.find(values[ii]));
+        BOOST_CHECK_EQUAL(index.distinctKeyAt(index.lowerBound(values[ii])), values[ii]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(rmi_payload_arena_test) {
+    const size_t datasetSize = 2000;
+    auto values = getIntegerLognormals<int, datasetSize>(1e6);
+
+    // 200 byte payloads live in the arena, the index only sorts and returns 12 byte handles
+    PayloadArena arena(4096);
+    std::vector<std::string> payloads;
+    RecursiveModelIndex<int, PayloadRef, 16> index(getFirstStageParams(), getSecondStageParams(), 256, 1e6);
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        payloads.push_back(std::string(200, static_cast<char>('a' + ii % 26)) + std::to_string(ii));
+        index.insert(values[ii], arena.append(payloads.back()));
+    }
+    index.train();
+
+    std::string pending(5000, 'p');
+    index.insert(-5, arena.append(pending));
+    BOOST_REQUIRE(index.findRef(-5));
+    BOOST_CHECK_EQUAL(arena.view(*index.findRef(-5)).toString(), pending);
+
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        const PayloadRef *ref = index.findRef(values[ii]);
+        BOOST_REQUIRE(ref);
+
+        // Duplicate keys resolve to the first insert, same as find()
+        size_t first = std::find(values.begin(), values.end(), values[ii]) - values.begin();
+        PayloadView view = arena.view(*ref);
+        BOOST_CHECK_EQUAL(std::string(view.data, view.size), payloads[first]);
+        BOOST_CHECK_EQUAL(index.find(values[ii]).get().second.offset, ref->offset);
+    }
+    BOOST_CHECK(!index.findRef(-1));
+}
+
+BOOST_AUTO_TEST_CASE(rmi_hot_key_cache_test) {
+    HotKeyCache<uint64_t> cache;
+    BOOST_CHECK_EQUAL(cache.lookup(1), HotKeyCache<uint64_t>::notFound);
+    cache.resize(3);
+    BOOST_CHECK_EQUAL(cache.sizeInBytes(), 4 * 64);
+
+    // Far more keys than ways, the most recent ones of each bucket must survive
+    for (uint64_t key = 0; key < 1000; ++key) {
+        cache.store(key, key * 2);
+    }
+    size_t hits = 0;
+    for (uint64_t key = 0; key < 1000; ++key) {
+        uint32_t position = cache.lookup(key);
+        if (position != HotKeyCache<uint64_t>::notFound) {
+            BOOST_CHECK_EQUAL(position, key * 2);
+            hits++;
+        }
+    }
+    BOOST_CHECK(hits > 0 && hits <= 4 * 5);
+    cache.store(5000, 1);
+    cache.invalidate(5000);
+    BOOST_CHECK_EQUAL(cache.lookup(5000), HotKeyCache<uint64_t>::notFound);
+
+    const size_t datasetSize = 2000;
+    auto values = getIntegerLognormals<int, datasetSize>(1e6);
+    RecursiveModelIndex<int, int, 16> index(getFirstStageParams(), getSecondStageParams(), 256, 1e6);
+    index.setHotKeyCache(64);
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        index.insert(values[ii], static_cast<int>(ii));
+    }
+    index.train();
+
+    // Zipf like: the first few keys are looked up over and over, hits must match misses
+    for (size_t round = 0; round < 3; ++round) {
+        for (size_t ii = 0; ii < datasetSize; ii += 1 + ii / 8) {
+            auto result = index.find(values[ii]);
+            BOOST_REQUIRE(result);
+            BOOST_CHECK_EQUAL(values[result.get().second], values[ii]);
+            BOOST_CHECK_EQUAL(*index.findRef(values[ii]), result.get().second);
+        }
+    }
+
+    // An insert of a cached key must be seen straight away, as must a retrain
+    int hotKey = values[0];
+    int firstValue = index.find(hotKey).get().second;
+    index.insert(hotKey, -7);
+    BOOST_CHECK_EQUAL(index.find(hotKey).get().second, -7);
+    index.train();
+    BOOST_CHECK_EQUAL(index.find(hotKey).get().second, firstValue);
+    BOOST_CHECK_EQUAL(index.equalRange(hotKey).back(), -7);
+}
+
+BOOST_AUTO_TEST_CASE(rmi_boundary_routing_test) {
+    const size_t datasetSize = 2000;
+    auto values = getIntegerLognormals<int, datasetSize>(1e6);
+
+    typedef RecursiveModelIndex<int, int, 16> Index;
+    Index index(getFirstStageParams(), getSecondStageParams(), 256, 1e6);
+    index.setRoutingMode(Index::RoutingMode::BoundaryTable);
+    index.setCompactLeaves(true);
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        index.insert(values[ii], static_cast<int>(ii));
+    }
+    index.train();
+    index.setLookupMode(Index::LookupMode::Learned);
+
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        auto result = index.find(values[ii]);
+        BOOST_REQUIRE(result);
+        BOOST_CHECK_EQUAL(values[result.get().second], values[ii]);
+    }
+
+    // Every key routes to the leaf owning its range, so absent keys get exact lower bounds too
+    std::vector<int> distinct(values.begin(), values.end());
+    std::sort(distinct.begin(), distinct.end());
+    distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+    for (int probe = -5; probe < distinct.back() + 5; probe += 37) {
+        size_t expected = std::lower_bound(distinct.begin(), distinct.end(), probe) - distinct.begin();
+        BOOST_CHECK_EQUAL(index.lowerBound(probe), expected);
+    }
+    BOOST_CHECK(!index.find(-1));
+    BOOST_CHECK(!index.find(distinct.back() + 1));
+}
+
+BOOST_AUTO_TEST_CASE(rmi_interleaved_lookups_test) {
+    const size_t datasetSize = 2000;
+    auto values = getIntegerLognormals<int, datasetSize>(1e6);
+
+    typedef RecursiveModelIndex<int, int, 16> Index;
+    Index index(getFirstStageParams(), getSecondStageParams(), 256, 1e6);
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        index.insert(values[ii], static_cast<int>(ii));
+    }
+    index.train();
+    index.insert(-3, -3);
+
+    std::vector<int> keys(values.begin(), values.end());
+    keys.push_back(-3);
+    keys.push_back(-1);
+
+    for (Index::LookupMode mode : {Index::LookupMode::Learned, Index::LookupMode::Interpolation}) {
+        index.setLookupMode(mode);
+        for (size_t inFlight : {1, 7, 64}) {
+            auto results = findInterleaved(index, keys, inFlight);
+            BOOST_REQUIRE_EQUAL(results.size(), keys.size());
+            for (size_t ii = 0; ii < keys.size(); ++ii) {
+                auto expected = index.find(keys[ii]);
+                BOOST_REQUIRE_EQUAL(static_cast<bool>(results[ii]), static_cast<bool>(expected));
+                if (expected) {
+                    BOOST_CHECK_EQUAL(results[ii].get().second, expected.get().second);
+                }
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(rmi_frozen_index_test) {
+    const size_t datasetSize = 2000;
+    auto values = getIntegerLognormals<int, datasetSize>(1e6);
+
+    RecursiveModelIndex<int, int, 16> index(getFirstStageParams(), getSecondStageParams(), 256, 1e6);
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        index.insert(values[ii], static_cast<int>(ii));
+    }
+    index.train();
+
+    typedef FrozenIndex<int, int> Frozen;
+    const std::string path = "rmi_frozen_index_test.idx";
+    const std::string segment = "/rmi_frozen_index_test";
+    BOOST_REQUIRE(Frozen::publishFile(index, path));
+    BOOST_REQUIRE(Frozen::publishShared(index, segment));
+
+    Frozen fromFile;
+    Frozen fromShared;
+    Frozen fromBuffer;
+    BOOST_REQUIRE(fromFile.attachFile(path));
+    BOOST_REQUIRE(fromShared.attachShared(segment));
+    BOOST_REQUIRE(fromBuffer.attachBuffer(Frozen::freeze(index)));
+
+    // Lookups run alongside the prefault
+    fromFile.prefaultInBackground();
+
+    // Published data is immutable, later inserts only reach the next publish
+    index.insert(-3, -3);
+
+    for (const Frozen *frozen : {&fromFile, &fromShared, &fromBuffer}) {
+        BOOST_REQUIRE_EQUAL(frozen->size(), index.trainedSize());
+        BOOST_REQUIRE_EQUAL(frozen->distinctSize(), index.distinctSize());
+        for (size_t ii = 0; ii < datasetSize; ++ii) {
+            const int *value = frozen->findRef(values[ii]);
+            BOOST_REQUIRE(value);
+            BOOST_CHECK_EQUAL(*value, *index.findRef(values[ii]));
+            BOOST_CHECK_EQUAL(frozen->lowerBound(values[ii] + 1), index.lowerBound(values[ii] + 1));
+        }
+        BOOST_CHECK(!frozen->find(-3));
+        BOOST_CHECK_EQUAL(frozen->lowerBound(-3), 0);
+    }
+
+    // Types must match what was published
+    FrozenIndex<float, int> mismatched;
+    BOOST_CHECK(!mismatched.attachFile(path));
+
+    // Truncated blocks and headers whose counts don't match their sections are rejected
+    std::vector<char> truncated = Frozen::freeze(index);
+    truncated.resize(truncated.size() / 2);
+    BOOST_CHECK(!fromBuffer.attachBuffer(std::move(truncated)));
+    std::vector<char> corrupt = Frozen::freeze(index);
+    corrupt[32] ^= 0x40;  // numKeys, after the magic, four uint32 fields and numLeaves
+    BOOST_CHECK(!fromBuffer.attachBuffer(std::move(corrupt)));
+
+    ::shm_unlink(segment.c_str());
+    std::remove(path.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(rmi_imported_weights_test) {
+    const size_t datasetSize = 2000;
+    const int numLeaves = 16;
+    auto values = getIntegerLognormals<int, datasetSize>(1e6);
+
+    std::vector<int> keys(values.begin(), values.end());
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    const float numKeys = static_cast<float>(keys.size());
+    const float maxInput = static_cast<float>(keys.back() - keys.front());
+
+    // Stand in for offline training: a one neuron root that routes by key, and a least squares line per leaf
+    ModelWeights weights;
+    weights.hiddenWeights = {1.0f / maxInput};
+    weights.hiddenBiases = {0.0f};
+    weights.outputWeights = {1.0f};
+    weights.outputBias = 0.0f;
+
+    std::vector<std::vector<size_t>> leafPositions(numLeaves);
+    for (size_t ii = 0; ii < keys.size(); ++ii) {
+        int stage = static_cast<int>(weights.evaluateRoot(static_cast<float>(keys[ii] - keys.front())) * numLeaves);
+        leafPositions[std::min(numLeaves - 1, stage)].push_back(ii);
+    }
+    for (const auto &positions : leafPositions) {
+        LinearModel line;
+        if (!positions.empty()) {
+            line.fit(positions.begin(), positions.end(), [&](size_t position) {
+                return static_cast<float>(keys[position] - keys.front());
+            });
+            line.intercept += positions.front();
+        }
+        weights.leaves.push_back({line.slope / numKeys, line.intercept / numKeys});
+    }
+
+    const std::string path = "rmi_imported_weights_test.bin";
+    BOOST_REQUIRE(weights.write(path));
+
+    typedef RecursiveModelIndex<int, int, numLeaves> Index;
+    Index index(getFirstStageParams(), getSecondStageParams(), 1 << 20, 1e6);
+    BOOST_REQUIRE(index.importWeights(path));
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        index.insert(values[ii], static_cast<int>(ii));
+    }
+    index.train();
+    index.setLookupMode(Index::LookupMode::Learned);
+
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        auto result = index.find(values[ii]);
+        BOOST_REQUIRE(result);
+        BOOST_CHECK_EQUAL(result.get().first, values[ii]);
+    }
+    BOOST_CHECK(!index.find(-1));
+
+    // Leaf counts must match, and files must be complete
+    RecursiveModelIndex<int, int, 8> smaller(getFirstStageParams(), getSecondStageParams());
+    BOOST_CHECK(!smaller.importWeights(weights));
+    ModelWeights mismatched = weights;
+    mismatched.outputWeights.push_back(0.0f);
+    BOOST_CHECK(!index.importWeights(mismatched));
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << "LIDXWTS1";
+    BOOST_CHECK(!index.importWeights(path));
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << "LIDXWTS1" << std::string(8, '\xff');
+    BOOST_CHECK(!index.importWeights(path));
+    std::remove(path.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(rmi_frozen_warmup_test) {
+    const size_t datasetSize = 2000;
+    auto values = getIntegerLognormals<int, datasetSize>(1e6);
+
+    RecursiveModelIndex<int, int, 16> index(getFirstStageParams(), getSecondStageParams(), 256, 1e6);
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        index.insert(values[ii], static_cast<int>(ii));
+    }
+    index.train();
+
+    typedef FrozenIndex<int, int> Frozen;
+    const std::string path = "rmi_frozen_warmup_test.idx";
+    const std::string statisticsPath = "rmi_frozen_warmup_test.hot";
+    BOOST_REQUIRE(Frozen::publishFile(index, path));
+
+    // Record a skewed workload on one replica and save its hot ranges
+    Frozen replica;
+    BOOST_REQUIRE(replica.attachFile(path));
+    AccessStatistics<int> statistics(64);
+    replica.recordAccesses(&statistics);
+    const int hotKey = index.distinctKeyAt(index.distinctSize() / 2);
+    for (int ii = 0; ii < 100; ++ii) {
+        BOOST_REQUIRE(replica.findRef(hotKey));
+    }
+    BOOST_REQUIRE(replica.findRef(values[0]));
+    replica.recordAccesses(nullptr);
+
+    auto hottest = replica.hottestRanges(statistics, 1);
+    BOOST_REQUIRE_EQUAL(hottest.size(), 1);
+    BOOST_CHECK(hottest[0].first <= hotKey && hotKey <= hottest[0].last);
+    BOOST_CHECK_EQUAL(hottest[0].hits, 100);
+    BOOST_REQUIRE(AccessStatistics<int>::save(statisticsPath, replica.hottestRanges(statistics, 8)));
+
+    // Warm a fresh replica from them
+    Frozen fresh;
+    BOOST_REQUIRE(fresh.attachFile(path));
+    Frozen::WarmupPolicy policy;
+    policy.allKeys = true;
+    policy.numThreads = 3;
+    BOOST_REQUIRE(AccessStatistics<int>::load(statisticsPath, policy.hotRanges));
+    BOOST_CHECK_EQUAL(policy.hotRanges.size(), 2);
+
+    // Progress comes from the warmup threads, so only check it once they're done
+    size_t lastProgress = 0;
+    size_t progressTotal = 0;
+    bool progressIncreases = true;
+    policy.onProgress = [&](size_t done, size_t total) {
+        progressIncreases = progressIncreases && done > lastProgress && done <= total;
+        lastProgress = done;
+        progressTotal = total;
+    };
+    size_t touched = fresh.warmup(policy);
+    BOOST_CHECK(touched > 0);
+    BOOST_CHECK(progressIncreases);
+    BOOST_CHECK_EQUAL(touched, progressTotal);
+    BOOST_CHECK(fresh.find(hotKey));
+
+    std::remove(path.c_str());
+    std::remove(statisticsPath.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(rmi_snapshot_index_test) {
+    const size_t datasetSize = 2000;
+    auto values = getIntegerLognormals<int, datasetSize>(1e6);
+
+    typedef SnapshotIndex<int, int, 16> Index;
+    Index index(getFirstStageParams(), getSecondStageParams(), 256, 16);
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        index.insert(values[ii], static_cast<int>(ii));
+    }
+    index.publish();
+    BOOST_CHECK_EQUAL(index.getSequence(), datasetSize);
+
+    Index::Snapshot before = index.snapshot();
+    index.insert({{-1, -1}, {-2, -2}});
+    Index::Snapshot after = index.snapshot();
+    index.publish();
+    Index::Snapshot published = index.snapshot();
+
+    // Old snapshots keep their view across inserts and a retrain, and pin their version
+    BOOST_CHECK(!before.find(-1));
+    BOOST_CHECK_EQUAL(after.find(-2).get().second, -2);
+    BOOST_CHECK_EQUAL(published.find(-1).get().second, -1);
+    BOOST_CHECK_EQUAL(before.getSequence(), datasetSize);
+    BOOST_CHECK_EQUAL(published.getSequence(), datasetSize + 2);
+    for (size_t ii = 0; ii < datasetSize; ii += 7) {
+        BOOST_CHECK(before.find(values[ii]));
+        BOOST_CHECK(published.find(values[ii]));
+    }
+    BOOST_CHECK(index.retiredVersions() > 0);
+
+    before = index.snapshot();
+    after = index.snapshot();
+    index.publish();
+    BOOST_CHECK_EQUAL(index.retiredVersions(), 1);
+
+    // Concurrent readers must see each batch entirely or not at all
+    const int numBatches = 200;
+    const int batchSize = 5;
+    std::atomic<bool> done(false);
+    std::atomic<bool> torn(false);
+    std::vector<std::thread> readers;
+    for (int reader = 0; reader < 3; ++reader) {
+        readers.emplace_back([&]() {
+            while (!done) {
+                Index::Snapshot view = index.snapshot();
+                for (int batch = 0; batch < numBatches; ++batch) {
+                    int visible = 0;
+                    for (int ii = 0; ii < batchSize; ++ii) {
+                        visible += view.find(-10 - batch * batchSize - ii) ? 1 : 0;
+                    }
+                    if (visible != 0 && visible != batchSize) {
+                        torn = true;
+                    }
+                }
+            }
+        });
+    }
+    for (int batch = 0; batch < numBatches; ++batch) {
+        std::vector<std::pair<int, int>> pairs;
+        for (int ii = 0; ii < batchSize; ++ii) {
+            pairs.push_back({-10 - batch * batchSize - ii, batch});
+        }
+        index.insert(pairs);
+        if (batch == numBatches / 2) {
+            index.publish();
+        }
+    }
+    done = true;
+    for (auto &reader : readers) {
+        reader.join();
+    }
+    BOOST_CHECK(!torn);
+    BOOST_CHECK_EQUAL(index.snapshot().find(-10 - (numBatches - 1) * batchSize).get().second, numBatches - 1);
+}
+
+BOOST_AUTO_TEST_CASE(rmi_snapshot_forked_retrain_test) {
+    const size_t datasetSize = 2000;
+    auto values = getIntegerLognormals<int, datasetSize>(1e6);
+
+    typedef SnapshotIndex<int, int, 16> Index;
+    Index index(getFirstStageParams(), getSecondStageParams(), 256, 16);
+    index.setRetrainStrategy(Index::RetrainStrategy::ForkedChild, ".");
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        index.insert(values[ii], static_cast<int>(ii));
+    }
+    index.publish();
+    index.insert(-1, -1);
+
+    Index::Snapshot view = index.snapshot();
+    BOOST_CHECK_EQUAL(view.getSequence(), datasetSize + 1);
+    BOOST_CHECK_EQUAL(view.find(-1).get().second, -1);
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        BOOST_REQUIRE(view.find(values[ii]));
+    }
+
+    // A child that can't write its file falls back to training in process
+    index.setRetrainStrategy(Index::RetrainStrategy::ForkedChild, "/nonexistent_directory");
+    index.publish();
+    Index::Snapshot fallback = index.snapshot();
+    BOOST_CHECK_EQUAL(fallback.find(-1).get().second, -1);
+    BOOST_CHECK(fallback.find(values[0]));
+}
+
+BOOST_AUTO_TEST_CASE(rmi_drift_detector_test) {
+    const int datasetSize = 2000;
+    const int numLeaves = 16;
+    const int maxKey = 10 * (datasetSize - 1);
+
+    // Evenly spaced keys under an exact linear root and leaves, so routing is known up front
+    ModelWeights weights;
+    weights.hiddenWeights = {1.0f / (10.0f * datasetSize)};
+    weights.hiddenBiases = {0.0f};
+    weights.outputWeights = {1.0f};
+    weights.outputBias = 0.0f;
+    weights.leaves.assign(numLeaves, {1.0f / (10.0f * datasetSize), 0.0f});
+
+    typedef RecursiveModelIndex<int, int, numLeaves> Index;
+    Index index(getFirstStageParams(), getSecondStageParams(), 256, 1e6);
+    BOOST_REQUIRE(index.importWeights(weights));
+    index.setDriftTracking(256);
+    for (int ii = 0; ii < datasetSize; ++ii) {
+        index.insert(10 * ii, ii);
+    }
+    index.train();
+    index.setLookupMode(Index::LookupMode::Learned);
+
+    Index::DriftReport report = index.measureDrift();
+    BOOST_CHECK(report.recommendation == DriftRecommendation::NoOp);
+    BOOST_CHECK_EQUAL(report.insertsSinceTraining, 0);
+    BOOST_CHECK_EQUAL(report.leafScores.size(), numLeaves);
+
+    // Appending past the largest key only grows the last leaf, the root still routes correctly
+    for (int ii = 1; ii <= 100; ++ii) {
+        index.insert(maxKey + ii, -ii);
+    }
+    report = index.measureDrift();
+    BOOST_CHECK(report.recommendation == DriftRecommendation::RetrainLeaves);
+    BOOST_CHECK_EQUAL(report.insertsSinceTraining, 100);
+    BOOST_CHECK_SMALL(report.rootDrift, 0.01f);
+    BOOST_CHECK_GT(report.leafScores[numLeaves - 1], 0.5f);
+    BOOST_REQUIRE_EQUAL(report.driftedLeaves.size(), 1);
+    BOOST_CHECK_EQUAL(report.driftedLeaves[0], numLeaves - 1);
+
+    size_t generation = index.getTrainingGeneration();
+    index.trainLeaves(report.driftedLeaves);
+    BOOST_CHECK_EQUAL(index.getTrainingGeneration(), generation + 1);
+    for (int ii = 0; ii < datasetSize; ++ii) {
+        BOOST_REQUIRE_EQUAL(index.find(10 * ii).get().second, ii);
+    }
+    for (int ii = 1; ii <= 100; ++ii) {
+        BOOST_CHECK_EQUAL(index.find(maxKey + ii).get().second, -ii);
+    }
+    BOOST_CHECK(index.measureDrift().recommendation == DriftRecommendation::NoOp);
+
+    // A mass of keys below everything shifts every rank, but the root sends them all to leaf 0
+    for (int ii = 1; ii <= 3000; ++ii) {
+        index.insert(-ii, ii);
+    }
+    report = index.measureDrift();
+    BOOST_CHECK(report.recommendation == DriftRecommendation::RetrainRoot);
+    BOOST_CHECK_GT(report.rootDrift, 0.5f);
+
+    index.clearImportedWeights();
+    index.train();
+    BOOST_CHECK(index.measureDrift().recommendation == DriftRecommendation::NoOp);
+    BOOST_CHECK_EQUAL(index.find(-3000).get().second, 3000);
+    BOOST_CHECK_EQUAL(index.find(maxKey + 100).get().second, -100);
+}
+
+BOOST_AUTO_TEST_CASE(rmi_explain_test) {
+    const size_t datasetSize = 2000;
+    const int numLeaves = 16;
+    auto values = getIntegerLognormals<int, datasetSize>(1e6);
+
+    typedef RecursiveModelIndex<int, int, numLeaves> Index;
+    Index index(getFirstStageParams(), getSecondStageParams(), 256, 1e6);
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        index.insert(values[ii], static_cast<int>(ii));
+    }
+    index.train();
+    index.setLookupMode(Index::LookupMode::Learned);
+    index.insert(-1, -1);
+    index.insert(-2, -2);
+
+    Index::LookupExplanation pending = index.explain(-1);
+    BOOST_CHECK(pending.found && pending.foundPending);
+    BOOST_CHECK_EQUAL(pending.pendingProbes, 1);
+    Index::LookupExplanation missing = index.explain(-3);
+    BOOST_CHECK(!missing.found);
+    BOOST_CHECK_EQUAL(missing.pendingProbes, 2);
+
+    double windowComparisons = 0;
+    size_t windowServed = 0;
+    for (size_t ii = 0; ii < index.distinctSize(); ++ii) {
+        int key = index.distinctKeyAt(ii);
+        Index::LookupExplanation explanation = index.explain(key);
+        BOOST_REQUIRE(explanation.found);
+        BOOST_CHECK(explanation.usedModels && !explanation.foundPending);
+        BOOST_CHECK_EQUAL(explanation.pendingProbes, 2);
+        BOOST_CHECK(explanation.leaf >= 0 && explanation.leaf < numLeaves);
+        BOOST_CHECK(explanation.rootPrediction == explanation.rootPrediction);
+        BOOST_CHECK_GT(explanation.comparisons, 0);
+        if (!explanation.usedTree) {
+            BOOST_CHECK(explanation.window.first <= ii && ii < explanation.window.second);
+            windowComparisons += explanation.comparisons;
+            windowServed++;
+        }
+    }
+
+    // Windows clamped at the ends of the data can only make lookups cheaper than the model expects
+    Index::LookupCostModel model = index.costModel();
+    BOOST_CHECK_EQUAL(model.pendingProbes, 2);
+    size_t routedKeys = 0;
+    for (size_t leafSize : model.leafSizes) {
+        routedKeys += leafSize;
+    }
+    BOOST_CHECK_EQUAL(routedKeys, index.distinctSize());
+    BOOST_CHECK_GT(model.expectedComparisons, 0.0);
+    if (windowServed == index.distinctSize()) {
+        BOOST_CHECK_LE(windowComparisons / windowServed, model.expectedComparisons + 1.0);
+    }
+
+    index.setLookupMode(Index::LookupMode::Interpolation);
+    Index::LookupExplanation interpolated = index.explain(values[0]);
+    BOOST_CHECK(interpolated.found && !interpolated.usedModels);
+    BOOST_CHECK_EQUAL(interpolated.leaf, -1);
+    BOOST_CHECK_GT(interpolated.comparisons, 0);
+    BOOST_CHECK(index.costModel().leafSizes.empty());
+}
+
+BOOST_AUTO_TEST_CASE(rmi_fanout_policy_test) {
+    const size_t datasetSize = 2000;
+    auto values = getIntegerLognormals<int, datasetSize>(1e6);
+    const int maxKey = *std::max_element(values.begin(), values.end());
+
+    typedef RecursiveModelIndex<int, int, 4> Index;
+    Index index(getFirstStageParams(), getSecondStageParams(), 256, 1e6);
+    index.setFanoutPolicy(Index::FanoutPolicy(Index::FanoutPolicy::Mode::KeysPerLeaf, 250));
+    index.setLookupMode(Index::LookupMode::Learned);
+    BOOST_CHECK_EQUAL(index.getNumLeaves(), 4);
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        index.insert(values[ii], static_cast<int>(ii));
+    }
+    index.train();
+    const int smallLeaves = index.getNumLeaves();
+    BOOST_CHECK_EQUAL(smallLeaves, static_cast<int>((index.distinctSize() + 249) / 250));
+
+    // Growing the table grows the fanout with it
+    for (int ii = 1; ii <= 2000; ++ii) {
+        index.insert(maxKey + 7 * ii, -ii);
+    }
+    index.train();
+    BOOST_CHECK_EQUAL(index.getNumLeaves(), static_cast<int>((index.distinctSize() + 249) / 250));
+    BOOST_CHECK_GT(index.getNumLeaves(), smallLeaves);
+    BOOST_CHECK_EQUAL(index.getLeafStarts().size(), index.getNumLeaves() + 1);
+    BOOST_CHECK_EQUAL(index.costModel().leafSizes.size(), index.getNumLeaves());
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        BOOST_REQUIRE(index.find(values[ii]));
+    }
+    BOOST_CHECK_EQUAL(index.find(maxKey + 7 * 2000).get().second, -2000);
+
+    index.setFanoutPolicy(Index::FanoutPolicy(Index::FanoutPolicy::Mode::KeysPerLeaf, 1, 1, 10));
+    index.train();
+    BOOST_CHECK_EQUAL(index.getNumLeaves(), 10);
+    BOOST_CHECK(index.find(values[0]));
+
+    // A target window scales the leaves by the window the last training measured, grown with the data
+    Index windowed(getFirstStageParams(), getSecondStageParams(), 256, 1e6);
+    windowed.setFanoutPolicy(Index::FanoutPolicy(Index::FanoutPolicy::Mode::TargetWindow, 8));
+    windowed.setLookupMode(Index::LookupMode::Learned);
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        windowed.insert(values[ii], static_cast<int>(ii));
+    }
+    windowed.train();
+    BOOST_CHECK_EQUAL(windowed.getNumLeaves(), 4);
+    const double window = windowed.costModel().averageWindow;
+    const double trainedKeys = windowed.distinctSize();
+    for (int ii = 1; ii <= 2000; ++ii) {
+        windowed.insert(maxKey + 7 * ii, -ii);
+    }
+    windowed.train();
+    if (window > 0) {
+        double expected = std::ceil(4 * window * windowed.distinctSize() / trainedKeys / 8);
+        BOOST_CHECK_LE(std::abs(windowed.getNumLeaves() - std::max(1.0, expected)), 1.0);
+    }
+    BOOST_CHECK(windowed.find(values[0]));
+}
+
+BOOST_AUTO_TEST_CASE(rmi_sparse_blocks_test) {
+    const size_t datasetSize = 4000;
+    const size_t blockSize = 64;
+    auto values = getIntegerLognormals<int, datasetSize>(1e6);
+
+    typedef RecursiveModelIndex<int, int, 8> Index;
+    Index index(getFirstStageParams(), getSecondStageParams(), 256, 1e6);
+    index.setSparseBlocks(blockSize);
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        index.insert(values[ii], static_cast<int>(ii));
+    }
+    index.train();
+    index.setLookupMode(Index::LookupMode::Learned);
+
+    std::vector<int> keys;
+    for (size_t ii = 0; ii < index.distinctSize(); ++ii) {
+        keys.push_back(index.distinctKeyAt(ii));
+    }
+    for (size_t ii = 0; ii < keys.size(); ++ii) {
+        BOOST_REQUIRE(index.find(keys[ii]));
+        BOOST_CHECK_EQUAL(index.find(keys[ii]).get().first, keys[ii]);
+
+        // Only the block the key lands in is searched
+        Index::LookupExplanation explanation = index.explain(keys[ii]);
+        BOOST_CHECK(explanation.found && !explanation.usedTree);
+        BOOST_CHECK_LE(explanation.window.second - explanation.window.first, blockSize);
+    }
+
+    // Keys between the modelled ones, and around the ends
+    for (int probe : {keys.front() - 1, keys.back() + 1, keys[100] + 1, keys[blockSize] - 1, keys[2 * blockSize]}) {
+        size_t expected = std::lower_bound(keys.begin(), keys.end(), probe) - keys.begin();
+        BOOST_CHECK_EQUAL(index.lowerBound(probe), expected);
+    }
+    BOOST_CHECK(!index.find(keys.back() + 1));
+
+    auto sorted = index.findSorted(keys);
+    auto interleaved = findInterleaved(index, keys);
+    for (size_t ii = 0; ii < keys.size(); ++ii) {
+        BOOST_REQUIRE(sorted[ii] && interleaved[ii]);
+        BOOST_CHECK_EQUAL(sorted[ii].get().first, keys[ii]);
+        BOOST_CHECK_EQUAL(interleaved[ii].get().first, keys[ii]);
+    }
+    BOOST_CHECK_GT(index.costModel().expectedComparisons, 0.0);
+
+    // Retraining some leaves re-cuts the blocks over the merged keys
+    for (int ii = 1; ii <= 100; ++ii) {
+        index.insert(keys.back() + ii, -ii);
+    }
+    index.trainLeaves({7});
+    for (size_t ii = 0; ii < keys.size(); ++ii) {
+        BOOST_REQUIRE(index.find(keys[ii]));
+    }
+    BOOST_CHECK_EQUAL(index.find(keys.back() + 100).get().second, -100);
+}
+
+BOOST_AUTO_TEST_CASE(rmi_sparse_blocks_many_leaves_test) {
+    const size_t datasetSize = 8000;
+    const int numLeaves = 128;
+    auto values = getIntegerLognormals<int, datasetSize>(1e6);
+    const int minKey = *std::min_element(values.begin(), values.end());
+    const float maxInput = static_cast<float>(*std::max_element(values.begin(), values.end()) - minKey);
+
+    // A root linear in the key spreads the long tail over many leaves, while its few block first
+    // keys land in only some of them, so many keys route to leaves that got no block first key
+    ModelWeights weights;
+    weights.hiddenWeights = {1.0f / maxInput};
+    weights.hiddenBiases = {0.0f};
+    weights.outputWeights = {1.0f};
+    weights.outputBias = 0.0f;
+    weights.leaves.assign(numLeaves, {1.0f / maxInput, 0.0f});
+
+    typedef RecursiveModelIndex<int, int, numLeaves> Index;
+    Index index(getFirstStageParams(), getSecondStageParams(), 256, 1e6);
+    BOOST_REQUIRE(index.importWeights(weights));
+    index.setSparseBlocks(64);
+    for (size_t ii = 0; ii < datasetSize; ++ii) {
+        index.insert(values[ii], static_cast<int>(ii));
+    }
+    index.train();
+    index.setLookupMode(Index::LookupMode::Learned);
+
+    std::vector<int> keys;
+    for (size_t ii = 0; ii < index.distinctSize(); ++ii) {
+        keys.push_back(index.distinctKeyAt(ii));
+    }
+    auto sorted = index.findSorted(keys);
+    auto interleaved = findInterleaved(index, keys);
+    for (size_t ii = 0; ii < keys.size(); ++ii) {
+        BOOST_REQUIRE(index.find(keys[ii]));
+        BOOST_REQUIRE(index.explain(keys[ii]).found);
+        BOOST_REQUIRE(sorted[ii] && interleaved[ii]);
+        BOOST_CHECK_EQUAL(sorted[ii].get().first, keys[ii]);
+        BOOST_CHECK_EQUAL(interleaved[ii].get().first, keys[ii]);
+        BOOST_CHECK_EQUAL(index.lowerBound(keys[ii]), ii);
+    }
+    BOOST_CHECK_GT(index.costModel().expectedComparisons, 0.0);
+}